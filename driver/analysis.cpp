@@ -18,6 +18,7 @@
 #include <inttypes.h>
 #include <math.h>
 
+#include <algorithm>
 #include <deque>
 #include <list>
 #include <optional>
@@ -27,6 +28,7 @@
 #include "logging.h"
 #include "mathlib.h"
 #include "metamargin.h"
+#include "score-surface.h"
 #include "utility.h"
 
 namespace stone {
@@ -38,26 +40,29 @@ static constexpr double kSenateMinError = 3.5;
 static constexpr double kGovernorMinError = 6.0;
 static constexpr double kHouseMinError = 8.0;
 
-Analysis::Analysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data)
-  : cx_(cx), cc_(cc), feed_(feed), data_(data)
+Analysis::Analysis(Context* cx, Campaign* cc, const Feed* feed, const FeedIndex* index,
+                   PollTable* poll_table, ModelData* data)
+  : cx_(cx), cc_(cc), feed_(feed), index_(index), poll_table_(poll_table), data_(data)
 {
 }
 
-StateAnalysis::StateAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data)
-  : Analysis(cx, cc, feed, data)
+StateAnalysis::StateAnalysis(Context* cx, Campaign* cc, const Feed* feed,
+                             const FeedIndex* index, PollTable* poll_table, ModelData* data)
+  : Analysis(cx, cc, feed, index, poll_table, data)
 {
 }
 
 void
-StateAnalysis::Analyze()
+StateAnalysis::AnalyzeNational()
 {
     if (!feed_->generic_ballot_polls().empty() && cc_->election_type() != "runoff") {
         RaceModel& model = *data_->mutable_generic_ballot();
         model.set_race_id(0);
         model.set_race_type(Race::GENERIC_BALLOT);
 
-        Analysis::FindRecentPolls(feed_->generic_ballot_polls(), model.mutable_polls());
-        ComputePollModelStats(&model);
+        PollSelection polls;
+        Analysis::FindRecentPolls(feed_->generic_ballot_polls(), &polls);
+        ComputePollModelStats(&model, polls);
 
         // Undecideds will either be from generic ballot polls, or the Campaign.
         data_->set_undecideds(model.undecideds());
@@ -71,13 +76,21 @@ StateAnalysis::Analyze()
         model.set_race_id(0);
         model.set_race_type(Race::NATIONAL);
 
-        Analysis::FindRecentPolls(feed_->national_polls(), model.mutable_polls());
-        ComputePollModelStats(&model);
+        PollSelection polls;
+        Analysis::FindRecentPolls(feed_->national_polls(), &polls);
+        ComputePollModelStats(&model, polls);
 
         // Undecideds will either be from national polls, or the generic ballot,
         // or the Campaign.
         data_->set_undecideds(model.undecideds());
     }
+}
+
+void
+StateAnalysis::Analyze()
+{
+    if (!cc_->IsPresidentialYear())
+        return;
 
     std::vector<std::pair<int, double>> state_p;
 
@@ -88,8 +101,7 @@ StateAnalysis::Analyze()
         state_model.set_race_id(state_models.size() - 1);
         state_model.set_race_type(Race::ELECTORAL_COLLEGE);
 
-        FindRecentPolls(state, &state_model);
-        ComputeState(&state_model);
+        ComputeState(state, &state_model);
 
         state_p.emplace_back(state.evs(), state_model.win_prob());
     }
@@ -104,10 +116,15 @@ StateAnalysis::Analyze()
 
     cv.CalcConfidence(data_->mutable_dem_ev_range());
 
-    auto bias_fn = GetBiasFn(cc_, data_);
+    ScoreSurface surface(GetRaceArray(cc_, data_));
     int ev_needed = GetTiebreakerMajority(cc_->TotalEv());
 
-    MetamarginFinder mmf(std::move(bias_fn), ev_needed - 1, cv.FindMean(), cc_->TotalEv());
+    std::optional<double> hint;
+    if (prev_data_)
+        hint = {prev_data_->metamargin()};
+
+    MetamarginFinder mmf(surface.AsBiasFn(), ev_needed - 1, cv.FindMean(), cc_->TotalEv(),
+                         hint);
     data_->set_metamargin(mmf.metamargin);
 }
 
@@ -122,13 +139,17 @@ StateAnalysis::GetConvolverForBias(Campaign* cc, const ModelData* data, double b
     return Convolver(std::move(win_p));
 }
 
-std::function<int(double)>
-StateAnalysis::GetBiasFn(Campaign* cc, const ModelData* data)
+RaceArray
+StateAnalysis::GetRaceArray(Campaign* cc, const ModelData* data)
 {
-    return [cc, data](double bias) -> int {
-        Convolver bias_cv = StateAnalysis::GetConvolverForBias(cc, data, bias);
-        return bias_cv.FindMean();
-    };
+    RaceArray races;
+    for (const auto& state : data->states()) {
+        int index = (int)races.size();
+        int evs = cc->state_list()[index].evs();
+        races.Add(evs, state.mean(), state.stddev(),
+                  cc->GetRegion(Race::ELECTORAL_COLLEGE, index));
+    }
+    return races;
 }
 
 bool
@@ -140,37 +161,41 @@ StateAnalysis::GetScoreToWin(Campaign* cc, const ModelData*, int* score, int* of
 }
 
 void
-StateAnalysis::ComputeState(RaceModel* model)
+StateAnalysis::ComputeState(const State& state, RaceModel* model)
 {
-    ComputePollModelStats(model);
+    PollSelection polls;
+    if (auto iter = feed_->states().find(state.name()); iter != feed_->states().end())
+        Analysis::FindRecentPolls(iter->second.polls(), &polls);
+
+    // If there are no polls, fall back to the previous election's result.
+    // These polls are interned before analysis starts, since the poll table
+    // cannot grow while pages are being rendered from it.
+    if (polls.empty()) {
+        const auto& assumed = assumed_feed_->states();
+        auto iter = assumed.find(state.name());
+        if (iter == assumed.end()) {
+            Err() << "Could not find assumed margins for: " << state.name() << "";
+            abort();
+        }
+        polls.index = &assumed_index_->Get(iter->second.polls());
+        polls.rows.emplace_back(0, 1.0);
+    }
 
-    // Probability of dems winning.
-    model->set_win_prob(DemWinProb(*model));
+    ComputeRaceModel(model, polls);
 }
 
 void
-StateAnalysis::FindRecentPolls(const State& state, RaceModel* model)
+StateAnalysis::BuildAssumedFeed(Campaign* cc, Feed* out)
 {
-    if (auto iter = feed_->states().find(state.name()); iter != feed_->states().end())
-        Analysis::FindRecentPolls(iter->second.polls(), model->mutable_polls());
-
-    if (!model->polls().empty())
-        return;
-
-    auto iter = cc_->AssumedMargins().find(state.name());
-    if (iter == cc_->AssumedMargins().end()) {
-        Err() << "Could not find assumed margins for: " << state.name() << "";
-        abort();
+    for (const auto& [name, margins] : cc->AssumedMargins()) {
+        Poll* poll = (*out->mutable_states())[name].add_polls();
+        poll->set_description(std::to_string(cc->EndDate().year() - 4) + " election result");
+        poll->set_dem(margins.first);
+        poll->set_gop(margins.second);
+        poll->set_margin(poll->dem() - poll->gop());
+        *poll->mutable_start() = cc->StartDate();
+        *poll->mutable_end() = cc->EndDate();
     }
-
-    Poll* poll = model->add_polls();
-    poll->set_description(std::to_string(cc_->EndDate().year() - 4) + " election result");
-    poll->set_dem(iter->second.first);
-    poll->set_gop(iter->second.second);
-    poll->set_margin(poll->dem() - poll->gop());
-    poll->set_weight(1.0);
-    *poll->mutable_start() = cc_->StartDate();
-    *poll->mutable_end() = cc_->EndDate();
 }
 
 double
@@ -179,8 +204,9 @@ StateAnalysis::GetMinimumError()
     return kStateMinError;
 }
 
-SenateAnalysis::SenateAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data)
-  : Analysis(cx, cc, feed, data)
+SenateAnalysis::SenateAnalysis(Context* cx, Campaign* cc, const Feed* feed,
+                               const FeedIndex* index, PollTable* poll_table, ModelData* data)
+  : Analysis(cx, cc, feed, index, poll_table, data)
 {
 }
 
@@ -222,12 +248,13 @@ SenateAnalysis::Analyze()
 
         // Ignore jungle races when flagged, since we have no way to distinguish
         // the true 2-party margin.
+        PollSelection polls;
         auto iter = feed_->senate_polls().find(index);
         if (iter != feed_->senate_polls().end())
-            FindRecentPolls(iter->second.polls(), model.mutable_polls());
-        ComputeRace(race, &model);
+            FindRecentPolls(iter->second.polls(), &polls);
+        ComputeRace(race, polls, &model);
 
-        if (model.polls().empty() && !model.rating().empty()) {
+        if (model.poll_refs().empty() && !model.rating().empty()) {
             if (model.rating() == "dem")
                 safe_seats->set_dem(safe_seats->dem() + 1);
             else if (model.rating() == "gop")
@@ -262,27 +289,27 @@ SenateAnalysis::Analyze()
     assert(dem_seats_needed > safe_seats->dem());
     data_->set_senate_can_flip(true);
 
-    auto bias_fn = GetBiasFn(cc_, data_);
+    ScoreSurface surface(GetRaceArray(cc_, data_));
 
-    MetamarginFinder mmf(std::move(bias_fn), dem_seats_needed - safe_seats->dem() - 1,
-                         cv.FindMean(), (int)seat_p.size());
+    std::optional<double> hint;
+    if (prev_data_ && prev_data_->senate_can_flip())
+        hint = {prev_data_->senate_mm()};
+
+    MetamarginFinder mmf(surface.AsBiasFn(), dem_seats_needed - safe_seats->dem() - 1,
+                         cv.FindMean(), (int)seat_p.size(), hint);
     data_->set_senate_mm(mmf.metamargin);
 }
 
-std::function<int(double)>
-SenateAnalysis::GetBiasFn(Campaign*, const ModelData* data)
+RaceArray
+SenateAnalysis::GetRaceArray(Campaign* cc, const ModelData* data)
 {
-    return [data](double bias) -> int {
-        std::vector<double> win_p;
-        for (const auto& race : data->senate_races()) {
-            if (race.polls().empty() && !race.rating().empty())
-                continue;
-            win_p.emplace_back(DemWinProb(race, bias));
-        }
-
-        Convolver bias_cv(win_p);
-        return bias_cv.FindMean();
-    };
+    RaceArray races;
+    for (const auto& race : data->senate_races()) {
+        if (race.poll_refs().empty() && !race.rating().empty())
+            continue;
+        races.Add(1, race.mean(), race.stddev(), cc->GetRegion(Race::SENATE, race.race_id()));
+    }
+    return races;
 }
 
 bool
@@ -301,11 +328,11 @@ SenateAnalysis::GetScoreToWin(Campaign* cc, const ModelData* data, int* score, i
 }
 
 void
-SenateAnalysis::ComputeRace(const Race& race, RaceModel* model)
+SenateAnalysis::ComputeRace(const Race& race, const PollSelection& polls, RaceModel* model)
 {
     assert(race.type() == Race::SENATE);
 
-    if (model->polls().empty()) {
+    if (polls.empty()) {
         // Note: all parameters will be zero by default.
         model->set_rating(race.presumed_winner());
         if (model->rating() == "dem") {
@@ -319,17 +346,11 @@ SenateAnalysis::ComputeRace(const Race& race, RaceModel* model)
         return;
     }
 
-    auto polls = model->polls();
-    if (polls[polls.size() - 1].final_result() &&
-        polls[polls.size() - 1].too_close_to_call())
-    {
+    const Poll& oldest = polls.index->poll(polls.rows.back().first);
+    if (oldest.final_result() && oldest.too_close_to_call())
         model->set_too_close_to_call(true);
-    }
 
-    ComputePollModelStats(model);
-
-    // Probability of dems winning.
-    model->set_win_prob(DemWinProb(*model));
+    ComputeRaceModel(model, polls);
 }
 
 double
@@ -338,8 +359,9 @@ SenateAnalysis::GetMinimumError()
     return kSenateMinError;
 }
 
-GovernorAnalysis::GovernorAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data)
-  : Analysis(cx, cc, feed, data)
+GovernorAnalysis::GovernorAnalysis(Context* cx, Campaign* cc, const Feed* feed,
+                                   const FeedIndex* index, PollTable* poll_table, ModelData* data)
+  : Analysis(cx, cc, feed, index, poll_table, data)
 {
 }
 
@@ -359,10 +381,11 @@ GovernorAnalysis::Analyze()
         model.set_race_id(race.race_id());
         model.set_race_type(Race::GOVERNOR);
 
+        PollSelection polls;
         auto iter = feed_->governor_polls().find(race.race_id());
         if (iter != feed_->governor_polls().end())
-            FindRecentPolls(iter->second.polls(), model.mutable_polls());
-        ComputeRace(race, &model);
+            FindRecentPolls(iter->second.polls(), &polls);
+        ComputeRace(race, polls, &model);
         seat_p.emplace_back(model.win_prob());
     }
 
@@ -379,22 +402,18 @@ GovernorAnalysis::Analyze()
 }
 
 void
-GovernorAnalysis::ComputeRace(const Race& race, RaceModel* model)
+GovernorAnalysis::ComputeRace(const Race& race, const PollSelection& polls, RaceModel* model)
 {
     assert(race.type() == Race::GOVERNOR);
 
-    if (model->polls().empty()) {
+    if (polls.empty()) {
         if (race.presumed_winner() == "dem")
             model->set_win_prob(1.0);
         model->set_rating(race.presumed_winner());
         return;
     }
 
-    ComputePollModelStats(model);
-
-    // Probability of dems winning.
-    if (!model->polls().empty())
-        model->set_win_prob(1.0 - NormalCdf(0.0, model->mean(), model->stddev()));
+    ComputeRaceModel(model, polls);
 }
 
 double
@@ -403,52 +422,68 @@ GovernorAnalysis::GetMinimumError()
     return kGovernorMinError;
 }
 
-HouseAnalysis::HouseAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data)
-  : Analysis(cx, cc, feed, data)
+HouseAnalysis::HouseAnalysis(Context* cx, Campaign* cc, const Feed* feed,
+                             const FeedIndex* index, PollTable* poll_table, ModelData* data)
+  : Analysis(cx, cc, feed, index, poll_table, data)
 {
 }
 
 void
 HouseAnalysis::Analyze(const Date& today)
 {
-    const auto& house_polls = feed_->house_polls();
-    const auto* house_ratings = &feed_->house_ratings();
-    if (house_ratings->empty()) {
+    std::vector<Chunk> chunks(1);
+    SelectRatings(today);
+    AnalyzeRaces(0, num_races(), &chunks[0]);
+    Finish(&chunks);
+}
+
+size_t
+HouseAnalysis::num_races() const
+{
+    return cc_->house_map().races().size();
+}
+
+void
+HouseAnalysis::SelectRatings(const Date& today)
+{
+    house_ratings_ = &feed_->house_ratings();
+    if (house_ratings_->empty()) {
         // Try to derive pre-recorded ratings.
         DeriveHouseRatings();
-        house_ratings = &derived_ratings_;
+        house_ratings_ = &derived_ratings_;
     }
     if (data_->date() != today && today != cc_->EndDate()) {
         // This is a backdated run. Try to use the historical ratings we saved
         // permanently, because unlike poll lists, ratings are not otherwise
         // dated.
         if (auto found = UseOldHouseRatings(); found != nullptr)
-            house_ratings = found;
+            house_ratings_ = found;
     }
+}
+
+void
+HouseAnalysis::AnalyzeRaces(size_t begin, size_t end, Chunk* out)
+{
+    const auto& house_polls = feed_->house_polls();
 
-    // This state is used to track the "safe" makeup of the house. In years
+    // The counts in |out| track the "safe" makeup of the house. In years
     // where we've bothered to fill the entire house makeup, we can just
     // count safe seats directly. Otherwise, we impute by assuming that all
     // missing house races are safe.
-    int safe_dem = 0;
-    int safe_gop = 0;
-    int unsafe_dem = 0;
-    int unsafe_gop = 0;
-    int flips_to_dem = 0;
-    int flips_to_gop = 0;
+    const auto& races = cc_->house_map().races();
+    for (size_t i = begin; i < end; i++) {
+        const auto& race = races[i];
 
-    // Analyze individual races.
-    std::vector<double> win_p;
-    for (const auto& race : cc_->house_map().races()) {
         const HouseRating* hr = nullptr;
-        if (auto hr_iter = house_ratings->find(race.race_id()); hr_iter != house_ratings->end())
+        if (auto hr_iter = house_ratings_->find(race.race_id()); hr_iter != house_ratings_->end())
             hr = &hr_iter->second;
 
         RaceModel model;
         model.set_race_id(race.race_id());
         model.set_race_type(Race::HOUSE);
+        PollSelection polls;
         if (auto iter = house_polls.find(race.race_id()); iter != house_polls.end())
-            FindRecentPolls(iter->second.polls(), model.mutable_polls());
+            FindRecentPolls(iter->second.polls(), &polls);
         if (hr) {
             if (hr->rating() != "tossup")
                 model.set_rating(hr->rating() + " " + hr->presumed_winner());
@@ -456,15 +491,11 @@ HouseAnalysis::Analyze(const Date& today)
                 model.set_rating(hr->rating());
         }
 
-        if (!model.polls().empty()) {
-            auto& polls = model.polls();
-            if (polls[polls.size() - 1].final_result() &&
-                polls[polls.size() - 1].too_close_to_call())
-            {
+        if (!polls.empty()) {
+            const Poll& oldest = polls.index->poll(polls.rows.back().first);
+            if (oldest.final_result() && oldest.too_close_to_call())
                 model.set_too_close_to_call(true);
-            }
-            ComputePollModelStats(&model);
-            model.set_win_prob(DemWinProb(model));
+            ComputeRaceModel(&model, polls);
         } else {
             std::string_view rating;
             std::string_view presumed_winner;
@@ -485,22 +516,19 @@ HouseAnalysis::Analyze(const Date& today)
 
             // If a seat has no rating, we assume it's safe.
             if (rating.empty() || rating == "safe") {
-                if (race.cook_pvi() > 0)
-                    presumed_winner = "dem";
-                else
-                    presumed_winner = "gop";
+                presumed_winner = IsSafeForDem(race) ? "dem" : "gop";
 
                 if (presumed_winner == "gop") {
-                    safe_gop++;
+                    out->safe_gop++;
                     if (race.current_holder() == "dem") {
-                        flips_to_gop++;
-                        unsafe_dem++;
+                        out->flips_to_gop++;
+                        out->unsafe_dem++;
                     }
                 } else if (presumed_winner == "dem") {
-                    safe_dem++;
+                    out->safe_dem++;
                     if (race.current_holder() == "gop") {
-                        flips_to_dem++;
-                        unsafe_gop++;
+                        out->flips_to_dem++;
+                        out->unsafe_gop++;
                     }
                 } else {
                     Fatal() << "No presumed winner for safe seat: " << race.region();
@@ -513,12 +541,37 @@ HouseAnalysis::Analyze(const Date& today)
         }
 
         if (race.current_holder() == "dem")
-            unsafe_dem++;
+            out->unsafe_dem++;
         else if (race.current_holder() == "gop")
-            unsafe_gop++;
+            out->unsafe_gop++;
 
-        win_p.emplace_back(model.win_prob());
-        *data_->mutable_house_races()->Add() = std::move(model);
+        out->races.emplace_back(std::move(model));
+    }
+}
+
+void
+HouseAnalysis::Finish(std::vector<Chunk>* chunks)
+{
+    int safe_dem = 0;
+    int safe_gop = 0;
+    int unsafe_dem = 0;
+    int unsafe_gop = 0;
+    int flips_to_dem = 0;
+    int flips_to_gop = 0;
+
+    std::vector<double> win_p;
+    for (auto& chunk : *chunks) {
+        safe_dem += chunk.safe_dem;
+        safe_gop += chunk.safe_gop;
+        unsafe_dem += chunk.unsafe_dem;
+        unsafe_gop += chunk.unsafe_gop;
+        flips_to_dem += chunk.flips_to_dem;
+        flips_to_gop += chunk.flips_to_gop;
+
+        for (auto& model : chunk.races) {
+            win_p.emplace_back(model.win_prob());
+            *data_->mutable_house_races()->Add() = std::move(model);
+        }
     }
     if (win_p.empty())
         return;
@@ -538,7 +591,7 @@ HouseAnalysis::Analyze(const Date& today)
     int total_seats = cc_->house_map().total_seats();
     int majority_seats = GetTiebreakerMajority(total_seats);
 
-    Convolver cv(win_p);
+    Convolver cv(win_p, &cx_->workers());
     cv.CalcConfidence(data_->mutable_dem_house_range(), safe_dem);
 
     auto seats = data_->mutable_house_median();
@@ -555,10 +608,14 @@ HouseAnalysis::Analyze(const Date& today)
 
     data_->set_house_can_flip(true);
 
-    auto bias_fn = GetBiasFn(cc_, data_);
+    ScoreSurface surface(GetRaceArray(cc_, data_));
 
-    MetamarginFinder mmf(std::move(bias_fn), majority_seats - safe_dem - 1, cv.FindMean(),
-                         (int)data_->house_races().size());
+    std::optional<double> hint;
+    if (prev_data_ && prev_data_->house_can_flip())
+        hint = {prev_data_->house_mm()};
+
+    MetamarginFinder mmf(surface.AsBiasFn(), majority_seats - safe_dem - 1, cv.FindMean(),
+                         (int)data_->house_races().size(), hint);
     data_->set_house_mm(mmf.metamargin);
 }
 
@@ -592,33 +649,28 @@ HouseAnalysis::UseOldHouseRatings()
     return candidate;
 }
 
-std::function<int(double)>
-HouseAnalysis::GetBiasFn([[maybe_unused]] Campaign* cc, const ModelData* data)
+RaceArray
+HouseAnalysis::GetRaceArray(Campaign* cc, const ModelData* data)
 {
     // Try to build a margin list for computing a meta-margin.
-    std::vector<std::pair<double, double>> margins;
+    RaceArray races;
     for (const auto& race : data->house_races()) {
-        if (!race.polls().empty()) {
-            margins.emplace_back(race.margin(), race.stddev());
+        int region = cc->GetRegion(Race::HOUSE, race.race_id());
+        if (!race.poll_refs().empty()) {
+            races.Add(1, race.margin(), race.stddev(), region);
         } else {
             static const double kEstimatedError = kHouseMinError;
-            margins.emplace_back(InverseCdf(0.0, 1.0 - race.win_prob(), kEstimatedError),
-                                 kEstimatedError);
-            if (margins.back().first == INFINITY)
-                margins.back().first = 24.0;
-            else if (margins.back().first == -INFINITY)
-                margins.back().first = -24.0;
+            double margin = InverseCdf(0.0, 1.0 - race.win_prob(), kEstimatedError);
+            if (margin == INFINITY)
+                margin = 24.0;
+            else if (margin == -INFINITY)
+                margin = -24.0;
+            races.Add(1, margin, kEstimatedError, region);
         }
     }
-    assert((int)margins.size() + data->house_safe_seats().dem() + data->house_safe_seats().gop() ==
+    assert((int)races.size() + data->house_safe_seats().dem() + data->house_safe_seats().gop() ==
            cc->house_map().total_seats());
-
-    return [margins{std::move(margins)}](double bias) -> int {
-        std::vector<double> win_p;
-        for (const auto& pair : margins)
-            win_p.emplace_back(DemWinProb(pair.first, pair.second, bias));
-        return Convolver(win_p).FindMean();
-    };
+    return races;
 }
 
 bool
@@ -670,46 +722,49 @@ HouseAnalysis::GetMinimumError()
 }
 
 static bool
-SamePollDate(const Poll& a, const Poll& b)
+SamePollDate(const PollIndex& index, size_t a, size_t b)
 {
-    return a.start() == b.start() && a.end() == b.end();
-}
-
-static inline int
-SampleTypeScore(const std::string& sample_type)
-{
-    if (sample_type == "lv")
-        return 4;
-    if (sample_type == "rv")
-        return 3;
-    if (sample_type == "a")
-        return 2;
-    return 0;
+    return index.start_day(a) == index.start_day(b) && index.end_day(a) == index.end_day(b);
 }
 
 static bool
-IsBetterPoll(const Poll& a, const Poll& b)
+IsBetterPoll(const PollIndex& index, size_t a, size_t b)
 {
-    if (a.sample_type() != b.sample_type())
-        return SampleTypeScore(a.sample_type()) > SampleTypeScore(b.sample_type());
-    return a.sample_size() > b.sample_size();
+    if (index.sample_type(a) != index.sample_type(b))
+        return index.sample_type(a) > index.sample_type(b);
+    return index.sample_size(a) > index.sample_size(b);
 }
 
-typedef std::map<std::string, std::vector<Poll>> PollsterMap;
+// Rows of a PollIndex, grouped by pollster. There are only ever a handful of
+// pollsters in a window, so this is a flat list rather than a map.
+struct PollsterBatch
+{
+    int pollster;
+    std::vector<size_t> rows;
+};
+typedef std::vector<PollsterBatch> PollsterMap;
 
 static void
-AddPollToMap(PollsterMap* map, const Poll& poll)
+AddPollToMap(PollsterMap* map, const PollIndex& index, size_t row)
 {
-    auto& batch = (*map)[poll.description()];
+    auto batch_iter = std::find_if(map->begin(), map->end(),
+                                   [&index, row](const PollsterBatch& batch) -> bool {
+        return batch.pollster == index.pollster(row);
+    });
+    if (batch_iter == map->end()) {
+        map->push_back(PollsterBatch{index.pollster(row), {row}});
+        return;
+    }
+    auto& batch = batch_iter->rows;
 
     auto iter = batch.begin();
     while (iter != batch.end()) {
-        if (iter->tracking() && poll.tracking()) {
+        if (index.tracking(*iter) && index.tracking(row)) {
             // Older version of tracking poll. Throw away.
-            if (iter->end() > poll.end())
+            if (index.end_day(*iter) > index.end_day(row))
                 return;
             // Newer version. remove the current.
-            if (iter->end() < poll.end()) {
+            if (index.end_day(*iter) < index.end_day(row)) {
                 iter = batch.erase(iter);
                 continue;
             }
@@ -717,12 +772,12 @@ AddPollToMap(PollsterMap* map, const Poll& poll)
 
         // If this is a duplicate, we either remove it, or replace the
         // existing poll if the new one has a better sample.
-        if (SamePollDate(poll, *iter)) {
-            if (IsBetterPoll(poll, *iter)) {
-                *iter = poll;
+        if (SamePollDate(index, row, *iter)) {
+            if (IsBetterPoll(index, row, *iter)) {
+                *iter = row;
                 return;
             }
-            if (IsBetterPoll(*iter, poll)) {
+            if (IsBetterPoll(index, *iter, row)) {
                 // Exclude this poll entirely.
                 return;
             }
@@ -731,7 +786,7 @@ AddPollToMap(PollsterMap* map, const Poll& poll)
         }
         iter++;
     }
-    batch.emplace_back(poll);
+    batch.emplace_back(row);
 }
 
 static inline int
@@ -770,18 +825,23 @@ GetPollWindow(const Date& election_date, const Date& window_start)
 
 void
 Analysis::FindRecentPolls(const google::protobuf::RepeatedPtrField<Poll>& polls,
-                          google::protobuf::RepeatedPtrField<Poll>* out)
+                          PollSelection* out)
 {
     if (polls.empty())
         return;
 
-    auto iter = polls.begin();
-    while (iter != polls.end()) {
-        if (iter->end() <= data_->date())
-            break;
-        iter++;
+    const PollIndex& index = index_->Get(polls);
+    int today = DayNumber(data_->date());
+
+    if (const PollFilter* filter = index_->GetFilter(index)) {
+        filter->Select(today, out);
+        return;
     }
-    if (iter == polls.end())
+
+    out->index = &index;
+
+    size_t first = index.FindFirstEndedBy(today);
+    if (first == index.size())
         return;
 
     // We want at least 4 polls, even if they're not within the same time
@@ -797,33 +857,34 @@ Analysis::FindRecentPolls(const google::protobuf::RepeatedPtrField<Poll>& polls,
     // the data would change every day making things harder to understand.
     // We don't do anything like 538 and try to correct a lack of polls
     // by using national trends.
-    std::optional<Date> earliest;
-
-    Date cutoff = cc_->StartDate() - 60;
+    std::optional<int> earliest;
 
-    for (; iter < polls.end(); iter++) {
-        const auto& poll = *iter;
+    int cutoff = DayNumber(cc_->StartDate()) - 60;
 
+    for (size_t i = first; i < index.size(); i++) {
         // Don't use ridiculously early polls. Our cutoff is 2 months from
         // before the official start of what we consider the campaign to be.
-        if (poll.start() < cutoff)
+        if (index.start_day(i) < cutoff)
             continue;
 
         // Only go past the most recent week if we don't have many samples.
         // Note that we count *pollsters* and not polls, since we don't want
         // three polls from the same pollster to knock out other candidates.
-        if (earliest.has_value() && poll.end() <= earliest.value() && staging.size() >= kMinPolls)
+        if (earliest.has_value() && index.end_day(i) <= earliest.value() &&
+            staging.size() >= kMinPolls)
+        {
             break;
+        }
 
         // Try to make the behavior of new runs to be the same as backdated
         // runs, by not including polls until they were published.
-        if (poll.has_published() && poll.published() > data_->date())
+        if (!index.IsPublishedBy(i, today))
             continue;
 
         if (!earliest.has_value())
-            earliest = {poll.end() - GetPollWindow(cc_->EndDate(), poll.end())};
+            earliest = {index.end_day(i) - GetPollWindow(cc_->EndDate(), polls[i].end())};
 
-        AddPollToMap(&staging, poll);
+        AddPollToMap(&staging, index, i);
     }
 
     // If each pollster has one poll, all polls will be weighted equally (1/N).
@@ -835,14 +896,13 @@ Analysis::FindRecentPolls(const google::protobuf::RepeatedPtrField<Poll>& polls,
     //   Pollster C 5/8, weight: 1/3
     //
     // Total weight: 1.0.
-    for (auto& pair : staging) {
-        auto& batch = pair.second;
-        for (auto& poll : batch) {
-            poll.set_weight(1.0 / (double(batch.size() * staging.size())));
-            *out->Add() = std::move(poll);
-        }
+    for (const auto& batch : staging) {
+        for (size_t row : batch.rows)
+            out->rows.emplace_back(row, 1.0 / (double(batch.rows.size() * staging.size())));
     }
-    SortPolls(out);
+
+    // Rows are in end date order, newest first, same as SortPolls.
+    std::sort(out->rows.begin(), out->rows.end());
 }
 
 double
@@ -880,38 +940,47 @@ Analysis::UndecidedFactor(double undecided_pct)
 }
 
 std::optional<double>
-Analysis::GetUndecideds(const google::protobuf::RepeatedPtrField<Poll>& polls)
-{
-    std::vector<double> undecideds;
-    for (const auto& poll : polls) {
-        if (poll.dem() && poll.gop()) {
-            auto undecided = 100.0 - poll.dem() - poll.gop();
-            if (undecided >= 0.0)
-                undecideds.emplace_back(undecided);
+Analysis::GetUndecideds(const PollSelection& polls)
+{
+    double total = 0.0;
+    size_t count = 0;
+    for (const auto& [row, _] : polls.rows) {
+        double dem = polls.index->dem(row);
+        double gop = polls.index->gop(row);
+        if (dem && gop) {
+            auto undecided = 100.0 - dem - gop;
+            if (undecided >= 0.0) {
+                total += undecided;
+                count++;
+            }
         }
     }
-    if (undecideds.empty())
+    if (!count)
         return {};
-    return {Average(undecideds)};
+    return {total / double(count)};
 }
 
 void
-Analysis::ComputePollModelStats(RaceModel* model)
+Analysis::ComputePollModelStats(RaceModel* model, const PollSelection& polls)
 {
-    assert(!model->polls().empty());
+    assert(!polls.empty());
 
-    model->set_dem_average(0.0);
-    model->set_gop_average(0.0);
+    const PollIndex& index = *polls.index;
 
+    double dem_average = 0.0;
+    double gop_average = 0.0;
     double weighted_average = 0.0;
     std::vector<double> margins;
-    for (const auto& poll : model->polls()) {
-        weighted_average += poll.margin() * poll.weight();
-        margins.emplace_back(poll.margin());
+    margins.reserve(polls.size());
+    for (const auto& [row, weight] : polls.rows) {
+        weighted_average += index.margin(row) * weight;
+        margins.emplace_back(index.margin(row));
 
-        model->set_dem_average(model->dem_average() + poll.weight() * poll.dem());
-        model->set_gop_average(model->gop_average() + poll.weight() * poll.gop());
+        dem_average += weight * index.dem(row);
+        gop_average += weight * index.gop(row);
     }
+    model->set_dem_average(dem_average);
+    model->set_gop_average(gop_average);
 
     // Round to three significant digits. This works around something like:
     //     2.0 * .33333... +
@@ -931,7 +1000,7 @@ Analysis::ComputePollModelStats(RaceModel* model)
     model->set_median(Median(margins));
     model->set_margin(model->mean());
 
-    auto undecideds = GetUndecideds(model->polls());
+    auto undecideds = GetUndecideds(polls);
     if (!undecideds.has_value()) {
         if (cc_->IsPresidentialYear() && data_->national().undecideds())
             undecideds = {data_->national().undecideds()};
@@ -947,10 +1016,54 @@ Analysis::ComputePollModelStats(RaceModel* model)
     } else {
         double stddev = 0.0;
         double expected_error = EstimateStdDev(*model);
-        if (model->polls().size() > 1)
+        if (polls.filter_stddev)
+            stddev = polls.filter_stddev;
+        else if (polls.size() > 1)
             stddev = SampleStdDev(margins);
         model->set_stddev(std::max(expected_error, stddev));
     }
+
+    polls.WriteTo(poll_table_, model->mutable_poll_refs());
+}
+
+void
+Analysis::ComputeRaceModel(RaceModel* model, const PollSelection& polls)
+{
+    uint64_t key = 0;
+    if (race_cache_) {
+        // Everything that ComputePollModelStats reads must be part of the key.
+        ContentHash builder;
+        builder.Add(RaceCache::kVersion);
+        builder.Add((int)model->race_type());
+        builder.Add(model->race_id());
+        builder.Add(GetMinimumError());
+        builder.Add((int)cc_->IsPresidentialYear());
+        builder.Add(data_->national().undecideds());
+        builder.Add(data_->generic_ballot().undecideds());
+        builder.Add(cc_->UndecidedPercent());
+        builder.Add(polls.filter_stddev);
+        for (const auto& [row, weight] : polls.rows) {
+            builder.Add(polls.index->poll(row).id());
+            builder.Add(polls.index->dem(row));
+            builder.Add(polls.index->gop(row));
+            builder.Add(polls.index->margin(row));
+            builder.Add(weight);
+        }
+        key = builder.Hash();
+
+        if (race_cache_->Find(DayNumber(data_->date()), key, model)) {
+            polls.WriteTo(poll_table_, model->mutable_poll_refs());
+            return;
+        }
+    }
+
+    ComputePollModelStats(model, polls);
+
+    // Probability of dems winning.
+    model->set_win_prob(DemWinProb(*model));
+
+    if (race_cache_)
+        race_cache_->Insert(DayNumber(data_->date()), key, *model);
 }
 
 double
@@ -24,22 +24,38 @@
 #include "campaign.h"
 #include "context.h"
 #include "mathlib.h"
+#include "poll-index.h"
+#include "race-cache.h"
 
 namespace stone {
 
 class Analysis
 {
   public:
-    Analysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data);
+    Analysis(Context* cx, Campaign* cc, const Feed* feed, const FeedIndex* index,
+             PollTable* poll_table, ModelData* data);
 
     static double UndecidedFactor(double undecided_pct);
 
+    // If the previous day's model is available, and will not change during
+    // this run, its metamargins are used to warm-start the metamargin search.
+    void set_previous_day(const ModelData* prev) { prev_data_ = prev; }
+
+    // If set, race stats are looked up in and added to this cache.
+    void set_race_cache(RaceCache* cache) { race_cache_ = cache; }
+
   protected:
     void FindRecentPolls(const google::protobuf::RepeatedPtrField<Poll>& polls,
-                         google::protobuf::RepeatedPtrField<Poll>* out);
+                         PollSelection* out);
     void GetWeightedPolls(const google::protobuf::RepeatedPtrField<Poll>& polls,
                           google::protobuf::RepeatedPtrField<Poll>* out);
-    void ComputePollModelStats(RaceModel* model);
+    // Fill in |model|'s averages and error from the selected polls, and copy
+    // the polls into it.
+    void ComputePollModelStats(RaceModel* model, const PollSelection& polls);
+
+    // Same as ComputePollModelStats, but also sets the win probability, and
+    // reuses the result of an earlier computation with the same inputs.
+    void ComputeRaceModel(RaceModel* model, const PollSelection& polls);
     double EstimateStdDev(const RaceModel& model);
 
     virtual double GetMinimumError() = 0;
@@ -47,26 +63,44 @@ class Analysis
     static double DemWinProb(double margin, double stddev, double bias = 0.0);
     static double DemWinProb(const RaceModel& model, double bias = 0.0);
 
-    static std::optional<double> GetUndecideds(
-        const google::protobuf::RepeatedPtrField<Poll>& polls);
+    static std::optional<double> GetUndecideds(const PollSelection& polls);
 
   protected:
     Context* cx_;
     Campaign* cc_;
     const Feed* feed_;
+    const FeedIndex* index_;
+    PollTable* poll_table_;
     ModelData* data_;
+    const ModelData* prev_data_ = nullptr;
+    RaceCache* race_cache_ = nullptr;
     double computed_error_;
 };
 
 class StateAnalysis : public Analysis
 {
   public:
-    StateAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data);
+    StateAnalysis(Context* cx, Campaign* cc, const Feed* feed, const FeedIndex* index,
+                  PollTable* poll_table, ModelData* data);
 
+    // Compute the national and generic ballot models, which set the
+    // undecideds that every other race reads. This must finish before any
+    // other analysis of the same day starts.
+    void AnalyzeNational();
     void Analyze();
 
-    // Return a function that can compute a score given a margin bias.
-    static std::function<int(double)> GetBiasFn(Campaign* cc, const ModelData* data);
+    // Build a feed with one poll per state, the previous election's result,
+    // for states that have no polls. It must be indexed and added to the poll
+    // table before analysis starts, and set with set_assumed_polls.
+    static void BuildAssumedFeed(Campaign* cc, Feed* out);
+    void set_assumed_polls(const Feed* feed, const FeedIndex* index) {
+        assumed_feed_ = feed;
+        assumed_index_ = index;
+    }
+
+    // Return the races that contribute to the score, for building a
+    // ScoreSurface that can compute a score given a margin bias.
+    static RaceArray GetRaceArray(Campaign* cc, const ModelData* data);
     static Convolver GetConvolverForBias(Campaign* cc, const ModelData* data, double bias);
 
     // Return the minimum score for D to win. The offset is an optimization. For
@@ -86,19 +120,23 @@ class StateAnalysis : public Analysis
     }
 
   private:
-    void FindRecentPolls(const State& state, RaceModel* model);
-    void ComputeState(RaceModel* model);
+    void ComputeState(const State& state, RaceModel* model);
     double GetMinimumError() override;
+
+  private:
+    const Feed* assumed_feed_ = nullptr;
+    const FeedIndex* assumed_index_ = nullptr;
 };
 
 class SenateAnalysis : public Analysis
 {
   public:
-    SenateAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data);
+    SenateAnalysis(Context* cx, Campaign* cc, const Feed* feed, const FeedIndex* index,
+                   PollTable* poll_table, ModelData* data);
 
     void Analyze();
 
-    static std::function<int(double)> GetBiasFn(Campaign* cc, const ModelData* data);
+    static RaceArray GetRaceArray(Campaign* cc, const ModelData* data);
     static bool GetScoreToWin(Campaign* cc, const ModelData* data, int* score, int* offset);
 
     // These are used by SetBayesParameters.
@@ -110,19 +148,20 @@ class SenateAnalysis : public Analysis
     }
 
   private:
-    void ComputeRace(const Race& race, RaceModel* model);
+    void ComputeRace(const Race& race, const PollSelection& polls, RaceModel* model);
     double GetMinimumError() override;
 };
 
 class GovernorAnalysis : public Analysis
 {
   public:
-    GovernorAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data);
+    GovernorAnalysis(Context* cx, Campaign* cc, const Feed* feed, const FeedIndex* index,
+                     PollTable* poll_table, ModelData* data);
 
     void Analyze();
 
   private:
-    void ComputeRace(const Race& race, RaceModel* model);
+    void ComputeRace(const Race& race, const PollSelection& polls, RaceModel* model);
 
     double GetMinimumError() override;
 };
@@ -130,13 +169,37 @@ class GovernorAnalysis : public Analysis
 class HouseAnalysis : public Analysis
 {
   public:
-    HouseAnalysis(Context* cx, Campaign* cc, const Feed* feed, ModelData* data);
+    HouseAnalysis(Context* cx, Campaign* cc, const Feed* feed, const FeedIndex* index,
+                  PollTable* poll_table, ModelData* data);
 
     void Analyze(const Date& today);
 
-    static std::function<int(double)> GetBiasFn(Campaign* cc, const ModelData* data);
+    // Analyze() can also be split up: SelectRatings, then AnalyzeRaces over
+    // ranges of races, and then Finish with every range's chunk, in order.
+    // AnalyzeRaces only writes to its chunk, so it can run in parallel with
+    // itself, and with other analyses that do not write to the day.
+    struct Chunk
+    {
+        std::vector<RaceModel> races;
+        int safe_dem = 0;
+        int safe_gop = 0;
+        int unsafe_dem = 0;
+        int unsafe_gop = 0;
+        int flips_to_dem = 0;
+        int flips_to_gop = 0;
+    };
+    size_t num_races() const;
+    void SelectRatings(const Date& today);
+    void AnalyzeRaces(size_t begin, size_t end, Chunk* out);
+    void Finish(std::vector<Chunk>* chunks);
+
+    static RaceArray GetRaceArray(Campaign* cc, const ModelData* data);
     static bool GetScoreToWin(Campaign* cc, const ModelData* data, int* score, int* offset);
 
+    // Seats without a rating, or rated safe, are presumed won by the party
+    // their PVI leans to.
+    static bool IsSafeForDem(const Race& race) { return race.cook_pvi() > 0; }
+
     // These are used by SetBayesParameters.
     //
     // Many house seats are not polled, or are polled infrequently, which makes
@@ -159,6 +222,7 @@ class HouseAnalysis : public Analysis
 
   private:
     HouseRatingMap derived_ratings_;
+    const HouseRatingMap* house_ratings_ = nullptr;
 };
 
 } // namespace stone
@@ -15,6 +15,8 @@
 // limitations under the License.
 #include "campaign.h"
 
+#include <ctype.h>
+
 #include <amtl/am-string.h>
 #include <google/protobuf/text_format.h>
 
@@ -198,6 +200,8 @@ Campaign::Init(Context* cx, int year)
         district_to_house_race_[race.region()] = index;
     }
 
+    InitRegions();
+
     auto results_file = dir + "/results-" + year_s + ".ini";
     if (FileExists(results_file)) {
         if (!InitElectionResults(results_file))
@@ -260,6 +264,23 @@ Campaign::InitMain(const IniFile& file, std::string_view file_name)
         return false;
     }
 
+    // Polls are averaged over a window of recent days by default, or with a
+    // Kalman filter (see PollFilter).
+    if (iter = section.find("poll_average"); iter != section.end()) {
+        if (iter->second == "kalman") {
+            use_poll_filter_ = true;
+        } else if (iter->second != "window") {
+            Err() << "Unknown poll_average in " << file_name;
+            return false;
+        }
+    }
+    if (iter = section.find("poll_filter_drift"); iter != section.end()) {
+        if (!ParseFloat(iter->second, &poll_filter_drift_) || poll_filter_drift_ <= 0.0) {
+            Err() << "Invalid poll_filter_drift in " << file_name;
+            return false;
+        }
+    }
+
     if (iter = section.find("dem"); iter != section.end())
         dem_pres_ = iter->second;
     if (iter = section.find("gop"); iter != section.end())
@@ -616,6 +637,80 @@ Campaign::InitStateMap(const std::string& name)
     return true;
 }
 
+// Return the name of the state that a region is in. Regions are state names,
+// or district names that start with a state's name or code, like "Maine CD-1"
+// or "TX-7".
+static const std::string*
+FindRegionState(const std::string& region)
+{
+    const std::string* best = nullptr;
+    for (const auto& [name, code] : kStateCodes) {
+        // Skip districts, which have codes like "ME1".
+        if (code.size() != 2)
+            continue;
+
+        bool matches = false;
+        if (region == name || region == code) {
+            matches = true;
+        } else if (region.size() > name.size() && region.compare(0, name.size(), name) == 0) {
+            char c = region[name.size()];
+            matches = (c == ' ' || c == '-');
+        } else if (region.size() > 2 && region.compare(0, 2, code) == 0) {
+            char c = region[2];
+            matches = (c == '-' || isdigit(c));
+        }
+
+        // Prefer the longest name, so "West Virginia" beats "Virginia".
+        if (matches && (!best || name.size() > best->size()))
+            best = &name;
+    }
+    return best;
+}
+
+void
+Campaign::InitRegions()
+{
+    std::unordered_map<std::string, int> regions;
+    auto get_region = [&regions](const std::string& region) -> int {
+        const std::string* state = FindRegionState(region);
+        if (!state)
+            return -1;
+        return regions.emplace(*state, (int)regions.size()).first->second;
+    };
+
+    for (const auto& state : state_list_)
+        state_regions_.emplace_back(get_region(state.parent().empty() ? state.name()
+                                                                       : state.parent()));
+    for (const auto& race : senate_map_.races())
+        senate_regions_.emplace_back(get_region(race.region()));
+    for (const auto& race : house_map_.races())
+        house_regions_.emplace_back(get_region(race.region()));
+
+    num_regions_ = (int)regions.size();
+}
+
+int
+Campaign::GetRegion(Race_RaceType type, int race_id) const
+{
+    const std::vector<int>* regions;
+    switch (type) {
+        case Race::ELECTORAL_COLLEGE:
+            regions = &state_regions_;
+            break;
+        case Race::SENATE:
+            regions = &senate_regions_;
+            break;
+        case Race::HOUSE:
+            regions = &house_regions_;
+            break;
+        default:
+            return -1;
+    }
+    if (race_id < 0 || (size_t)race_id >= regions->size())
+        return -1;
+    return (*regions)[race_id];
+}
+
 void
 Campaign::InitBannedPolls(const IniFile& file)
 {
@@ -101,6 +101,17 @@ class Campaign
     }
     const std::string& election_type() const { return election_type_; }
 
+    // Whether races are averaged with a PollFilter, and its daily drift in
+    // points. A drift of zero means the filter's default.
+    bool UsePollFilter() const { return use_poll_filter_; }
+    double poll_filter_drift() const { return poll_filter_drift_; }
+
+    // Races are grouped into regions, one per state, so that races in the same
+    // state can share an error. Districts belong to their state. Returns -1 if
+    // the race is not in a known state.
+    int GetRegion(Race_RaceType type, int race_id) const;
+    int num_regions() const { return num_regions_; }
+
   private:
     bool InitMain(const IniFile& file, std::string_view file_name);
     bool InitStateMap(const std::string& name);
@@ -113,6 +124,7 @@ class Campaign
     bool InitImportantDates(const IniFile& file, std::string_view file_name);
     void InitBannedPolls(const IniFile& file);
     bool InitElectionResults(std::string_view file_name);
+    void InitRegions();
 
   protected:
     Date start_date_;
@@ -138,9 +150,16 @@ class Campaign
     std::vector<ImportantDate> important_dates_;
     HouseRatingHistory house_history_;
     std::string election_type_;
+    bool use_poll_filter_ = false;
+    double poll_filter_drift_ = 0.0;
 
     std::unordered_map<Race_RaceType, RaceResultMap> race_results_;
     std::unordered_map<Race_RaceType, RaceResult> national_race_results_;
+
+    std::vector<int> state_regions_;
+    std::vector<int> senate_regions_;
+    std::vector<int> house_regions_;
+    int num_regions_ = 0;
 };
 
 extern const std::unordered_map<std::string, std::string> kStateCodes;
@@ -57,6 +57,16 @@ Context::~Context()
     google::protobuf::ShutdownProtobufLibrary();
 }
 
+// Properties are kept as strings. Doubles keep every digit, so that they
+// parse back to the same value.
+static std::string
+FormatDouble(double value)
+{
+    std::ostringstream out;
+    out << std::setprecision(17) << value;
+    return out.str();
+}
+
 bool
 Context::Init(const std::string& settings_file, int num_threads)
 {
@@ -76,6 +86,8 @@ Context::Init(const std::string& settings_file, int num_threads)
             props_[m.name.GetString()] = m.value.GetString();
         else if (m.value.IsInt())
             props_[m.name.GetString()] = std::to_string(m.value.GetInt());
+        else if (m.value.IsDouble())
+            props_[m.name.GetString()] = FormatDouble(m.value.GetDouble());
     }
 
     outdir_ = GetProp("data-dir");
@@ -241,6 +253,21 @@ Context::GetPropInt(const std::string& prop, int default_value)
     return v;
 }
 
+double
+Context::GetPropDouble(const std::string& prop, double default_value)
+{
+    auto iter = props_.find(prop);
+    if (iter == props_.end())
+        return default_value;
+
+    double v;
+    if (!ParseFloat(iter->second, &v)) {
+        Err() << "Warning: property " << prop << " is not a number.";
+        return default_value;
+    }
+    return v;
+}
+
 bool
 Context::GetCache(const std::string& key, std::string* value)
 {
@@ -46,6 +46,7 @@ class Context final
 
     std::string GetProp(const std::string& prop, const std::string& default_value = {});
     int GetPropInt(const std::string& prop, int default_value = 0);
+    double GetPropDouble(const std::string& prop, double default_value = 0.0);
 
     bool GetCache(const std::string& key, std::string* value);
     std::string GetCache(const std::string& key, std::string_view default_value);
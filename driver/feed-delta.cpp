@@ -0,0 +1,140 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "feed-delta.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "logging.h"
+#include "utility.h"
+
+namespace stone {
+
+typedef std::vector<std::pair<uint64_t, int>> PollKeys;
+
+static void
+AddList(FeedSnapshot* snapshot, const std::string& key,
+        const google::protobuf::RepeatedPtrField<Poll>& polls)
+{
+    if (polls.empty())
+        return;
+
+    auto& out = (*snapshot->mutable_lists())[key];
+    for (const auto& poll : polls) {
+        ContentHash hash;
+        hash.Add(poll.SerializeAsString());
+
+        int visible = DayNumber(poll.end());
+        if (poll.has_published())
+            visible = std::max(visible, DayNumber(poll.published()));
+
+        out.add_hashes(hash.Hash());
+        out.add_visible_days(visible);
+    }
+}
+
+FeedSnapshot
+TakeFeedSnapshot(const Feed& feed)
+{
+    FeedSnapshot snapshot;
+    AddList(&snapshot, "national", feed.national_polls());
+    AddList(&snapshot, "generic_ballot", feed.generic_ballot_polls());
+    for (const auto& [name, state] : feed.states())
+        AddList(&snapshot, "state/" + name, state.polls());
+    for (const auto& [id, list] : feed.senate_polls())
+        AddList(&snapshot, "senate/" + std::to_string(id), list.polls());
+    for (const auto& [id, list] : feed.governor_polls())
+        AddList(&snapshot, "governor/" + std::to_string(id), list.polls());
+    for (const auto& [id, list] : feed.house_polls())
+        AddList(&snapshot, "house/" + std::to_string(id), list.polls());
+    return snapshot;
+}
+
+static PollKeys
+GetSortedPolls(const FeedSnapshot& snapshot, const std::string& key)
+{
+    PollKeys polls;
+    auto iter = snapshot.lists().find(key);
+    if (iter == snapshot.lists().end())
+        return polls;
+
+    const auto& list = iter->second;
+    if (list.hashes_size() != list.visible_days_size()) {
+        Err() << "Feed snapshot for " << key << " is malformed.";
+        return polls;
+    }
+    for (int i = 0; i < list.hashes_size(); i++)
+        polls.emplace_back(list.hashes(i), list.visible_days(i));
+    std::sort(polls.begin(), polls.end());
+    return polls;
+}
+
+// Return the earliest visible day of a poll in only one of the two lists.
+static std::optional<int>
+FindEarliestDifference(const PollKeys& a, const PollKeys& b)
+{
+    std::optional<int> earliest;
+    auto note = [&earliest](int day) -> void {
+        if (!earliest.has_value() || day < earliest.value())
+            earliest = {day};
+    };
+
+    auto a_iter = a.begin();
+    auto b_iter = b.begin();
+    while (a_iter != a.end() && b_iter != b.end()) {
+        if (*a_iter < *b_iter) {
+            note((a_iter++)->second);
+        } else if (*b_iter < *a_iter) {
+            note((b_iter++)->second);
+        } else {
+            a_iter++;
+            b_iter++;
+        }
+    }
+    for (; a_iter != a.end(); a_iter++)
+        note(a_iter->second);
+    for (; b_iter != b.end(); b_iter++)
+        note(b_iter->second);
+    return earliest;
+}
+
+std::optional<int>
+FindEarliestAffectedDay(const FeedSnapshot& before, const FeedSnapshot& after)
+{
+    std::vector<std::string> keys;
+    for (const auto& [key, _] : before.lists())
+        keys.emplace_back(key);
+    for (const auto& [key, _] : after.lists()) {
+        if (!before.lists().count(key))
+            keys.emplace_back(key);
+    }
+
+    std::optional<int> earliest;
+    for (const auto& key : keys) {
+        auto day = FindEarliestDifference(GetSortedPolls(before, key), GetSortedPolls(after, key));
+        if (!day.has_value())
+            continue;
+
+        Out() << "Polls changed for " << key << " starting " << DateFromDayNumber(day.value());
+        if (!earliest.has_value() || day.value() < earliest.value())
+            earliest = day;
+    }
+    return earliest;
+}
+
+} // namespace stone
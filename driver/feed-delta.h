@@ -0,0 +1,34 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <optional>
+
+#include <proto/cache.pb.h>
+#include <proto/poll.pb.h>
+
+namespace stone {
+
+FeedSnapshot TakeFeedSnapshot(const Feed& feed);
+
+// Compare the previous run's snapshot of a feed against the current one, and
+// return the first day (as a DayNumber) whose analysis could differ. A poll
+// that was added, removed, or revised affects every day from the one it
+// became visible on, since it can be in the poll window of any later day.
+std::optional<int> FindEarliestAffectedDay(const FeedSnapshot& before,
+                                           const FeedSnapshot& after);
+
+} // namespace stone
@@ -0,0 +1,641 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "history-store.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "logging.h"
+
+namespace stone {
+
+static constexpr char kMagic[4] = {'S', 'T', 'N', 'H'};
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kHeaderSize = 24;
+static constexpr size_t kPrefixSize = 4;
+
+static void
+PutU32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = uint8_t(v >> (i * 8));
+}
+
+static void
+PutU64(uint8_t* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = uint8_t(v >> (i * 8));
+}
+
+static uint32_t
+GetU32(const uint8_t* p)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++)
+        v |= uint32_t(p[i]) << (i * 8);
+    return v;
+}
+
+static uint64_t
+GetU64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v |= uint64_t(p[i]) << (i * 8);
+    return v;
+}
+
+static int
+DateKey(const Date& date)
+{
+    return date.year() * 10000 + date.month() * 100 + date.day();
+}
+
+struct Header
+{
+    uint64_t index_offset = 0;
+    uint32_t index_length = 0;
+};
+
+static bool
+ParseHeader(const std::string& path, const uint8_t* bytes, size_t size, Header* header)
+{
+    if (size < kHeaderSize || memcmp(bytes, kMagic, sizeof(kMagic)) != 0) {
+        Err() << path << " is not a history file.";
+        return false;
+    }
+    if (GetU32(bytes + 4) != kVersion) {
+        Err() << path << " has unsupported version " << GetU32(bytes + 4);
+        return false;
+    }
+    header->index_offset = GetU64(bytes + 8);
+    header->index_length = GetU32(bytes + 16);
+    if (header->index_offset + kPrefixSize + header->index_length > size) {
+        Err() << path << " has a truncated index.";
+        return false;
+    }
+    return true;
+}
+
+HistoryReader::~HistoryReader()
+{
+    if (map_)
+        munmap(const_cast<uint8_t*>(map_), size_);
+}
+
+bool
+HistoryReader::Open(const std::string& path)
+{
+    path_ = path;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        PErr() << "open " << path;
+        return false;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) < 0) {
+        PErr() << "fstat " << path;
+        close(fd);
+        return false;
+    }
+    size_ = s.st_size;
+
+    void* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        PErr() << "mmap " << path;
+        size_ = 0;
+        return false;
+    }
+    map_ = reinterpret_cast<const uint8_t*>(map);
+
+    Header header;
+    if (!ParseHeader(path, map_, size_, &header))
+        return false;
+
+    HistoryRecord record;
+    record.set_offset(header.index_offset);
+    record.set_length(header.index_length);
+    if (!Read(record, &index_))
+        return false;
+
+    days_by_date_.reserve(num_days());
+    for (size_t i = 0; i < num_days(); i++)
+        days_by_date_.emplace(DateKey(date(i)), i);
+    return true;
+}
+
+bool
+HistoryReader::ReadRaw(const HistoryRecord& record, std::string_view* out) const
+{
+    if (record.offset() + kPrefixSize + record.length() > size_ ||
+        GetU32(map_ + record.offset()) != record.length())
+    {
+        Err() << path_ << " has a bad record at offset " << record.offset();
+        return false;
+    }
+    *out = std::string_view(reinterpret_cast<const char*>(map_ + record.offset() + kPrefixSize),
+                            record.length());
+    return true;
+}
+
+bool
+HistoryReader::Read(const HistoryRecord& record, google::protobuf::MessageLite* out) const
+{
+    std::string_view bytes;
+    if (!ReadRaw(record, &bytes))
+        return false;
+    if (!out->ParseFromArray(bytes.data(), bytes.size())) {
+        Err() << path_ << " has an unparseable record at offset " << record.offset();
+        return false;
+    }
+    return true;
+}
+
+size_t
+HistoryReader::FindDay(const Date& date) const
+{
+    auto iter = days_by_date_.find(DateKey(date));
+    return iter != days_by_date_.end() ? iter->second : num_days();
+}
+
+bool
+HistoryReader::ReadCampaign(CampaignData* out) const
+{
+    return Read(index_.campaign(), out);
+}
+
+bool
+HistoryReader::ReadDay(size_t day, ModelData* out) const
+{
+    return Read(index_.days(day), out);
+}
+
+bool
+HistoryReader::ReadRawDay(size_t day, std::string_view* out) const
+{
+    return ReadRaw(index_.days(day), out);
+}
+
+void
+HistoryReader::ReadSummary(size_t day, ModelData* out) const
+{
+    const auto& record = index_.days(day);
+    const auto& summary = record.summary();
+    *out->mutable_date() = record.date();
+    out->set_generated(summary.generated());
+    out->set_metamargin(summary.metamargin());
+    out->set_senate_mm(summary.senate_mm());
+    out->set_house_mm(summary.house_mm());
+    out->mutable_generic_ballot()->set_margin(summary.generic_ballot_margin());
+    out->set_undecideds(summary.undecideds());
+    out->set_senate_can_flip(summary.senate_can_flip());
+    out->set_house_can_flip(summary.house_can_flip());
+}
+
+bool
+HistoryReader::ReadAll(CampaignData* out) const
+{
+    if (!ReadCampaign(out))
+        return false;
+
+    out->mutable_history()->Reserve(num_days());
+    for (size_t i = 0; i < num_days(); i++) {
+        if (!ReadDay(i, out->add_history()))
+            return false;
+    }
+    return true;
+}
+
+bool
+HistoryReader::ReadSummaries(CampaignData* out) const
+{
+    if (!ReadCampaign(out))
+        return false;
+
+    out->mutable_history()->Reserve(num_days());
+    for (size_t i = 0; i < num_days(); i++)
+        ReadSummary(i, out->add_history());
+    return true;
+}
+
+bool
+LazyHistory::Open(const std::string& path, CampaignData* out)
+{
+    if (!reader_.Open(path) || !reader_.ReadSummaries(out))
+        return false;
+
+    for (size_t i = 0; i < reader_.num_days(); i++)
+        summaries_.emplace(DateKey(reader_.date(i)));
+    return true;
+}
+
+bool
+LazyHistory::Load(ModelData* day)
+{
+    auto iter = summaries_.find(DateKey(day->date()));
+    if (iter == summaries_.end())
+        return true;
+    summaries_.erase(iter);
+
+    size_t index = reader_.FindDay(day->date());
+    ModelData full;
+    if (!reader_.ReadDay(index, &full))
+        return false;
+    *day = std::move(full);
+    return true;
+}
+
+void
+LazyHistory::Forget(const Date& date)
+{
+    summaries_.erase(DateKey(date));
+}
+
+static void
+Summarize(const ModelData& day, DaySummary* out)
+{
+    out->set_generated(day.generated());
+    out->set_metamargin(day.metamargin());
+    out->set_senate_mm(day.senate_mm());
+    out->set_house_mm(day.house_mm());
+    out->set_generic_ballot_margin(day.generic_ballot().margin());
+    out->set_undecideds(day.undecideds());
+    out->set_senate_can_flip(day.senate_can_flip());
+    out->set_house_can_flip(day.house_can_flip());
+}
+
+namespace {
+
+class HistoryWriter
+{
+  public:
+    HistoryWriter(const std::string& path, int fd, uint64_t end)
+      : path_(path), fd_(fd), end_(end)
+    {}
+
+    bool WriteAt(uint64_t offset, const void* bytes, size_t length) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(bytes);
+        while (length) {
+            ssize_t rv = pwrite(fd_, p, length, offset);
+            if (rv < 0) {
+                if (errno == EINTR)
+                    continue;
+                PErr() << "write " << path_;
+                return false;
+            }
+            p += rv;
+            offset += rv;
+            length -= rv;
+        }
+        return true;
+    }
+
+    // Append a record. If it replaces |old|, the old space is counted as
+    // dead. Records that the header's index refers to are never written over.
+    bool Put(std::string_view bytes, const HistoryRecord* old, HistoryRecord* out) {
+        if (old)
+            dead_bytes_ += kPrefixSize + old->capacity();
+        uint64_t offset = end_;
+        uint32_t capacity = (uint32_t)bytes.size();
+        end_ += kPrefixSize + capacity;
+
+        uint8_t prefix[kPrefixSize];
+        PutU32(prefix, (uint32_t)bytes.size());
+        if (!WriteAt(offset, prefix, sizeof(prefix)))
+            return false;
+        if (!WriteAt(offset + kPrefixSize, bytes.data(), bytes.size()))
+            return false;
+
+        out->set_offset(offset);
+        out->set_length((uint32_t)bytes.size());
+        out->set_capacity(capacity);
+        return true;
+    }
+
+    bool Put(const google::protobuf::MessageLite& msg, const HistoryRecord* old,
+             HistoryRecord* out)
+    {
+        msg.SerializeToString(&buffer_);
+        return Put(buffer_, old, out);
+    }
+
+    // Append the index, sync everything written so far, and only then point
+    // the header at the new index.
+    bool Finish(HistoryIndex* index) {
+        index->set_dead_bytes(dead_bytes_);
+
+        HistoryRecord record;
+        if (!Put(*index, nullptr, &record))
+            return false;
+        if (ftruncate(fd_, end_) < 0 || fsync(fd_) < 0) {
+            PErr() << "sync " << path_;
+            return false;
+        }
+
+        uint8_t header[kHeaderSize] = {};
+        memcpy(header, kMagic, sizeof(kMagic));
+        PutU32(header + 4, kVersion);
+        PutU64(header + 8, record.offset());
+        PutU32(header + 16, record.length());
+        if (!WriteAt(0, header, sizeof(header)))
+            return false;
+        if (fsync(fd_) < 0) {
+            PErr() << "sync " << path_;
+            return false;
+        }
+        return true;
+    }
+
+    void AddDeadBytes(uint64_t bytes) { dead_bytes_ += bytes; }
+    uint64_t dead_bytes() const { return dead_bytes_; }
+
+  private:
+    std::string path_;
+    int fd_;
+    uint64_t end_;
+    uint64_t dead_bytes_ = 0;
+    std::string buffer_;
+};
+
+} // anonymous namespace
+
+static void
+MarkPollRefs(const RaceModel& model, std::vector<int>* remap)
+{
+    for (const auto& ref : model.poll_refs()) {
+        if (ref.index() >= 0 && (size_t)ref.index() < remap->size())
+            (*remap)[ref.index()] = 0;
+    }
+}
+
+// Mark every poll table entry that |day| refers to.
+static void
+MarkPollRefs(const ModelData& day, std::vector<int>* remap)
+{
+    MarkPollRefs(day.national(), remap);
+    MarkPollRefs(day.generic_ballot(), remap);
+    for (const auto& model : day.states())
+        MarkPollRefs(model, remap);
+    for (const auto& model : day.senate_races())
+        MarkPollRefs(model, remap);
+    for (const auto& model : day.gov_races())
+        MarkPollRefs(model, remap);
+    for (const auto& model : day.house_races())
+        MarkPollRefs(model, remap);
+}
+
+static void
+RemapPollRefs(RaceModel* model, const std::vector<int>& remap)
+{
+    for (auto& ref : *model->mutable_poll_refs()) {
+        if (ref.index() >= 0 && (size_t)ref.index() < remap.size())
+            ref.set_index(remap[ref.index()]);
+    }
+}
+
+static void
+RemapPollRefs(ModelData* day, const std::vector<int>& remap)
+{
+    RemapPollRefs(day->mutable_national(), remap);
+    RemapPollRefs(day->mutable_generic_ballot(), remap);
+    for (auto& model : *day->mutable_states())
+        RemapPollRefs(&model, remap);
+    for (auto& model : *day->mutable_senate_races())
+        RemapPollRefs(&model, remap);
+    for (auto& model : *day->mutable_gov_races())
+        RemapPollRefs(&model, remap);
+    for (auto& model : *day->mutable_house_races())
+        RemapPollRefs(&model, remap);
+}
+
+// Write a new file from scratch, and move it over the old one. Days that have
+// not changed are copied from |old| as is, if it has them.
+//
+// The campaign's poll table only ever grows while runs update the file, so
+// entries that no day refers to any more, such as revised or removed polls,
+// are dropped here, and the days' references are renumbered.
+static bool
+RewriteHistory(const std::string& path, const CampaignData& campaign,
+               const std::vector<const ModelData*>& history,
+               const std::function<bool(const ModelData&)>& changed,
+               const HistoryReader* old)
+{
+    // Return the full day, decoding it from |old| if it is copied from there,
+    // since the day in |history| may only be a summary.
+    auto load_day = [&](const ModelData* day, ModelData* storage) -> const ModelData* {
+        size_t old_day = old ? old->FindDay(day->date()) : 0;
+        if (old && old_day < old->num_days() && !changed(*day))
+            return old->ReadDay(old_day, storage) ? storage : nullptr;
+        return day;
+    };
+
+    // Entry i of |remap| is the new index of poll table entry i, or -1 if no
+    // day refers to it.
+    std::vector<int> remap(campaign.polls_size(), -1);
+    for (const ModelData* day : history) {
+        ModelData storage;
+        const ModelData* full = load_day(day, &storage);
+        if (!full)
+            return false;
+        MarkPollRefs(*full, &remap);
+    }
+    int live_polls = 0;
+    for (auto& entry : remap) {
+        if (entry >= 0)
+            entry = live_polls++;
+    }
+    bool compact = live_polls < campaign.polls_size();
+
+    CampaignData compacted;
+    if (compact) {
+        compacted = campaign;
+        compacted.clear_polls();
+        compacted.mutable_polls()->Reserve(live_polls);
+        for (int i = 0; i < campaign.polls_size(); i++) {
+            if (remap[i] >= 0)
+                *compacted.add_polls() = campaign.polls(i);
+        }
+    }
+
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PErr() << "open " << tmp_path;
+        return false;
+    }
+
+    HistoryWriter writer(tmp_path, fd, kHeaderSize);
+    HistoryIndex index;
+    bool ok = writer.Put(compact ? compacted : campaign, nullptr, index.mutable_campaign());
+    for (const ModelData* day : history) {
+        if (!ok)
+            break;
+
+        auto record = index.add_days();
+        *record->mutable_date() = day->date();
+
+        if (compact) {
+            ModelData storage;
+            const ModelData* full = load_day(day, &storage);
+            if (!full) {
+                ok = false;
+                break;
+            }
+            ModelData renumbered = (full == &storage) ? std::move(storage) : *full;
+            RemapPollRefs(&renumbered, remap);
+            ok = writer.Put(renumbered, nullptr, record);
+            Summarize(renumbered, record->mutable_summary());
+            continue;
+        }
+
+        size_t old_day = old ? old->FindDay(day->date()) : 0;
+        if (old && old_day < old->num_days() && !changed(*day)) {
+            std::string_view bytes;
+            ok = old->ReadRawDay(old_day, &bytes) && writer.Put(bytes, nullptr, record);
+            *record->mutable_summary() = old->index().days(old_day).summary();
+        } else {
+            ok = writer.Put(*day, nullptr, record);
+            Summarize(*day, record->mutable_summary());
+        }
+    }
+    ok = ok && writer.Finish(&index);
+    close(fd);
+
+    if (ok && rename(tmp_path.c_str(), path.c_str()) < 0) {
+        PErr() << "rename " << tmp_path;
+        ok = false;
+    }
+    if (!ok)
+        unlink(tmp_path.c_str());
+    return ok;
+}
+
+static bool
+UpdateHistory(const std::string& path, const CampaignData& campaign,
+              const std::vector<const ModelData*>& history,
+              const std::function<bool(const ModelData&)>& changed,
+              const HistoryReader& reader, bool* needs_rewrite)
+{
+    const HistoryIndex& old_index = reader.index();
+
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        PErr() << "open " << path;
+        return false;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) < 0) {
+        PErr() << "fstat " << path;
+        close(fd);
+        return false;
+    }
+
+    HistoryWriter writer(path, fd, s.st_size);
+
+    // The old index is dead once the new one is written.
+    writer.AddDeadBytes(old_index.dead_bytes() + kPrefixSize + old_index.ByteSizeLong());
+
+    std::vector<bool> kept(reader.num_days());
+    uint64_t live_bytes = 0;
+
+    HistoryIndex index;
+    bool ok = writer.Put(campaign, &old_index.campaign(), index.mutable_campaign());
+    for (const ModelData* day : history) {
+        if (!ok)
+            break;
+
+        const HistoryRecord* old = nullptr;
+        if (size_t old_day = reader.FindDay(day->date()); old_day < reader.num_days()) {
+            old = &old_index.days(old_day);
+            kept[old_day] = true;
+        }
+
+        auto record = index.add_days();
+        if (old && !changed(*day)) {
+            *record = *old;
+        } else {
+            ok = writer.Put(*day, old, record);
+            *record->mutable_date() = day->date();
+            Summarize(*day, record->mutable_summary());
+        }
+        live_bytes += kPrefixSize + record->capacity();
+    }
+
+    // Days that are no longer in the history.
+    for (size_t i = 0; i < kept.size(); i++) {
+        if (!kept[i])
+            writer.AddDeadBytes(kPrefixSize + old_index.days(i).capacity());
+    }
+
+    ok = ok && writer.Finish(&index);
+    close(fd);
+
+    // Compact once more than half of the file is unused.
+    if (ok)
+        *needs_rewrite = writer.dead_bytes() > live_bytes;
+    return ok;
+}
+
+bool
+SaveHistory(const std::string& path, const CampaignData& campaign,
+            const std::vector<const ModelData*>& history,
+            const std::function<bool(const ModelData&)>& changed)
+{
+    assert(campaign.history().empty());
+
+    bool ok;
+    if (access(path.c_str(), F_OK) == 0) {
+        HistoryReader reader;
+        if (!reader.Open(path)) {
+            Err() << "Could not read " << path << ", rewriting it.";
+            ok = RewriteHistory(path, campaign, history, changed, nullptr);
+        } else {
+            bool needs_rewrite = false;
+            ok = UpdateHistory(path, campaign, history, changed, reader, &needs_rewrite);
+            if (ok && needs_rewrite) {
+                // Every day is in the updated file, so all of them are copied.
+                HistoryReader updated;
+                auto unchanged = [](const ModelData&) -> bool { return false; };
+                ok = updated.Open(path) &&
+                     RewriteHistory(path, campaign, history, unchanged, &updated);
+            } else if (!ok) {
+                // A failed update only appended, and never moved the header,
+                // so the old index and its records are untouched and can
+                // still be copied from the old mapping.
+                Err() << "Could not update " << path << ", rewriting it.";
+                ok = RewriteHistory(path, campaign, history, changed, &reader);
+            }
+        }
+    } else {
+        ok = RewriteHistory(path, campaign, history, changed, nullptr);
+    }
+    return ok;
+}
+
+} // namespace stone
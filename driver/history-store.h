@@ -0,0 +1,132 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <proto/history.pb.h>
+
+namespace stone {
+
+// Campaign history is stored as one record per day, so that a run only has to
+// write the days that changed, and readers only have to decode the days they
+// use. The layout is:
+//
+//    Header       "STNH", u32 version, u64 index offset, u32 index length,
+//                 u32 reserved
+//    Records      u32 length, then a serialized message, then unused bytes
+//                 up to the record's capacity
+//    Index        a record holding a HistoryIndex
+//
+// Integers are little-endian. The campaign record is a CampaignData with an
+// empty history, and the index lists every day's record along with a summary
+// of the day. Records are never overwritten: an update appends the days that
+// changed and a new index, syncs them, and only then points the header at the
+// new index. Until then the old index and every record it refers to are
+// intact, so a crash mid-update leaves the previous history readable. Space
+// left behind by replaced records is reclaimed by rewriting the file once it
+// is more than half unused. A rewrite also drops the campaign's poll table
+// entries that no day refers to, and renumbers the days' references.
+static constexpr char kHistoryFile[] = "history.dat";
+
+class HistoryReader
+{
+  public:
+    HistoryReader() {}
+    HistoryReader(const HistoryReader&) = delete;
+    ~HistoryReader();
+
+    // Map the file and parse its index. No day is decoded until asked for.
+    bool Open(const std::string& path);
+
+    const HistoryIndex& index() const { return index_; }
+    size_t num_days() const { return index_.days_size(); }
+    const Date& date(size_t day) const { return index_.days(day).date(); }
+
+    // Return the position of the day with the given date, or num_days().
+    size_t FindDay(const Date& date) const;
+
+    bool ReadCampaign(CampaignData* out) const;
+    bool ReadDay(size_t day, ModelData* out) const;
+
+    // Fill in only the date and the summarized fields of a day.
+    void ReadSummary(size_t day, ModelData* out) const;
+
+    // Return a day's serialized record, without decoding it.
+    bool ReadRawDay(size_t day, std::string_view* out) const;
+
+    // Read the campaign, with every day as a summary.
+    bool ReadSummaries(CampaignData* out) const;
+
+    // Read the campaign and every day. Readers that only need some days, or
+    // only summaries, should use ReadDay or ReadSummaries instead.
+    bool ReadAll(CampaignData* out) const;
+
+    HistoryReader& operator =(const HistoryReader&) = delete;
+
+  private:
+    bool Read(const HistoryRecord& record, google::protobuf::MessageLite* out) const;
+    bool ReadRaw(const HistoryRecord& record, std::string_view* out) const;
+
+  private:
+    std::string path_;
+    const uint8_t* map_ = nullptr;
+    size_t size_ = 0;
+    HistoryIndex index_;
+    std::unordered_map<int, size_t> days_by_date_;
+};
+
+// A history imported with only a summary of each day, which is what a run
+// reads for days it does not recompute. Full days are decoded when they are
+// needed, for example to render them. The file stays mapped, so it can be
+// saved over while this is in use.
+class LazyHistory
+{
+  public:
+    // Read the campaign, with every day as a summary.
+    bool Open(const std::string& path, CampaignData* out);
+
+    // If |day| is still a summary, replace it with the full day. This is not
+    // thread-safe.
+    bool Load(ModelData* day);
+
+    // Stop tracking a day that is being recomputed.
+    void Forget(const Date& date);
+
+  private:
+    HistoryReader reader_;
+    std::unordered_set<int> summaries_;
+};
+
+// Save |campaign|, with |history| as its days, newest first, to |path|. The
+// campaign's own history must be empty. If the file already exists, only days
+// for which |changed| returns true, or that are not in the file yet, are
+// written. Other days keep their existing record, so they may be summaries
+// from a LazyHistory. Days are only read, so other threads may read them at
+// the same time.
+bool SaveHistory(const std::string& path, const CampaignData& campaign,
+                 const std::vector<const ModelData*>& history,
+                 const std::function<bool(const ModelData&)>& changed);
+
+} // namespace stone
@@ -35,6 +35,7 @@
 #include <amtl/experimental/am-argparser.h>
 #include <inja/inja.hpp>
 #include "campaign.h"
+#include "history-store.h"
 #include "logging.h"
 #include "mathlib.h"
 #include "utility.h"
@@ -143,7 +144,7 @@ SuffixedName(const std::string& name, const Date& d)
 }
 
 bool
-Renderer::Generate()
+Renderer::Begin(const Date& latest_date)
 {
     if (dir_.empty()) {
         Err() << "Missing tpl-dir in config.";
@@ -161,10 +162,7 @@ Renderer::Generate()
     if (!CopyNonTemplateFiles())
         return false;
 
-    if (data_.history().empty()) {
-        Err() << "No history to generate";
-        return false;
-    }
+    latest_date_ = latest_date;
 
     // Determine if we are backdating.
     {
@@ -186,86 +184,89 @@ Renderer::Generate()
     FileTime latest_mod;
     if (!CalcLatestUpdate(&latest_mod))
         return false;
-    bool regen_all = last_gen_time < latest_mod;
+    regen_all_ = last_gen_time < latest_mod;
 
     // Get the latest index file we last wrote.
-    std::optional<Date> last_gen_date;
     auto last_date_string = cx_->GetCache("htmlgen.last_date", "");
     if (!last_date_string.empty()) {
         Date date;
         if (ParseYyyyMmDd(last_date_string, &date))
-            last_gen_date.emplace(date);
-    }
-    if (!last_gen_date.has_value())
-        regen_all = true;
-
-    bool all_rendered = true;
-    const ModelData* prev = nullptr;
-    for (auto iter = data_.history().rbegin(); iter != data_.history().rend(); iter++) {
-        const auto& model = *iter;
-
-        // Don't regenerate backdated entries unless they're missing.
-        auto index_path = SuffixedName("index.html", model.date());
-
-        // Note: always regenerate the last date we generated, since we
-        // need to update the "Next" link.
-        bool should_regen = false;
-        if (regen_all)
-            should_regen = true;
-        if (!should_regen && !OutputExists(index_path))
-            should_regen = true;
-        if (!should_regen && last_gen_date && model.date() == *last_gen_date)
-            should_regen = true;
-        if (!should_regen) {
-            auto gen_time_s = std::chrono::seconds{UtcToLocal(model.generated())};
-            auto gen_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(gen_time_s);
-            FileTime gen_time = FileTime{gen_time_ns};
-            FileTime file_time;
-            if (GetFileModTime(OutputPath(index_path), &file_time))
-                should_regen |= gen_time > file_time;
-            else
-                should_regen = true;
-        }
+            last_gen_date_.emplace(date);
+    }
+    if (!last_gen_date_.has_value())
+        regen_all_ = true;
+    return true;
+}
 
-        if (!should_regen) {
-            prev = &model;
-            continue;
-        }
+bool
+Renderer::ShouldRender(const ModelData& model)
+{
+    if (regen_all_)
+        return true;
 
-        const ModelData* this_model = &model;
-        auto task = [this, this_model, prev, &all_rendered,
-                     index_path{std::move(index_path)}](ThreadPool*) -> void
-        {
-            HtmlGenerator generator(this, *this_model, prev);
-            all_rendered &= generator.RenderMain(index_path);
-        };
-        cx_->workers().Do(std::move(task));
+    // Don't regenerate backdated entries unless they're missing.
+    auto index_path = SuffixedName("index.html", model.date());
+    if (!OutputExists(index_path))
+        return true;
 
-        prev = &model;
-    }
+    // Note: always regenerate the last date we generated, since we need to
+    // update the "Next" link.
+    if (last_gen_date_ && model.date() == *last_gen_date_)
+        return true;
+
+    auto gen_time_s = std::chrono::seconds{UtcToLocal(model.generated())};
+    auto gen_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(gen_time_s);
+    FileTime gen_time = FileTime{gen_time_ns};
+    FileTime file_time;
+    if (!GetFileModTime(OutputPath(index_path), &file_time))
+        return true;
+    return gen_time > file_time;
+}
+
+void
+Renderer::RenderDay(const ModelData& model, const ModelData* prev)
+{
+    HtmlGenerator generator(this, model, prev);
+    if (!generator.RenderMain(SuffixedName("index.html", model.date())))
+        all_rendered_ = false;
 
+    if (!RunGraphCommands(false))
+        all_rendered_ = false;
+}
+
+void
+Renderer::RenderLatest(const ModelData& model)
+{
     if (data_.presidential_year()) {
-        cx_->workers().Do([this](ThreadPool*) -> void {
-            int index = (data_.history()[0].date() <= data_.election_day())
-                        ? 0 : 1;
-            HtmlGenerator generator(this, data_.history()[index], nullptr);
-            generator.RenderWrongometer();
-        });
-    }
-
-    cx_->workers().Do([this](ThreadPool*) -> void {
-        int index = (data_.history()[0].date() <= data_.election_day())
-                    ? 0 : 1;
-        HtmlGenerator generator(this, data_.history()[index], nullptr);
-        generator.RenderVoteShareGraphs();
-    });
+        HtmlGenerator generator(this, model, nullptr);
+        generator.RenderWrongometer();
+    }
 
-    cx_->workers().RunCompletionTasks();
+    HtmlGenerator generator(this, model, nullptr);
+    generator.RenderVoteShareGraphs();
+}
+
+void
+Renderer::StartGraphs()
+{
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        graphs_ready_ = true;
+    }
+    if (!RunGraphCommands(true))
+        all_rendered_ = false;
+}
 
-    if (!all_rendered)
+bool
+Renderer::Finish()
+{
+    if (data_.history().empty()) {
+        Err() << "No history to generate";
         return false;
+    }
 
-    if (!GenerateGraphs())
+    // Anything queued after the last batch.
+    if (!RunGraphCommands(true) || !all_rendered_)
         return false;
 
     // Don't symlink to the final results, force a click-through to a special
@@ -291,41 +292,43 @@ Renderer::Generate()
     return true;
 }
 
+// Starting generate-graph is slow, so commands are run in batches of at least
+// this many, except for the last one.
+static constexpr size_t kGraphBatchSize = 32;
+
 bool
-Renderer::GenerateGraphs()
+Renderer::RunGraphCommands(bool all)
 {
-    Out() << "Generating graphs...";
+    std::vector<std::vector<std::string>> commands;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (!graphs_ready_)
+            return true;
+        if (graph_commands_.empty() || (!all && graph_commands_.size() < kGraphBatchSize))
+            return true;
+        commands = std::move(graph_commands_);
+        graph_commands_.clear();
+    }
 
     std::vector<std::string> base_argv = {
         GetExecutableDir() + "/generate-graph",
-        cx_->PathTo("history.bin"),
+        cx_->PathTo(kHistoryFile),
         "batch"s,
     };
 
     // Divvy up commands between all available threads.
-    size_t num_threads = cx_->workers().NumThreads();
-    std::vector<std::vector<std::string>> tasks;
-
-    size_t batch = 0;
-    while (!graph_commands_.empty()) {
-        if (batch >= tasks.size())
-            tasks.push_back(base_argv);
-
-        ke::MoveExtend(&tasks[batch], &graph_commands_.back());
-        graph_commands_.pop_back();
-
-        batch = (batch + 1) % num_threads;
-    }
+    size_t num_batches = std::max(std::min(commands.size() / kGraphBatchSize,
+                                           cx_->workers().NumThreads()),
+                                  size_t(1));
+    std::vector<std::vector<std::string>> batches(num_batches, base_argv);
+    for (size_t i = 0; i < commands.size(); i++)
+        ke::MoveExtend(&batches[i % num_batches], &commands[i]);
 
     std::atomic<bool> ok = true;
-    while (!tasks.empty()) {
-        auto argv = ke::PopBack(&tasks);
-        auto task =[&ok, argv{std::move(argv)}](ThreadPool*) -> void {
-            ok.store(ok.load() && Run(argv));
-        };
-        cx_->workers().Do(std::move(task));
-    }
-    cx_->workers().RunCompletionTasks();
+    cx_->workers().ForEach(batches.size(), [&](size_t i) -> void {
+        if (!Run(batches[i]))
+            ok = false;
+    });
     return ok.load();
 }
 
@@ -654,7 +657,7 @@ HtmlGenerator::RenderMain(const std::string& path)
     nlohmann::json& obj = main_;
     obj["year"] = campaign_.election_day().year();
 
-    obj["for_today"] = (data_.date() == campaign_.history()[0].date());
+    obj["for_today"] = (data_.date() == renderer_->latest_date());
     obj["backdated"] = renderer_->backdating();
     obj["is_prediction"] = is_prediction_;
 
@@ -871,7 +874,7 @@ HtmlGenerator::RenderMain(const std::string& path)
 
     bool has_gov_polls = false;
     for (const auto& race : data_.gov_races()) {
-        if (!race.polls().empty()) {
+        if (!race.poll_refs().empty()) {
             has_gov_polls = true;
             break;
         }
@@ -920,7 +923,7 @@ HtmlGenerator::RenderMain(const std::string& path)
 
     bool has_house_polls = false;
     for (const auto& race : *house_races) {
-        if (!race.polls().empty()) {
+        if (!race.poll_refs().empty()) {
             has_house_polls = true;
             break;
         }
@@ -1027,7 +1030,7 @@ HtmlGenerator::RenderVoteShareGraphs()
         obj["race_type"] = "President";
 
         for (const auto& model : data_.states()) {
-            if (model.polls().empty())
+            if (model.poll_refs().empty())
                 continue;
 
             const auto& info = campaign_.states()[model.race_id()];
@@ -1064,7 +1067,7 @@ HtmlGenerator::RenderVoteShareGraphs()
         obj["race_type"] = "Senate";
 
         for (const auto& model : data_.senate_races()) {
-            if (model.polls().empty())
+            if (model.poll_refs().empty())
                 continue;
 
             const auto& info = campaign_.senate().races()[model.race_id()];
@@ -1134,13 +1137,13 @@ HtmlGenerator::RenderStates()
             entry["class"] = "margin_row_normal";
         }
 
-        const RepeatedPoll* prev_polls = nullptr;
+        const RepeatedPollRef* prev_polls = nullptr;
         if (auto iter = prev_states.find(state.race_id()); iter != prev_states.end()) {
             RenderDelta(entry, iter->second->margin(), state.margin());
-            prev_polls = &iter->second->polls();
+            prev_polls = &iter->second->poll_refs();
         }
 
-        if (!AddPollData(entry, state.polls(), prev_polls))
+        if (!AddPollData(entry, state.poll_refs(), prev_polls))
             return false;
 
         out_entries.emplace_back(std::move(entry));
@@ -1166,7 +1169,7 @@ HtmlGenerator::RenderSenate()
     int dem_given = 0, gop_given = 0;
     for (const auto& race : data_.senate_races()) {
         // Exclude likely races for which no polling exists.
-        if (race.polls().empty() && !race.rating().empty()) {
+        if (race.poll_refs().empty() && !race.rating().empty()) {
             if (race.rating() == "gop")
                 gop_given++;
             else if (race.rating() == "dem")
@@ -1219,15 +1222,15 @@ HtmlGenerator::RenderSenate()
             entry["class"] = "margin_row_normal";
         }
 
-        const RepeatedPoll* prev_polls = nullptr;
+        const RepeatedPollRef* prev_polls = nullptr;
         if (auto iter = prev_races.find(race.race_id()); iter != prev_races.end()) {
-            prev_polls = &iter->second->polls();
+            prev_polls = &iter->second->poll_refs();
             if (!race.too_close_to_call()) {
                 RenderDelta(entry, iter->second->margin(), race.margin());
             }
         }
 
-        if (!AddPollData(entry, race.polls(), prev_polls))
+        if (!AddPollData(entry, race.poll_refs(), prev_polls))
             return false;
 
         out_entries.emplace_back(std::move(entry));
@@ -1307,7 +1310,7 @@ HtmlGenerator::RenderHouse()
     std::deque<const RaceModel*> races;
     for (const auto& race : data_.house_races()) {
         // Skip likely races.
-        if (race.polls().empty() && ke::StartsWith(race.rating(), "likely")) {
+        if (race.poll_refs().empty() && ke::StartsWith(race.rating(), "likely")) {
             add_implied_seat(race);
             continue;
         }
@@ -1318,7 +1321,7 @@ HtmlGenerator::RenderHouse()
     if (!is_prediction_) {
         bool no_polls = true;
         for (const auto& race : prev_data_->house_races()) {
-            if (!race.polls().empty()) {
+            if (!race.poll_refs().empty()) {
                 no_polls = false;
                 break;
             }
@@ -1336,14 +1339,14 @@ HtmlGenerator::RenderHouse()
     //
     // If everything else is equal, we sort by district name, which is unique.
     std::sort(races.begin(), races.end(), [&](const RaceModel* a, const RaceModel* b) -> bool {
-        if (a->polls().empty() || b->polls().empty()) {
+        if (a->poll_refs().empty() || b->poll_refs().empty()) {
             if (a->win_prob() > b->win_prob())
                 return true;
             if (a->win_prob() < b->win_prob())
                 return false;
-            if (a->polls().empty() && !b->polls().empty())
+            if (a->poll_refs().empty() && !b->poll_refs().empty())
                 return true;
-            if (!a->polls().empty() && b->polls().empty())
+            if (!a->poll_refs().empty() && b->poll_refs().empty())
                 return false;
         } else {
             if (a->margin() > b->margin())
@@ -1419,7 +1422,7 @@ HtmlGenerator::RenderHouse()
             entry["name"] = ShortenDistrict(race_info.region()) + ": " + race_info.dem().name() +
                             " (D) - " + race_info.gop().name() + " (R)";
         }
-        if (!race->polls().empty()) {
+        if (!race->poll_refs().empty()) {
             AddPollWinner(entry, "margin", *race);
         } else if (is_prediction_) {
             // Only show the rating if no margin is available.
@@ -1442,7 +1445,7 @@ HtmlGenerator::RenderHouse()
             entry["class"] = "margin_row_normal";
         }
 
-        const RepeatedPoll* prev_polls = nullptr;
+        const RepeatedPollRef* prev_polls = nullptr;
         if (prev_data_) {
             // Since house races are added incrementally, show a margin change
             // even if there was no previous data.
@@ -1450,12 +1453,12 @@ HtmlGenerator::RenderHouse()
             double prev_margin = 0.0f;
             if (auto iter = prev_races.find(race->race_id()); iter != prev_races.end()) {
                 prev_race = &*iter->second;
-                prev_polls = &prev_race->polls();
+                prev_polls = &prev_race->poll_refs();
                 prev_margin = prev_race->margin();
             }
 
             if (prev_race && race->rating() != prev_race->rating() &&
-                !prev_race->rating().empty() && race->polls().empty())
+                !prev_race->rating().empty() && race->poll_refs().empty())
             {
                 if (prev_race->win_prob() < race->win_prob()) {
                     entry["dt_value"] = "Toward D";
@@ -1473,7 +1476,7 @@ HtmlGenerator::RenderHouse()
                 AddWinnerRating(entry, "rating", *prev_race);
         }
 
-        if (!AddPollData(entry, race->polls(), prev_polls))
+        if (!AddPollData(entry, race->poll_refs(), prev_polls))
             return false;
 
         out_entries.emplace_back(std::move(entry));
@@ -1505,13 +1508,13 @@ HtmlGenerator::RenderNational()
         entry["code"] = "national";
         entry["class"] = "margin_row_normal";
 
-        const RepeatedPoll* prev_polls = nullptr;
+        const RepeatedPollRef* prev_polls = nullptr;
         if (prev_data_) {
             RenderDelta(entry, prev_data_->national().margin(), data_.national().margin());
-            prev_polls = &prev_data_->national().polls();
+            prev_polls = &prev_data_->national().poll_refs();
         }
 
-        if (!AddPollData(entry, data_.national().polls(), prev_polls))
+        if (!AddPollData(entry, data_.national().poll_refs(), prev_polls))
             return false;
         out_entries.emplace_back(std::move(entry));
     }
@@ -1525,13 +1528,13 @@ HtmlGenerator::RenderNational()
         entry["code"] = "generic_ballot";
         entry["class"] = "margin_row_normal";
 
-        const RepeatedPoll* prev_polls = nullptr;
+        const RepeatedPollRef* prev_polls = nullptr;
         if (prev_data_) {
             RenderDelta(entry, prev_data_->generic_ballot().margin(), race.margin());
-            prev_polls = &prev_data_->generic_ballot().polls();
+            prev_polls = &prev_data_->generic_ballot().poll_refs();
         }
 
-        if (!AddPollData(entry, race.polls(), prev_polls))
+        if (!AddPollData(entry, race.poll_refs(), prev_polls))
             return false;
         out_entries.emplace_back(std::move(entry));
     }
@@ -1557,7 +1560,7 @@ HtmlGenerator::RenderGovernor()
     int dem_given = 0, gop_given = 0;
     for (const auto& race : data_.gov_races()) {
         // Exclude likely races for which no polling exists.
-        if (race.polls().empty() && !race.rating().empty()) {
+        if (race.poll_refs().empty() && !race.rating().empty()) {
             if (race.rating() == "gop")
                 gop_given++;
             else if (race.rating() == "dem")
@@ -1605,15 +1608,15 @@ HtmlGenerator::RenderGovernor()
         // No tipping point, there is no body or congress of governors.
         entry["class"] = "margin_row_normal";
 
-        const RepeatedPoll* prev_polls = nullptr;
+        const RepeatedPollRef* prev_polls = nullptr;
         if (auto iter = prev_races.find(race.race_id()); iter != prev_races.end()) {
-            prev_polls = &iter->second->polls();
+            prev_polls = &iter->second->poll_refs();
             if (!race.too_close_to_call() && !prev_polls->empty()) {
                 RenderDelta(entry, iter->second->margin(), race.margin());
             }
         }
 
-        if (!AddPollData(entry, race.polls(), prev_polls))
+        if (!AddPollData(entry, race.poll_refs(), prev_polls))
             return false;
 
         out_entries.emplace_back(std::move(entry));
@@ -1631,7 +1634,7 @@ HtmlGenerator::RenderGovernor()
 void
 HtmlGenerator::AddNav()
 {
-    const auto& latest_date = campaign_.history()[0].date();
+    const auto& latest_date = renderer_->latest_date();
 
     nlohmann::json nav;
     if (prev_data_)
@@ -1714,11 +1717,11 @@ HtmlGenerator::RenderMap(const std::string& title, bool no_ties, const std::stri
 }
 
 bool
-HtmlGenerator::BuildPollRows(const std::vector<const Poll*>& polls, const std::string& icon,
+HtmlGenerator::BuildPollRows(const std::vector<const PollRef*>& refs, const std::string& icon,
                              std::vector<nlohmann::json>* out)
 {
-    for (const auto& ppoll : polls) {
-        const auto& poll = *ppoll;
+    for (const auto& ref : refs) {
+        const auto& poll = GetPoll(*ref);
         nlohmann::json pe;
         pe["icon"] = icon;
         pe["description"] = poll.description();
@@ -1740,7 +1743,7 @@ HtmlGenerator::BuildPollRows(const std::vector<const Poll*>& polls, const std::s
         else
             pe["gop"] = "";
         pe["url"] = poll.url();
-        pe["weight"] = poll.weight();
+        pe["weight"] = ref->weight();
         AddWinner(pe, "margin", RoundMargin(poll.margin()),
                   (!is_prediction_ && icon == "new") /* is_precise */,
                   icon == "new" /* allow_tbd */);
@@ -1750,27 +1753,28 @@ HtmlGenerator::BuildPollRows(const std::vector<const Poll*>& polls, const std::s
 }
 
 bool
-HtmlGenerator::AddPollData(nlohmann::json& obj, const RepeatedPoll& polls,
-                           const RepeatedPoll* prev_polls)
+HtmlGenerator::AddPollData(nlohmann::json& obj, const RepeatedPollRef& polls,
+                           const RepeatedPollRef* prev_polls)
 {
-    std::vector<const Poll*> new_polls, old_polls, aged_polls;
+    std::vector<const PollRef*> new_polls, old_polls, aged_polls;
 
     std::unordered_set<std::string> new_set, old_set;
-    for (const auto& poll : polls)
-        new_set.emplace(poll.id());
+    for (const auto& ref : polls)
+        new_set.emplace(GetPoll(ref).id());
     if (prev_polls) {
-        for (const auto& poll : *prev_polls) {
-            old_set.emplace(poll.id());
-            if (!new_set.count(poll.id()))
-                aged_polls.emplace_back(&poll);
+        for (const auto& ref : *prev_polls) {
+            const auto& id = GetPoll(ref).id();
+            old_set.emplace(id);
+            if (!new_set.count(id))
+                aged_polls.emplace_back(&ref);
         }
     }
 
-    for (const auto& poll : polls) {
-        if (old_set.count(poll.id()))
-            old_polls.emplace_back(&poll);
+    for (const auto& ref : polls) {
+        if (old_set.count(GetPoll(ref).id()))
+            old_polls.emplace_back(&ref);
         else
-            new_polls.emplace_back(&poll);
+            new_polls.emplace_back(&ref);
     }
 
     std::vector<nlohmann::json> rows;
@@ -1851,9 +1855,8 @@ HtmlGenerator::IsLatestPrediction()
 {
     if (!is_prediction_)
         return false;
-    if (campaign_.history()[0].date() > campaign_.election_day())
-        return data_.date() == campaign_.history()[1].date();
-    return data_.date() == campaign_.history()[0].date();
+    // Final results come the day after the election.
+    return data_.date() == std::min(renderer_->latest_date(), campaign_.election_day());
 }
 
 } // namespace stone
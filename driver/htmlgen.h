@@ -15,7 +15,9 @@
 // limitations under the License.
 #pragma once
 
+#include <atomic>
 #include <mutex>
+#include <optional>
 #include <string>
 
 #include <inja/inja.hpp>
@@ -30,7 +32,26 @@ class Renderer
   public:
     Renderer(Context* cx, const CampaignData& data);
 
-    bool Generate();
+    // Rendering happens in steps, so that each day can be rendered as soon as
+    // it is ready, while other days are still being computed:
+    //
+    //  1. Begin, with the date of the latest day that will be in the history.
+    //  2. RenderDay for each day that ShouldRender says needs it, once the day
+    //     and the day before it have their predictions. RenderLatest once
+    //     the latest day does. These can run in parallel with each other.
+    //  3. StartGraphs once the history file has been saved. It runs the graph
+    //     commands queued so far, and after that, RenderDay runs them in
+    //     batches as they are queued.
+    //  4. Finish, once everything else is done and |data|'s history has been
+    //     filled in.
+    //
+    // Until Finish, only the days passed in are read, not |data|'s history.
+    bool Begin(const Date& latest_date);
+    bool ShouldRender(const ModelData& model);
+    void RenderDay(const ModelData& model, const ModelData* prev);
+    void RenderLatest(const ModelData& model);
+    void StartGraphs();
+    bool Finish();
 
     std::string Render(const std::string& tpl, const nlohmann::json& obj);
     void RenderTo(const std::string& tpl, const nlohmann::json& obj, const std::string& path);
@@ -43,6 +64,7 @@ class Renderer
 
     int total_evs() const { return total_evs_; }
     bool backdating() const { return backdating_; }
+    const Date& latest_date() const { return latest_date_; }
     const CampaignData& campaign_data() { return data_; }
 
     std::string OutputPath(const std::string& path);
@@ -51,7 +73,7 @@ class Renderer
     bool OutputExists(const std::string& path);
     bool CalcLatestUpdate(FileTime* time);
     bool CopyNonTemplateFiles();
-    bool GenerateGraphs();
+    bool RunGraphCommands(bool all);
 
   private:
     Context* cx_;
@@ -64,10 +86,15 @@ class Renderer
     std::unordered_map<std::string, State> state_map_;
     int total_evs_ = 0;
     bool backdating_ = false;
+    Date latest_date_;
+    bool regen_all_ = false;
+    std::optional<Date> last_gen_date_;
+    std::atomic<bool> all_rendered_ = true;
 
     std::mutex lock_;
     std::unordered_map<std::string, std::string> doc_cache_;
     std::vector<std::vector<std::string>> graph_commands_;
+    bool graphs_ready_ = false;
 };
 
 class HtmlGenerator
@@ -80,7 +107,7 @@ class HtmlGenerator
     void RenderVoteShareGraphs();
 
   private:
-    typedef ::google::protobuf::RepeatedPtrField<Poll> RepeatedPoll;
+    typedef ::google::protobuf::RepeatedPtrField<PollRef> RepeatedPollRef;
 
     static constexpr double kSafeMargin = 5.0;
 
@@ -92,10 +119,13 @@ class HtmlGenerator
     bool AddMapEv(const std::string& prefix, const MapEv& evs, bool no_ties,
                   const std::string& dem = {}, const std::string& gop = {});
     void AddNav();
-    bool AddPollData(nlohmann::json& obj, const RepeatedPoll& polls,
-                     const RepeatedPoll* prev_polls);
-    bool BuildPollRows(const std::vector<const Poll*>& polls, const std::string& icon,
+    bool AddPollData(nlohmann::json& obj, const RepeatedPollRef& polls,
+                     const RepeatedPollRef* prev_polls);
+    bool BuildPollRows(const std::vector<const PollRef*>& refs, const std::string& icon,
                        std::vector<nlohmann::json>* out);
+    const Poll& GetPoll(const PollRef& ref) const {
+        return campaign_.polls(ref.index());
+    }
 
     void RenderMap(const std::string& title, bool no_ties, const std::string& path, MapEv* evs);
     bool RenderStates();
@@ -16,10 +16,16 @@
 #include <stdio.h>
 #include <sysexits.h>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
-#include <list>
+#include <iterator>
 #include <memory>
+#include <optional>
+#include <sstream>
+#include <vector>
 
+#include <amtl/am-string.h>
 #include <amtl/experimental/am-argparser.h>
 #include <google/protobuf/text_format.h>
 #include <proto/history.pb.h>
@@ -28,11 +34,17 @@
 #include "campaign.h"
 #include "context.h"
 #include "datasource-538.h"
+#include "feed-delta.h"
+#include "history-store.h"
 #include "htmlgen.h"
 #include "logging.h"
 #include "mathlib.h"
+#include "poll-index.h"
 #include "predict.h"
 #include "progress-bar.h"
+#include "race-cache.h"
+#include "scenario.h"
+#include "task-graph.h"
 #include "utility.h"
 
 using namespace ke;
@@ -40,7 +52,15 @@ using namespace ke;
 args::StringOption settings_file("settings_file", "Settings file");
 args::EnableOption reset_history(nullptr, "--reset-history", false, "Reset history (do not import)");
 args::EnableOption skip_html(nullptr, "--skip-html", false, "Do not generate HTML");
+args::EnableOption skip_history_text(nullptr, "--skip-history-text", false,
+                                      "Do not also save history as a text protobuf");
 args::IntOption num_threads(nullptr, "--num-threads", ke::Some(-1), "Number of threads");
+args::StringOption scenario_file(nullptr, "--scenarios", ke::Nothing(),
+                                 "Run what-if scenarios from a file, one per line, instead of "
+                                 "updating the campaign");
+args::StringOption scenario_date(nullptr, "--scenario-date", ke::Nothing(),
+                                 "Day of saved history to run scenarios against (YYYY-MM-DD), "
+                                 "instead of the latest");
 
 namespace stone {
 
@@ -53,8 +73,32 @@ class Driver final
 
   private:
     bool ImportHistory();
-    void RunForDay(const Date& date, const Feed* feed);
+    ModelData* SlotFor(const Date& date);
+    bool FindChangedDays();
+    TaskGraph::TaskId RunForDay(TaskGraph* graph, const Date& date, const Feed* feed,
+                                const FeedIndex* index);
+    bool ScheduleDays(TaskGraph* graph, const std::vector<TaskGraph::TaskId>& analyzed,
+                      Predictor* predictor, Renderer* renderer);
+
+    // A day's analysis is split into tasks. See RunForDay.
+    struct DayWork
+    {
+        Date date;
+        ModelData* data;
+        const ModelData* prev;
+        const Feed* feed;
+        const FeedIndex* index;
+        // Results of the state, Senate, and governor tasks, in that order.
+        ModelData scratch[3];
+        std::unique_ptr<HouseAnalysis> house;
+        std::vector<HouseAnalysis::Chunk> house_chunks;
+    };
+    size_t NumHouseChunks() const;
+    void AnalyzeDay(DayWork* day);
+    void AnalyzeRaces(DayWork* day, size_t task);
+    void FinishDay(DayWork* day);
     bool Export();
+    bool ExportText();
     void BuildFeedFromResults();
 
   private:
@@ -63,10 +107,27 @@ class Driver final
     Date today_;
     Feed feed_;
     Feed results_feed_;
+    std::unique_ptr<FeedIndex> feed_index_;
+    std::unique_ptr<FeedIndex> results_index_;
+    Feed assumed_feed_;
+    std::unique_ptr<FeedIndex> assumed_index_;
+    std::unique_ptr<PollTable> poll_table_;
+    RaceCache race_cache_;
+    FeedSnapshot feed_snapshot_;
+    // Days of history before this one (a DayNumber) are kept as is.
+    int recompute_from_;
     CampaignData out_;
-    std::list<ModelData> history_;
-    std::list<ModelData>::iterator history_pos_;
-    std::vector<std::function<void(ThreadPool*)>> work_;
+    LazyHistory lazy_history_;
+    // One slot per day, starting at first_day_ (a DayNumber). Slots without
+    // a date have no model yet. Slots are allocated before any work is
+    // queued, so workers can hold pointers into the vector.
+    int first_day_ = 0;
+    std::vector<ModelData> history_;
+    size_t imported_days_ = 0;
+    const ModelData* last_kept_day_ = nullptr;
+    // Indexed like history_, for days that get a new prediction.
+    std::vector<DaySurfaces> surfaces_;
+    std::atomic<bool> failed_ = false;
 };
 
 Driver::Driver(Context* cx, Campaign* cc)
@@ -96,6 +157,17 @@ Driver::Run()
         SortPolls(list.mutable_polls());
     for (auto& [_, list] : *feed_.mutable_governor_polls())
         SortPolls(list.mutable_polls());
+    for (auto& [_, list] : *feed_.mutable_house_polls())
+        SortPolls(list.mutable_polls());
+    feed_index_ = std::make_unique<FeedIndex>(feed_);
+    if (cc_->UsePollFilter()) {
+        PollFilter::Params params;
+        if (cc_->poll_filter_drift())
+            params.drift = cc_->poll_filter_drift();
+        // Same cutoff as the windowed average, see Analysis::FindRecentPolls.
+        params.cutoff = DayNumber(cc_->StartDate()) - 60;
+        feed_index_->BuildFilters(params);
+    }
 
     *out_.mutable_feed_info() = feed_.info();
     *out_.mutable_senate() = cc_->senate_map();
@@ -108,166 +180,479 @@ Driver::Run()
     out_.set_election_type(cc_->election_type());
     for (const auto& important_date : cc_->important_dates())
         *out_.mutable_important_dates()->Add() = important_date;
+    for (const auto& state : cc_->state_list())
+        *out_.add_states() = state;
+    for (const auto& [state_name, state_code] : kStateCodes)
+        (*out_.mutable_state_codes())[state_name] = state_code;
+    *out_.mutable_election_day() = cc_->EndDate();
+    *out_.mutable_start_date() = cc_->StartDate();
+
+    // Allocate every day of the campaign, plus the day after it for final
+    // results.
+    SlotFor(cc_->StartDate());
+    SlotFor(NextDay(cc_->EndDate()));
 
     if (!ImportHistory()) {
         Err() << "Failed to import history.";
         return false;
     }
-    history_pos_ = history_.begin();
+
+    // The imported history's poll table, if any, is in out_ now. Days saved
+    // before the table existed have their polls moved into it.
+    poll_table_ = std::make_unique<PollTable>(out_.mutable_polls());
+    for (auto& day : history_)
+        poll_table_->MoveToTable(&day);
+    poll_table_->AddFeed(*feed_index_);
+    StateAnalysis::BuildAssumedFeed(cc_, &assumed_feed_);
+    assumed_index_ = std::make_unique<FeedIndex>(assumed_feed_);
+    poll_table_->AddFeed(*assumed_index_);
+    if (!reset_history.value() && !race_cache_.Load(cx_))
+        return false;
+    if (!FindChangedDays())
+        return false;
 
     bool has_final_results = false;
     if (today_ == cc_->EndDate() && !cc_->race_results().empty()) {
         BuildFeedFromResults();
+        results_index_ = std::make_unique<FeedIndex>(results_feed_);
+        poll_table_->AddFeed(*results_index_);
         has_final_results = true;
     }
 
+    // Pages are rendered from the poll table while later days are analyzed,
+    // so every poll analysis can refer to must be in it by now.
+    poll_table_->Freeze();
+
+    // Everything from here until the pages are finished runs as one graph of
+    // tasks. A day is predicted as soon as it and every day before it are
+    // analyzed, and rendered as soon as its prediction is done, while later
+    // days are still being analyzed.
+    TaskGraph graph(&cx_->workers());
+    std::vector<TaskGraph::TaskId> analyzed(history_.size(), TaskGraph::kNoTask);
+
     Date day = cc_->StartDate();
     while (day <= today_) {
-        RunForDay(day, &feed_);
+        analyzed[DayNumber(day) - first_day_] =
+            RunForDay(&graph, day, &feed_, feed_index_.get());
         day = NextDay(day);
     }
-    if (has_final_results)
-        RunForDay(day, &results_feed_);
-
-    // Stuff starts getting submitted to the worker pool right here.
-    ProgressBar pbar("Analyzing polls ", work_.size());
-    for (auto& fn : work_) {
-        auto inc_pbar = [&pbar]() -> void {
-            pbar.Increment();
-        };
-        cx_->workers().Do(std::move(fn), std::move(inc_pbar));
+    if (has_final_results) {
+        analyzed[DayNumber(day) - first_day_] =
+            RunForDay(&graph, day, &results_feed_, results_index_.get());
     }
-    work_.clear();
 
-    // Wait for workers to finish up.
-    cx_->workers().RunCompletionTasks();
-    pbar.Finish();
-
-    out_.clear_history();
-    for (auto iter = history_.rbegin(); iter != history_.rend(); iter++)
-        *out_.add_history() = std::move(*iter);
-    history_.clear();
+    Predictor predictor(cx_, cc_, &out_);
+    std::unique_ptr<Renderer> renderer;
+    if (!skip_html.value())
+        renderer = std::make_unique<Renderer>(cx_, out_);
+    if (!ScheduleDays(&graph, analyzed, &predictor, renderer.get()))
+        return false;
 
-    out_.clear_states();
-    for (const auto& state : cc_->state_list())
-        *out_.add_states() = state;
-    for (const auto& [state_name, state_code] : kStateCodes)
-        (*out_.mutable_state_codes())[state_name] = state_code;
+    // Stuff starts getting submitted to the worker pool right here.
+    ProgressBar pbar("Updating        ", graph.num_tasks());
+    graph.set_on_task_done([&pbar]() -> void {
+        pbar.Increment();
+    });
+    graph.Run();
+    pbar.Finish();
 
-    *out_.mutable_election_day() = cc_->EndDate();
-    *out_.mutable_start_date() = cc_->StartDate();
+    if (failed_)
+        return false;
 
-    Predictor pr(cx_, cc_, &out_);
-    pr.Predict();
+    out_.mutable_history()->Reserve(history_.size());
+    for (auto iter = history_.rbegin(); iter != history_.rend(); iter++) {
+        if (iter->has_date())
+            *out_.add_history() = std::move(*iter);
+    }
+    history_.clear();
+    surfaces_.clear();
 
-    if (!Export())
+    if (!skip_history_text.value() && !ExportText())
+        return false;
+    if (!cx_->WriteCache())
         return false;
 
-    if (!skip_html.value()) {
-        Renderer renderer(cx_, out_);
-        if (!renderer.Generate())
+    if (renderer) {
+        if (!renderer->Finish())
             return false;
         cx_->WriteCache();
     }
     return true;
 }
 
-void
-Driver::RunForDay(const Date& date, const Feed* feed)
+// Add the tasks that analyze a day, and return the one that finishes it, or
+// kNoTask if the day is kept as is.
+TaskGraph::TaskId
+Driver::RunForDay(TaskGraph* graph, const Date& date, const Feed* feed, const FeedIndex* index)
 {
-    while (history_pos_ != history_.end()) {
-        if (history_pos_->date() < date) {
-            history_pos_++;
-            continue;
+    ModelData* data = SlotFor(date);
+    if (data->has_date()) {
+        if (DayNumber(date) < recompute_from_) {
+            last_kept_day_ = data;
+            return TaskGraph::kNoTask;
         }
-        if (history_pos_->date() == date)
-            break;
+        lazy_history_.Forget(date);
+        *data = {};
+    }
+
+    // Days that are not recomputed are never written to, so the workers can
+    // read the previous day to warm-start metamargin searches.
+    const ModelData* prev = nullptr;
+    if (last_kept_day_ && NextDay(last_kept_day_->date()) == date)
+        prev = last_kept_day_;
+    last_kept_day_ = nullptr;
+
+    // The day is analyzed in three steps, so that the expensive parts of
+    // different days, and of the same day, can run in parallel:
+    //
+    //  1. AnalyzeDay computes the national and generic ballot models, which
+    //     every race reads undecideds from.
+    //  2. AnalyzeRaces runs once for the states, the Senate, governors, and
+    //     each chunk of House races. Protobuf messages cannot be written from
+    //     two threads at once, so each task writes to its own scratch model or
+    //     House chunk, and only reads the day.
+    //  3. FinishDay merges the results into the day, once every AnalyzeRaces
+    //     task is done.
+    //
+    // Workers only write to the day's own slot, which does not move, since
+    // every slot was allocated up front.
+    auto day = std::make_shared<DayWork>();
+    day->date = date;
+    day->data = data;
+    day->prev = prev;
+    day->feed = feed;
+    day->index = index;
+    day->house_chunks.resize(NumHouseChunks());
+
+    auto national = graph->Add([this, day](ThreadPool*) -> void {
+        AnalyzeDay(day.get());
+    });
+    auto finished = graph->Add([this, day](ThreadPool*) -> void {
+        FinishDay(day.get());
+    });
+    for (size_t i = 0; i < std::size(day->scratch) + day->house_chunks.size(); i++) {
+        auto races = graph->Add([this, day, i](ThreadPool*) -> void {
+            AnalyzeRaces(day.get(), i);
+        }, {national});
+        graph->Depend(finished, races);
+    }
+    return finished;
+}
+
+static constexpr size_t kHouseChunkSize = 32;
+
+size_t
+Driver::NumHouseChunks() const
+{
+    return (cc_->house_map().races().size() + kHouseChunkSize - 1) / kHouseChunkSize;
+}
+
+void
+Driver::AnalyzeDay(DayWork* day)
+{
+    ModelData* data = day->data;
+    *data->mutable_date() = day->date;
+    data->set_generated(GetUtcTime());
+
+    {
+        StateAnalysis sa(cx_, cc_, day->feed, day->index, poll_table_.get(), data);
+        sa.set_race_cache(&race_cache_);
+        sa.AnalyzeNational();
     }
 
-    ModelData* data;
-    if (history_pos_ == history_.end() || history_pos_->date() > date) {
-        history_pos_ = history_.emplace(history_pos_);
+    // The day is read-only from here until FinishDay.
+    for (auto& scratch : day->scratch)
+        scratch = *data;
+
+    day->house = std::make_unique<HouseAnalysis>(cx_, cc_, day->feed, day->index,
+                                                 poll_table_.get(), data);
+    day->house->set_previous_day(day->prev);
+    day->house->set_race_cache(&race_cache_);
+    day->house->SelectRatings(today_);
+}
+
+void
+Driver::AnalyzeRaces(DayWork* day, size_t task)
+{
+    if (task == 0) {
+        StateAnalysis sa(cx_, cc_, day->feed, day->index, poll_table_.get(), &day->scratch[0]);
+        sa.set_assumed_polls(&assumed_feed_, assumed_index_.get());
+        sa.set_previous_day(day->prev);
+        sa.set_race_cache(&race_cache_);
+        sa.Analyze();
+    } else if (task == 1) {
+        SenateAnalysis sa(cx_, cc_, day->feed, day->index, poll_table_.get(), &day->scratch[1]);
+        sa.set_previous_day(day->prev);
+        sa.set_race_cache(&race_cache_);
+        sa.Analyze();
+    } else if (task == 2) {
+        GovernorAnalysis ga(cx_, cc_, day->feed, day->index, poll_table_.get(),
+                            &day->scratch[2]);
+        ga.set_race_cache(&race_cache_);
+        ga.Analyze();
     } else {
-        assert(history_pos_->date() == date);
-        if (history_pos_->date() < today_)
-            return;
-        *history_pos_ = {};
-    }
-    data = &*history_pos_;
-
-    // Note: the worker thread does not modify any data. The history is
-    // populated on the main thread. The "models" variable is considered
-    // stable even if history_pos_ or the list changes, because it is a
-    // linked list. A vector would not work.
-    auto work = [this, date, data, feed](ThreadPool* pool) -> void {
-        *data->mutable_date() = date;
-        data->set_generated(GetUtcTime());
-
-        {
-            StateAnalysis sa(cx_, cc_, feed, data);
-            sa.Analyze();
-        }
-        {
-            SenateAnalysis sa(cx_, cc_, feed, data);
-            sa.Analyze();
-        }
-        {
-            GovernorAnalysis ga(cx_, cc_, feed, data);
-            ga.Analyze();
+        size_t chunk = task - std::size(day->scratch);
+        size_t begin = chunk * kHouseChunkSize;
+        size_t end = std::min(begin + kHouseChunkSize, day->house->num_races());
+        day->house->AnalyzeRaces(begin, end, &day->house_chunks[chunk]);
+    }
+}
+
+void
+Driver::FinishDay(DayWork* day)
+{
+    for (auto& scratch : day->scratch) {
+        // Only merge what the task added.
+        scratch.clear_date();
+        scratch.clear_generated();
+        scratch.clear_national();
+        scratch.clear_generic_ballot();
+        scratch.clear_undecideds();
+        day->data->MergeFrom(scratch);
+        scratch.Clear();
+    }
+
+    day->house->Finish(&day->house_chunks);
+    day->house = nullptr;
+    day->house_chunks.clear();
+}
+
+// Add the tasks that predict, save, and render each day. |analyzed| holds the
+// task that finishes each slot's analysis, if it is recomputed.
+bool
+Driver::ScheduleDays(TaskGraph* graph, const std::vector<TaskGraph::TaskId>& analyzed,
+                     Predictor* predictor, Renderer* renderer)
+{
+    std::vector<size_t> slots;
+    for (size_t i = 0; i < history_.size(); i++) {
+        if (history_[i].has_date() || analyzed[i] != TaskGraph::kNoTask)
+            slots.emplace_back(i);
+    }
+    if (slots.empty())
+        return true;
+
+    // Recomputed days don't have a date until they're analyzed.
+    auto date_of = [this](size_t slot) -> Date {
+        return DateFromDayNumber(first_day_ + int(slot));
+    };
+    if (renderer && !renderer->Begin(date_of(slots.back())))
+        return false;
+
+    // A prediction uses every earlier day's analysis, through the prior sums,
+    // but not their predictions. So the tasks that add priors form a chain in
+    // date order, and each day is predicted as soon as the chain reaches it.
+    // Once a day needs a new prediction, every day after it does too.
+    //
+    // Kept days are only summaries until loaded. Loading is not thread-safe,
+    // so every kept day that a task will read in full is loaded now.
+    if (!predictor->Start(slots.size()))
+        return false;
+    surfaces_.resize(history_.size());
+
+    std::vector<TaskGraph::TaskId> predictions;
+    TaskGraph::TaskId priors = TaskGraph::kNoTask;
+    TaskGraph::TaskId prev_predicted = TaskGraph::kNoTask;
+    bool predicting = false;
+    ModelData* prev = nullptr;
+    for (size_t i = 0; i < slots.size(); i++) {
+        size_t slot = slots[i];
+        ModelData* data = &history_[slot];
+        bool kept = analyzed[slot] == TaskGraph::kNoTask;
+
+        TaskGraph::TaskId predicted = TaskGraph::kNoTask;
+        predicting |= !kept;
+        if (predicting) {
+            if (kept && !lazy_history_.Load(data))
+                return false;
+
+            DaySurfaces* surfaces = &surfaces_[slot];
+            auto built = graph->Add([predictor, data, surfaces](ThreadPool*) -> void {
+                predictor->BuildSurfaces(data, surfaces);
+            }, {analyzed[slot]});
+            predicted = graph->Add([this, predictor, data, surfaces, i](ThreadPool*) -> void {
+                if (!predictor->PredictDay(data, surfaces, i))
+                    failed_ = true;
+                *surfaces = {};
+            }, {built, priors});
+            predictions.emplace_back(predicted);
         }
-        {
-            HouseAnalysis ha(cx_, cc_, feed, data);
-            ha.Analyze(today_);
+        priors = graph->Add([predictor, data](ThreadPool*) -> void {
+            predictor->AddPrior(data);
+        }, {analyzed[slot], priors});
+
+        if (renderer && (predicting || renderer->ShouldRender(*data))) {
+            if (kept && !lazy_history_.Load(data))
+                return false;
+            if (prev && !lazy_history_.Load(prev))
+                return false;
+            graph->Add([renderer, data, prev](ThreadPool*) -> void {
+                renderer->RenderDay(*data, prev);
+            }, {predicted, prev_predicted});
         }
-    };
-    work_.emplace_back(std::move(work));
+        prev = data;
+        prev_predicted = predicted;
+    }
+
+    predictions.emplace_back(priors);
+    auto predicted_all = graph->Add(nullptr, predictions);
+
+    auto saved = graph->Add([this](ThreadPool*) -> void {
+        if (!failed_ && !Export())
+            failed_ = true;
+    }, {predicted_all});
+    if (!renderer)
+        return true;
+
+    graph->Add([this, renderer](ThreadPool*) -> void {
+        if (!failed_)
+            renderer->StartGraphs();
+    }, {saved});
+
+    // The final results page is not a prediction, so the summary pages use
+    // the day before it.
+    size_t latest = slots.back();
+    if (slots.size() > 1 && date_of(latest) > cc_->EndDate())
+        latest = slots[slots.size() - 2];
+    ModelData* latest_data = &history_[latest];
+    if (!lazy_history_.Load(latest_data))
+        return false;
+    graph->Add([renderer, latest_data](ThreadPool*) -> void {
+        renderer->RenderLatest(*latest_data);
+    }, {predicted_all});
+    return true;
 }
 
+// Compare the feed against the one from the previous run. Days from the first
+// one that a new, removed, or revised poll could affect are recomputed, rather
+// than just today.
 bool
-Driver::ImportHistory()
+Driver::FindChangedDays()
 {
-    if (reset_history.value())
+    feed_snapshot_ = TakeFeedSnapshot(feed_);
+    recompute_from_ = DayNumber(today_);
+
+    if (reset_history.value() || !imported_days_)
         return true;
-    if (!cx_->FileExists("history.bin"))
+    if (!cx_->FileExists("feed-snapshot.bin"))
         return true;
 
     std::string bits;
-    if (!cx_->Read("history.bin", &bits)) {
-        Err() << "History protobuf is empty.";
+    if (!cx_->Read("feed-snapshot.bin", &bits)) {
+        Err() << "Could not read feed snapshot.";
         return false;
     }
 
-    CampaignData data;
-    if (!data.ParseFromString(bits)) {
-        Err() << "Could not parse history protobuf.";
+    FeedSnapshot previous;
+    if (!previous.ParseFromString(bits)) {
+        Err() << "Could not parse feed snapshot protobuf.";
         return false;
     }
 
+    if (auto day = FindEarliestAffectedDay(previous, feed_snapshot_); day.has_value()) {
+        recompute_from_ = std::min(recompute_from_, day.value());
+        if (recompute_from_ < DayNumber(today_))
+            Out() << "Recomputing history from " << DateFromDayNumber(recompute_from_);
+    }
+    return true;
+}
+
+bool
+Driver::ImportHistory()
+{
+    if (reset_history.value())
+        return true;
+
+    // Days that are not recomputed only need their summaries, until they
+    // are rendered.
+    CampaignData data;
+    if (cx_->FileExists(kHistoryFile)) {
+        if (!lazy_history_.Open(cx_->PathTo(kHistoryFile), &data))
+            return false;
+    } else if (cx_->FileExists("history.bin")) {
+        // Older runs saved the whole campaign as one message.
+        std::string bits;
+        if (!cx_->Read("history.bin", &bits)) {
+            Err() << "History protobuf is empty.";
+            return false;
+        }
+        if (!data.ParseFromString(bits)) {
+            Err() << "Could not parse history protobuf.";
+            return false;
+        }
+    } else {
+        return true;
+    }
+
     if (data.election_day() != cc_->EndDate()) {
         Err() << "Saved campaign end date " << data.election_day()
               << " does not match settings: " << cc_->EndDate();
         return false;
     }
 
+    out_.mutable_polls()->Swap(data.mutable_polls());
     for (auto& entry : *data.mutable_history())
-        history_.emplace_front(std::move(entry));
+        *SlotFor(entry.date()) = std::move(entry);
+    imported_days_ = data.history_size();
     return true;
 }
 
+// Return the history slot for |date|. Days outside the campaign, which can
+// come from an imported history, grow the vector, so this must not be called
+// for such days once work has been queued.
+ModelData*
+Driver::SlotFor(const Date& date)
+{
+    int day = DayNumber(date);
+    if (history_.empty()) {
+        first_day_ = day;
+        history_.resize(1);
+    } else if (day < first_day_) {
+        history_.insert(history_.begin(), first_day_ - day, ModelData());
+        first_day_ = day;
+    } else if (size_t(day - first_day_) >= history_.size()) {
+        history_.resize(day - first_day_ + 1);
+    }
+    return &history_[day - first_day_];
+}
+
 bool
 Driver::Export()
 {
-    std::string str;
-    google::protobuf::TextFormat::PrintToString(out_, &str);
-    if (!cx_->Save(str, "history.text"))
+    // The days are still in their slots, and may be rendering, which only
+    // reads them.
+    std::vector<const ModelData*> days;
+    for (auto iter = history_.rbegin(); iter != history_.rend(); iter++) {
+        if (iter->has_date())
+            days.emplace_back(&*iter);
+    }
+
+    // Only days computed during this run need to be written.
+    auto last_updated = out_.last_updated();
+    auto changed = [last_updated](const ModelData& day) -> bool {
+        return day.generated() >= last_updated;
+    };
+    if (!SaveHistory(cx_->PathTo(kHistoryFile), out_, days, changed))
         return false;
 
-    str = {};
-    out_.SerializeToString(&str);
-    if (!cx_->Save(str, "history.bin"))
+    if (!race_cache_.Save(cx_))
         return false;
 
-    return cx_->WriteCache();
+    std::string str;
+    feed_snapshot_.SerializeToString(&str);
+    return cx_->Save(str, "feed-snapshot.bin");
+}
+
+bool
+Driver::ExportText()
+{
+    for (auto& day : *out_.mutable_history()) {
+        if (!lazy_history_.Load(&day))
+            return false;
+    }
+
+    std::string str;
+    google::protobuf::TextFormat::PrintToString(out_, &str);
+    return cx_->Save(str, "history.text");
 }
 
 static Poll
@@ -353,6 +738,105 @@ Driver::BuildFeedFromResults()
     }
 }
 
+static void
+PrintScenarioScores(const char* name, const std::optional<ScenarioScores>& scores)
+{
+    if (!scores)
+        return;
+
+    auto line = ke::StringPrintf("  %-6s mean %.1f, control %.1f%%", name, scores->mean,
+                                 scores->control_p * 100.0);
+    if (scores->metamargin)
+        line += ke::StringPrintf(", metamargin %+.2f", scores->metamargin.value());
+    Out() << line;
+}
+
+// Run each line of the scenario file against one saved day. Lines that are
+// empty or start with '#' are skipped.
+static bool
+RunScenarios(Context* cx, Campaign* cc)
+{
+    if (!cx->FileExists(kHistoryFile)) {
+        Err() << "No saved history to run scenarios against.";
+        return false;
+    }
+
+    HistoryReader reader;
+    if (!reader.Open(cx->PathTo(kHistoryFile)))
+        return false;
+    if (!reader.num_days()) {
+        Err() << "Saved history has no days.";
+        return false;
+    }
+
+    size_t day = 0;
+    if (scenario_date.hasValue()) {
+        Date date;
+        if (!ParseYyyyMmDd(scenario_date.value(), &date)) {
+            Err() << "Invalid scenario date: " << scenario_date.value();
+            return false;
+        }
+        day = reader.FindDay(date);
+        if (day == reader.num_days()) {
+            Err() << "No saved model for " << date;
+            return false;
+        }
+    } else {
+        // Like the summary pages, skip the final results day, which is not a
+        // prediction, unless it is the only day.
+        std::optional<size_t> latest;
+        for (size_t i = 0; i < reader.num_days(); i++) {
+            if (reader.date(i) > reader.date(day))
+                day = i;
+            if (reader.date(i) <= cc->EndDate() &&
+                (!latest || reader.date(i) > reader.date(*latest)))
+            {
+                latest = {i};
+            }
+        }
+        if (latest)
+            day = *latest;
+    }
+
+    ModelData data;
+    if (!reader.ReadDay(day, &data))
+        return false;
+
+    // Days saved before the poll table existed have their polls embedded,
+    // which the analysis treats differently from having none.
+    google::protobuf::RepeatedPtrField<Poll> polls;
+    PollTable poll_table(&polls);
+    poll_table.MoveToTable(&data);
+
+    std::string text;
+    if (!ReadFile(scenario_file.value(), &text))
+        return false;
+
+    ScenarioEngine engine(cc, data, &cx->workers());
+    Out() << "Scenarios for " << data.date() << ":";
+
+    bool ok = true;
+    std::istringstream lines(text);
+    for (std::string line; std::getline(lines, line);) {
+        auto first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        Scenario scenario;
+        ScenarioResult result;
+        if (!ParseScenario(line, &scenario) || !engine.Run(scenario, &result)) {
+            ok = false;
+            continue;
+        }
+
+        Out() << line;
+        PrintScenarioScores("EV", result.ev);
+        PrintScenarioScores("Senate", result.senate);
+        PrintScenarioScores("House", result.house);
+    }
+    return ok;
+}
+
 } // namespace stone
 
 using namespace stone;
@@ -383,6 +867,9 @@ int main(int argc, char** argv)
         return EX_USAGE;
     }
 
+    if (scenario_file.hasValue())
+        return RunScenarios(cx.get(), cc.get()) ? 0 : EX_SOFTWARE;
+
     Driver driver(cx.get(), cc.get());
     if (!driver.Run())
         return EX_SOFTWARE;
@@ -17,12 +17,21 @@
 #include <assert.h>
 
 #include <algorithm>
+#include <array>
+#include <complex>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <numeric>
 #include <unordered_set>
 
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
 #include <erfinv.h>
 #include "mathlib.h"
+#include "threadpool.h"
 
 namespace stone {
 
@@ -124,9 +133,15 @@ Cumsum(const std::vector<double>& values)
 
 double
 WeightedAverage(const std::vector<double>& weights)
+{
+    return WeightedAverage(weights, 0, weights.size());
+}
+
+double
+WeightedAverage(const std::vector<double>& weights, size_t begin, size_t end)
 {
     double average = 0.0;
-    for (size_t i = 0; i < weights.size(); i++)
+    for (size_t i = begin; i < end; i++)
         average += double(i) * weights[i];
     return average;
 }
@@ -147,11 +162,17 @@ WeightedAverage(const std::vector<double>& values, const std::vector<double>& we
 
 double
 WeightedStdDev(const std::vector<double>& weights, int mean)
+{
+    return WeightedStdDev(weights, mean, 0, weights.size());
+}
+
+double
+WeightedStdDev(const std::vector<double>& weights, int mean, size_t begin, size_t end)
 {
     double stddev = 0.0;
     double weight = 0.0;
     int non_zero_weights = 0;
-    for (size_t i = 0; i < weights.size(); i++) {
+    for (size_t i = begin; i < end; i++) {
         stddev += weights[i] * (double(i) - double(mean)) * (double(i) - double(mean));
         weight += weights[i];
         if (weights[i] != 0.0)
@@ -170,12 +191,30 @@ RoundToNearest(double d)
 }
 
 static double
-GetTpdfCoeff(int df)
+ComputeTpdfCoeff(int df)
 {
     static const double kPi = 4.0 * atan(1.0);
     return tgamma((df + 1.0) / 2.0) / tgamma(df / 2.0) / sqrt(df * kPi);
 }
 
+// The normalizing constant only depends on the degrees of freedom, and the
+// model only uses a handful of small ones, so those are computed once.
+static double
+GetTpdfCoeff(int df)
+{
+    static constexpr int kCachedDfs = 32;
+    static const auto cache = []() -> std::array<double, kCachedDfs> {
+        std::array<double, kCachedDfs> coeffs;
+        for (int i = 0; i < kCachedDfs; i++)
+            coeffs[i] = ComputeTpdfCoeff(i + 1);
+        return coeffs;
+    }();
+
+    if (df >= 1 && df <= kCachedDfs)
+        return cache[df - 1];
+    return ComputeTpdfCoeff(df);
+}
+
 double
 Tpdf(double x, int df)
 {
@@ -183,6 +222,710 @@ Tpdf(double x, int df)
     return coeff * pow(1.0 + (x * x) / double(df), -((df + 1.0) / 2.0));
 }
 
+double
+ExpectedScore(const RaceArray& races, double bias)
+{
+    const double* weights = races.weights.data();
+    const double* means = races.means.data();
+    const double* stddevs = races.stddevs.data();
+
+    // Note: the per-race win probability must agree with Analysis::DemWinProb.
+    double score = 0.0;
+    for (size_t i = 0; i < races.size(); i++)
+        score += weights[i] * (1.0 - NormalCdf(0.0, means[i] + bias, stddevs[i]));
+    return score;
+}
+
+static size_t
+AddRaceToHistogram_Scalar(double* hist, size_t len, int w, double p)
+{
+    size_t new_len = len + w;
+    double q = 1.0 - p;
+
+    // Walk downward so that h[k - w] has not been updated yet.
+    for (size_t k = new_len - 1; k >= (size_t)w; k--)
+        hist[k] = hist[k] * q + hist[k - w] * p;
+    for (size_t k = 0; k < (size_t)w && k < new_len; k++)
+        hist[k] *= q;
+    return new_len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) static size_t
+AddRaceToHistogram_Avx2(double* hist, size_t len, int w, double p)
+{
+    size_t new_len = len + w;
+    double q = 1.0 - p;
+
+    __m256d vp = _mm256_set1_pd(p);
+    __m256d vq = _mm256_set1_pd(q);
+
+    // Walk downward four entries at a time. Both inputs of a block are loaded
+    // before it is stored, and every later block reads strictly lower entries,
+    // so this is safe even when w < 4.
+    size_t k = new_len;
+    while (k >= (size_t)w + 4) {
+        k -= 4;
+        __m256d cur = _mm256_loadu_pd(hist + k);
+        __m256d prev = _mm256_loadu_pd(hist + k - w);
+        _mm256_storeu_pd(hist + k, _mm256_fmadd_pd(cur, vq, _mm256_mul_pd(prev, vp)));
+    }
+    while (k > (size_t)w) {
+        k--;
+        hist[k] = hist[k] * q + hist[k - w] * p;
+    }
+    for (k = 0; k < (size_t)w && k < new_len; k++)
+        hist[k] *= q;
+    return new_len;
+}
+
+static bool
+HasAvx2()
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has_avx2;
+}
+#endif
+
+size_t
+AddRaceToHistogram(double* hist, size_t len, int w, double p)
+{
+    assert(w > 0);
+#if defined(__x86_64__) || defined(__i386__)
+    if (HasAvx2())
+        return AddRaceToHistogram_Avx2(hist, len, w, p);
+#endif
+    return AddRaceToHistogram_Scalar(hist, len, w, p);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Constants for the erf() approximation below, from fdlibm's s_erf.c.
+namespace erf_coeffs {
+static constexpr double erx = 8.45062911510467529297e-01;
+static constexpr double pp[] = {
+    1.28379167095512558561e-01, -3.25042107247001499370e-01, -2.84817495755985104766e-02,
+    -5.77027029648944159157e-03, -2.37630166566501626084e-05,
+};
+static constexpr double qq[] = {
+    3.97917223959155352819e-01, 6.50222499887672944485e-02, 5.08130628187576562776e-03,
+    1.32494738004321644526e-04, -3.96022827877536812320e-06,
+};
+static constexpr double pa[] = {
+    -2.36211856075265944077e-03, 4.14856118683748331666e-01, -3.72207876035701323847e-01,
+    3.18346619901161753674e-01, -1.10894694282396677476e-01, 3.54783043256182359371e-02,
+    -2.16637559486879084300e-03,
+};
+static constexpr double qa[] = {
+    1.06420880400844228286e-01, 5.40397917702171048937e-01, 7.18286544141962662868e-02,
+    1.26171219808761642112e-01, 1.36370839120290507362e-02, 1.19844998467991074170e-02,
+};
+static constexpr double ra[] = {
+    -9.86494403484714822705e-03, -6.93858572707181764372e-01, -1.05586262253232909814e+01,
+    -6.23753324503260060396e+01, -1.62396669462573470355e+02, -1.84605092906711035994e+02,
+    -8.12874355063065934246e+01, -9.81432934416914548592e+00,
+};
+static constexpr double sa[] = {
+    1.96512716674392571292e+01, 1.37657754143519042600e+02, 4.34565877475229228821e+02,
+    6.45387271733267880336e+02, 4.29008140027567833386e+02, 1.08635005541779435134e+02,
+    6.57024977031928170135e+00, -6.04244152148580987438e-02,
+};
+static constexpr double rb[] = {
+    -9.86494292470009928597e-03, -7.99283237680523006574e-01, -1.77579549177547519889e+01,
+    -1.60636384855821916062e+02, -6.37566443368389627722e+02, -1.02509513161107724954e+03,
+    -4.83519191608651397019e+02, 0.0,
+};
+static constexpr double sb[] = {
+    3.03380607434824582924e+01, 3.25792512996573918826e+02, 1.53672958608443695994e+03,
+    3.19985821950859553908e+03, 2.55305040643316442583e+03, 4.74528541206955367215e+02,
+    -2.24409524465858183362e+01, 0.0,
+};
+} // namespace erf_coeffs
+
+// Evaluate c[0] + c[1]*x + ... + c[n-1]*x^(n-1).
+template <size_t N>
+__attribute__((target("avx2,fma"))) static inline __m256d
+Polynomial_Avx2(__m256d x, const double (&c)[N])
+{
+    __m256d r = _mm256_set1_pd(c[N - 1]);
+    for (size_t i = N - 1; i > 0; i--)
+        r = _mm256_fmadd_pd(r, x, _mm256_set1_pd(c[i - 1]));
+    return r;
+}
+
+// Same as above, but each lane takes its coefficients from |a| or |b|.
+template <size_t N>
+__attribute__((target("avx2,fma"))) static inline __m256d
+Polynomial_Avx2(__m256d x, const double (&a)[N], const double (&b)[N], __m256d use_b)
+{
+    __m256d r = _mm256_blendv_pd(_mm256_set1_pd(a[N - 1]), _mm256_set1_pd(b[N - 1]), use_b);
+    for (size_t i = N - 1; i > 0; i--) {
+        __m256d c = _mm256_blendv_pd(_mm256_set1_pd(a[i - 1]), _mm256_set1_pd(b[i - 1]), use_b);
+        r = _mm256_fmadd_pd(r, x, c);
+    }
+    return r;
+}
+
+// exp(x), for x in [-708, 709]. The argument is reduced to r = x - n*ln(2)
+// with |r| <= ln(2)/2, and exp(r) is a Taylor series out to r^13, which is
+// accurate to an ulp or so on that range.
+__attribute__((target("avx2,fma"))) static inline __m256d
+Exp_Avx2(__m256d x)
+{
+    static constexpr double kLn2Hi = 6.93147180369123816490e-01;
+    static constexpr double kLn2Lo = 1.90821492927058770002e-10;
+    static constexpr double kTaylor[] = {
+        1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+        1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800, 1.0 / 479001600,
+        1.0 / 6227020800,
+    };
+
+    x = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(709.0)), _mm256_set1_pd(-708.0));
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.0 / M_LN2)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(kLn2Hi), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(kLn2Lo), r);
+
+    __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+    e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(Polynomial_Avx2(r, kTaylor), _mm256_castsi256_pd(e));
+}
+
+// The standard normal CDF at |z|, computed with fdlibm's erf()/erfc()
+// approximations. Each lane computes every branch and then picks its own, so
+// there are no per-lane jumps.
+__attribute__((target("avx2,fma"))) static inline __m256d
+StandardNormalCdf_Avx2(__m256d z)
+{
+    using namespace erf_coeffs;
+
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d x = _mm256_mul_pd(z, _mm256_set1_pd(M_SQRT1_2));
+    __m256d ax = _mm256_andnot_pd(_mm256_set1_pd(-0.0), x);
+    __m256d large = _mm256_cmp_pd(ax, _mm256_set1_pd(1.25), _CMP_GE_OQ);
+    int large_mask = _mm256_movemask_pd(large);
+
+    // |x| < 0.84375: erf(x) = x + x * P(x^2) / Q(x^2)
+    // |x| < 1.25:    erf(x) = erx + P(|x| - 1) / Q(|x| - 1)
+    __m256d upper = one, lower = _mm256_setzero_pd();
+    if (large_mask != 0xf) {
+        __m256d xx = _mm256_mul_pd(ax, ax);
+        __m256d num_small = _mm256_mul_pd(ax, Polynomial_Avx2(xx, pp));
+        __m256d den_small = _mm256_fmadd_pd(Polynomial_Avx2(xx, qq), xx, one);
+
+        __m256d t = _mm256_sub_pd(ax, one);
+        __m256d num_mid = Polynomial_Avx2(t, pa);
+        __m256d den_mid = _mm256_fmadd_pd(Polynomial_Avx2(t, qa), t, one);
+
+        __m256d small = _mm256_cmp_pd(ax, _mm256_set1_pd(0.84375), _CMP_LT_OQ);
+        __m256d base = _mm256_blendv_pd(_mm256_set1_pd(erx), ax, small);
+        __m256d num = _mm256_blendv_pd(num_mid, num_small, small);
+        __m256d den = _mm256_blendv_pd(den_mid, den_small, small);
+        __m256d half_erf = _mm256_mul_pd(half, _mm256_add_pd(base, _mm256_div_pd(num, den)));
+        upper = _mm256_add_pd(half, half_erf);
+        lower = _mm256_sub_pd(half, half_erf);
+    }
+
+    // Otherwise: erfc(x) = exp(-x^2 - 0.5625 + R(1/x^2) / S(1/x^2)) / x, with
+    // one set of coefficients below 1/0.35 and another above it. Past 28,
+    // erfc(x) is zero for our purposes.
+    if (large_mask) {
+        __m256d ct = _mm256_min_pd(_mm256_max_pd(ax, _mm256_set1_pd(1.25)),
+                                   _mm256_set1_pd(28.0));
+        __m256d use_b = _mm256_cmp_pd(ct, _mm256_set1_pd(1.0 / 0.35), _CMP_GE_OQ);
+        __m256d inv = _mm256_div_pd(one, ct);
+        __m256d ss = _mm256_mul_pd(inv, inv);
+        __m256d rr = Polynomial_Avx2(ss, ra, rb, use_b);
+        __m256d sr = _mm256_fmadd_pd(Polynomial_Avx2(ss, sa, sb, use_b), ss, one);
+        __m256d ct2 = _mm256_mul_pd(ct, ct);
+        __m256d ct2_lo = _mm256_fmsub_pd(ct, ct, ct2);
+        __m256d arg = _mm256_add_pd(_mm256_sub_pd(_mm256_set1_pd(-0.5625), ct2),
+                                    _mm256_sub_pd(_mm256_div_pd(rr, sr), ct2_lo));
+        __m256d half_erfc = _mm256_mul_pd(_mm256_mul_pd(half, inv), Exp_Avx2(arg));
+
+        upper = _mm256_blendv_pd(upper, _mm256_sub_pd(one, half_erfc), large);
+        lower = _mm256_blendv_pd(lower, half_erfc, large);
+    }
+    return _mm256_blendv_pd(lower, upper, _mm256_cmp_pd(z, _mm256_setzero_pd(), _CMP_GE_OQ));
+}
+
+__attribute__((target("avx2,fma"))) static void
+NormalCdf_Avx2(const double* x, size_t n, double mean, double stddev, double* out)
+{
+    __m256d vmean = _mm256_set1_pd(mean);
+    __m256d vscale = _mm256_set1_pd(1.0 / stddev);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d z = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(x + i), vmean), vscale);
+        _mm256_storeu_pd(out + i, StandardNormalCdf_Avx2(z));
+    }
+    if (i < n) {
+        // Pad the tail, so that every entry goes through the same code.
+        double in[4] = {mean, mean, mean, mean}, res[4];
+        std::copy(x + i, x + n, in);
+        __m256d z = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(in), vmean), vscale);
+        _mm256_storeu_pd(res, StandardNormalCdf_Avx2(z));
+        std::copy(res, res + (n - i), out + i);
+    }
+}
+
+// (1 + x^2/df)^-((df + 1) / 2) only needs an integer power, and a square root
+// when df is even.
+__attribute__((target("avx2,fma"))) static inline __m256d
+TpdfKernel_Avx2(__m256d x, int df, __m256d coeff)
+{
+    __m256d base = _mm256_fmadd_pd(_mm256_mul_pd(x, x), _mm256_set1_pd(1.0 / df),
+                                   _mm256_set1_pd(1.0));
+    __m256d power = (df % 2 == 0) ? _mm256_sqrt_pd(base) : _mm256_set1_pd(1.0);
+    __m256d square = base;
+    for (int e = (df + 1) / 2; e; e >>= 1) {
+        if (e & 1)
+            power = _mm256_mul_pd(power, square);
+        if (e > 1)
+            square = _mm256_mul_pd(square, square);
+    }
+    return _mm256_div_pd(coeff, power);
+}
+
+__attribute__((target("avx2,fma"))) static void
+Tpdf_Avx2(const double* x, size_t n, int df, double* out)
+{
+    __m256d coeff = _mm256_set1_pd(GetTpdfCoeff(df));
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(out + i, TpdfKernel_Avx2(_mm256_loadu_pd(x + i), df, coeff));
+    if (i < n) {
+        double in[4] = {}, res[4];
+        std::copy(x + i, x + n, in);
+        _mm256_storeu_pd(res, TpdfKernel_Avx2(_mm256_loadu_pd(in), df, coeff));
+        std::copy(res, res + (n - i), out + i);
+    }
+}
+#endif
+
+void
+NormalCdf(const double* x, size_t n, double mean, double stddev, double* out)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (HasAvx2())
+        return NormalCdf_Avx2(x, n, mean, stddev, out);
+#endif
+    for (size_t i = 0; i < n; i++)
+        out[i] = NormalCdf(x[i], mean, stddev);
+}
+
+void
+Tpdf(const double* x, size_t n, int df, double* out)
+{
+    assert(df > 0);
+#if defined(__x86_64__) || defined(__i386__)
+    if (HasAvx2())
+        return Tpdf_Avx2(x, n, df, out);
+#endif
+    for (size_t i = 0; i < n; i++)
+        out[i] = Tpdf(x[i], df);
+}
+
+// In-place iterative radix-2 FFT. |n| must be a power of two.
+static void
+Fft(std::complex<double>* data, size_t n, bool inverse)
+{
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(data[i], data[j]);
+    }
+
+    static const double kPi = 4.0 * atan(1.0);
+    for (size_t len = 2; len <= n; len <<= 1) {
+        double angle = 2.0 * kPi / double(len) * (inverse ? 1.0 : -1.0);
+        for (size_t k = 0; k < len / 2; k++) {
+            std::complex<double> w = std::polar(1.0, angle * double(k));
+            for (size_t i = k; i < n; i += len) {
+                std::complex<double> u = data[i];
+                std::complex<double> v = data[i + len / 2] * w;
+                data[i] = u + v;
+                data[i + len / 2] = u - v;
+            }
+        }
+    }
+}
+
+// Below this size (of the smaller input), direct convolution is cheaper than
+// an FFT.
+static constexpr size_t kFftMinSize = 64;
+
+void
+ConvolvePolynomials(const std::vector<double>& a, const std::vector<double>& b,
+                    std::vector<double>* out)
+{
+    assert(!a.empty() && !b.empty());
+
+    out->resize(a.size() + b.size() - 1);
+    ConvolvePolynomials(a.data(), a.size(), b.data(), b.size(), out->data());
+}
+
+void
+ConvolvePolynomials(const double* a, size_t a_len, const double* b, size_t b_len, double* out)
+{
+    assert(a_len && b_len);
+
+    size_t out_size = a_len + b_len - 1;
+    if (std::min(a_len, b_len) < kFftMinSize) {
+        // Skip zero taps, since binomial distributions of weighted races are
+        // mostly zeroes.
+        std::fill(out, out + out_size, 0.0);
+        for (size_t j = 0; j < b_len; j++) {
+            if (b[j] == 0.0)
+                continue;
+            for (size_t i = 0; i < a_len; i++)
+                out[i + j] += a[i] * b[j];
+        }
+        return;
+    }
+
+    size_t n = 1;
+    while (n < out_size)
+        n <<= 1;
+
+    // Pack both inputs into one complex sequence, a + ib. Squaring its
+    // transform gives a^2 - b^2 + 2iab, so the imaginary part of the inverse
+    // is twice the convolution. This takes one forward FFT instead of two.
+    thread_local std::vector<std::complex<double>> buffer;
+    buffer.assign(n, {});
+    for (size_t i = 0; i < a_len; i++)
+        buffer[i].real(a[i]);
+    for (size_t i = 0; i < b_len; i++)
+        buffer[i].imag(b[i]);
+
+    Fft(buffer.data(), n, false);
+    for (auto& c : buffer)
+        c *= c;
+    Fft(buffer.data(), n, true);
+
+    // Coefficients of probability distributions are never negative. Anything
+    // within the FFT's rounding noise of zero is treated as zero, so that
+    // entries that are exactly zero in the direct path stay that way.
+    static constexpr double kNoiseFloor = kFftTolerance / 10.0;
+
+    double scale = 0.5 / double(n);
+    for (size_t i = 0; i < out_size; i++) {
+        double v = buffer[i].imag() * scale;
+        out[i] = (v < kNoiseFloor) ? 0.0 : v;
+    }
+}
+
+std::vector<double>
+BinomialPmf(int n, double p, int stride)
+{
+    assert(n >= 0 && stride > 0);
+
+    std::vector<double> pmf(size_t(n) * stride + 1, 0.0);
+    if (p <= 0.0) {
+        pmf.front() = 1.0;
+        return pmf;
+    }
+    if (p >= 1.0) {
+        pmf.back() = 1.0;
+        return pmf;
+    }
+
+    // log(k!) for k in [0, n]. This avoids lgamma(), which is not thread-safe.
+    std::vector<double> log_fact(n + 1, 0.0);
+    for (int k = 2; k <= n; k++)
+        log_fact[k] = log_fact[k - 1] + log(double(k));
+
+    double log_p = log(p);
+    double log_q = log1p(-p);
+    for (int k = 0; k <= n; k++) {
+        double log_coeff = log_fact[n] - log_fact[k] - log_fact[n - k];
+        pmf[size_t(k) * stride] = exp(log_coeff + k * log_p + (n - k) * log_q);
+    }
+    return pmf;
+}
+
+double Convolver::TrimEpsilon = 1e-12;
+
+// Run fn(0) through fn(count - 1), on the pool if there is one.
+static void
+ForEach(ThreadPool* pool, size_t count, const std::function<void(size_t)>& fn)
+{
+    if (pool) {
+        pool->ForEach(count, fn);
+    } else {
+        for (size_t i = 0; i < count; i++)
+            fn(i);
+    }
+}
+
+// A histogram where only entries in [lo, hi) can be non-zero. Entries are
+// indexed by score, so |values| always has room for the maximum score. Mass
+// trimmed from either end of the window is tracked so it can be restored.
+struct Convolver::Window
+{
+    std::vector<double> values;
+    size_t lo = 0;
+    size_t hi = 0;
+    double dropped_low = 0.0;
+    double dropped_high = 0.0;
+
+    void Trim() {
+        while (hi - lo > 1 && values[lo] < TrimEpsilon) {
+            dropped_low += values[lo];
+            values[lo++] = 0.0;
+        }
+        while (hi - lo > 1 && values[hi - 1] < TrimEpsilon) {
+            dropped_high += values[hi - 1];
+            values[--hi] = 0.0;
+        }
+    }
+
+    static Window Multiply(const Window& a, const Window& b) {
+        Window out;
+        out.values.assign(a.values.size() + b.values.size() - 1, 0.0);
+        out.lo = a.lo + b.lo;
+        out.hi = out.lo + (a.hi - a.lo) + (b.hi - b.lo) - 1;
+        out.dropped_low = a.dropped_low + b.dropped_low;
+        out.dropped_high = a.dropped_high + b.dropped_high;
+        ConvolvePolynomials(&a.values[a.lo], a.hi - a.lo, &b.values[b.lo], b.hi - b.lo,
+                            &out.values[out.lo]);
+        out.Trim();
+        return out;
+    }
+};
+
+void
+Convolver::Compute(ThreadPool* pool)
+{
+    std::map<std::pair<int, double>, int> groups;
+    for (const auto& race : data_)
+        groups[race]++;
+
+    RaceList singles;
+    std::vector<Window> binomials;
+    for (const auto& [race, count] : groups) {
+        if (count >= kMinBinomialGroup) {
+            Window pmf;
+            pmf.values = BinomialPmf(count, race.second, race.first);
+            pmf.hi = pmf.values.size();
+            pmf.Trim();
+            binomials.emplace_back(std::move(pmf));
+        } else {
+            for (int i = 0; i < count; i++)
+                singles.emplace_back(race);
+        }
+    }
+
+    Window result;
+    if (singles.size() >= kProductTreeThreshold)
+        ComputeProductTree(singles, pool, &result);
+    else
+        ComputeDirect(singles.data(), singles.data() + singles.size(), &result);
+
+    for (const auto& pmf : binomials)
+        result = Window::Multiply(result, pmf);
+
+    histogram = std::move(result.values);
+    lo_ = result.lo;
+    hi_ = result.hi;
+    histogram[lo_] += result.dropped_low;
+    histogram[hi_ - 1] += result.dropped_high;
+}
+
+// The histogram is sized for every race up front, and each race is then added
+// in place to the active window, so no temporary buffers are needed.
+void
+Convolver::ComputeDirect(const std::pair<int, double>* begin, const std::pair<int, double>* end,
+                         Window* out)
+{
+    size_t total = 1;
+    for (auto iter = begin; iter != end; iter++)
+        total += iter->first;
+
+    out->values.assign(total, 0.0);
+    out->values[0] = 1.0;
+    out->lo = 0;
+    out->hi = 1;
+
+    for (auto iter = begin; iter != end; iter++) {
+        double* window = &out->values[out->lo];
+        out->hi = out->lo + AddRaceToHistogram(window, out->hi - out->lo, iter->first, iter->second);
+        out->Trim();
+    }
+}
+
+void
+Convolver::ComputeProductTree(const RaceList& races, ThreadPool* pool, Window* out)
+{
+    static constexpr size_t kLeafSize = 16;
+
+    auto for_each = [pool](size_t count, const std::function<void(size_t)>& fn) -> void {
+        ForEach(pool, count, fn);
+    };
+
+    // Leaves are computed with the direct kernel.
+    std::vector<Window> polys((races.size() + kLeafSize - 1) / kLeafSize);
+    for_each(polys.size(), [&races, &polys](size_t leaf) -> void {
+        size_t begin = leaf * kLeafSize;
+        size_t end = std::min(begin + kLeafSize, races.size());
+        ComputeDirect(races.data() + begin, races.data() + end, &polys[leaf]);
+    });
+
+    // Merge pairs of subtrees until one remains.
+    while (polys.size() > 1) {
+        std::vector<Window> next((polys.size() + 1) / 2);
+        for_each(next.size(), [&polys, &next](size_t i) -> void {
+            if (i * 2 + 1 < polys.size())
+                next[i] = Window::Multiply(polys[i * 2], polys[i * 2 + 1]);
+            else
+                next[i] = std::move(polys[i * 2]);
+        });
+        polys = std::move(next);
+    }
+    *out = std::move(polys[0]);
+}
+
+Convolver
+Convolver::Updatable(std::vector<std::pair<int, double>>&& data, ThreadPool* pool)
+{
+    Convolver cv;
+    cv.data_ = std::move(data);
+    cv.BuildTree(pool);
+    return cv;
+}
+
+void
+Convolver::BuildTree(ThreadPool* pool)
+{
+    size_t leaves = 1;
+    while (leaves < data_.size())
+        leaves <<= 1;
+
+    tree_.assign(leaves * 2, std::vector<double>(1, 1.0));
+    for (size_t i = 0; i < data_.size(); i++)
+        SetLeaf(i);
+
+    // Nodes [n, 2n) are one level of the tree.
+    for (size_t n = leaves / 2; n >= 1; n /= 2) {
+        ForEach(pool, n, [this, n](size_t i) -> void {
+            size_t node = n + i;
+            ConvolvePolynomials(tree_[node * 2], tree_[node * 2 + 1], &tree_[node]);
+        });
+    }
+    SetHistogramFromTree();
+}
+
+void
+Convolver::SetLeaf(size_t index)
+{
+    const auto& [weight, p] = data_[index];
+    auto& leaf = tree_[tree_.size() / 2 + index];
+    leaf.assign(weight + 1, 0.0);
+    leaf[0] = 1.0 - p;
+    leaf[weight] = p;
+}
+
+void
+Convolver::UpdatePath(size_t index)
+{
+    for (size_t node = (tree_.size() / 2 + index) / 2; node >= 1; node /= 2)
+        ConvolvePolynomials(tree_[node * 2], tree_[node * 2 + 1], &tree_[node]);
+}
+
+void
+Convolver::SetHistogramFromTree()
+{
+    histogram = tree_[1];
+    lo_ = 0;
+    hi_ = histogram.size();
+    mean_ = -1;
+    cumsum.clear();
+}
+
+void
+Convolver::AddRace(int weight, double p)
+{
+    assert(!tree_.empty());
+
+    data_.emplace_back(weight, p);
+    if (data_.size() > tree_.size() / 2) {
+        BuildTree(nullptr);
+        return;
+    }
+
+    SetLeaf(data_.size() - 1);
+    UpdatePath(data_.size() - 1);
+    SetHistogramFromTree();
+}
+
+void
+Convolver::RemoveRace(size_t index)
+{
+    assert(!tree_.empty());
+    assert(index < data_.size());
+
+    size_t last = data_.size() - 1;
+    if (index != last) {
+        data_[index] = data_[last];
+        SetLeaf(index);
+        UpdatePath(index);
+    }
+    data_.pop_back();
+    tree_[tree_.size() / 2 + last].assign(1, 1.0);
+    UpdatePath(last);
+    SetHistogramFromTree();
+}
+
+void
+Convolver::UpdateRace(size_t index, double p)
+{
+    assert(!tree_.empty());
+    assert(index < data_.size());
+
+    data_[index].second = p;
+    SetLeaf(index);
+    UpdatePath(index);
+    SetHistogramFromTree();
+}
+
+void
+Convolver::UpdateRaces(const std::vector<std::pair<size_t, double>>& updates, ThreadPool* pool)
+{
+    assert(!tree_.empty());
+
+    if (updates.empty())
+        return;
+
+    std::vector<size_t> nodes;
+    nodes.reserve(updates.size());
+    for (const auto& [index, p] : updates) {
+        assert(index < data_.size());
+        data_[index].second = p;
+        SetLeaf(index);
+        nodes.emplace_back(tree_.size() / 2 + index);
+    }
+
+    // Walk up one level at a time. Every node in |nodes| is on the same level,
+    // so their parents can be computed in parallel.
+    while (nodes[0] > 1) {
+        for (auto& node : nodes)
+            node /= 2;
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+        ForEach(pool, nodes.size(), [this, &nodes](size_t i) -> void {
+            size_t node = nodes[i];
+            ConvolvePolynomials(tree_[node * 2], tree_[node * 2 + 1], &tree_[node]);
+        });
+    }
+    SetHistogramFromTree();
+}
+
 double
 Sum(const std::vector<double>& values)
 {
@@ -192,4 +935,163 @@ Sum(const std::vector<double>& values)
     return total;
 }
 
+void
+AdaptiveSample(const DensityFn& density, double lo, double hi, double tolerance,
+               double min_step, std::vector<double>* points, std::vector<double>* values)
+{
+    // Start from an even grid, which also gives a rough total to measure
+    // errors against.
+    static constexpr int kInitialIntervals = 16;
+    double step = (hi - lo) / kInitialIntervals;
+    double xs[kInitialIntervals + 1], fs[kInitialIntervals + 1];
+    for (int i = 0; i <= kInitialIntervals; i++)
+        xs[i] = (i == kInitialIntervals) ? hi : lo + step * i;
+    density(xs, kInitialIntervals + 1, fs);
+
+    double total = 0.0;
+    for (int i = 1; i <= kInitialIntervals; i++)
+        total += (fs[i - 1] + fs[i]) * step / 2;
+    double max_error = tolerance * total;
+
+    // Refine one level at a time, so that all of a level's midpoints go to the
+    // density in one call. Intervals stay in order, and each one is split
+    // until its midpoint shows that it is accurate enough.
+    struct Interval {
+        double a, b, fa, fb;
+        double c, fc;
+        bool done;
+    };
+    std::vector<Interval> intervals;
+    for (int i = 0; i < kInitialIntervals; i++)
+        intervals.push_back({xs[i], xs[i + 1], fs[i], fs[i + 1], 0.0, 0.0, false});
+
+    std::vector<Interval> next;
+    std::vector<double> mids, fmids;
+    for (;;) {
+        mids.clear();
+        for (auto& iv : intervals) {
+            if (iv.done)
+                continue;
+            iv.c = iv.a + (iv.b - iv.a) / 2;
+            mids.emplace_back(iv.c);
+        }
+        if (mids.empty())
+            break;
+
+        fmids.resize(mids.size());
+        density(mids.data(), mids.size(), fmids.data());
+
+        next.clear();
+        size_t k = 0;
+        for (auto& iv : intervals) {
+            if (!iv.done) {
+                iv.fc = fmids[k++];
+
+                double width = iv.b - iv.a;
+                double trapezoid = width * (iv.fa + iv.fb) / 2;
+                double simpson = width * (iv.fa + 4 * iv.fc + iv.fb) / 6;
+                if (fabs(simpson - trapezoid) > max_error && width / 4 >= min_step) {
+                    next.push_back({iv.a, iv.c, iv.fa, iv.fc, 0.0, 0.0, false});
+                    next.push_back({iv.c, iv.b, iv.fc, iv.fb, 0.0, 0.0, false});
+                    continue;
+                }
+                iv.done = true;
+            }
+            next.push_back(iv);
+        }
+        std::swap(intervals, next);
+    }
+
+    points->clear();
+    values->clear();
+    points->emplace_back(xs[0]);
+    values->emplace_back(fs[0]);
+    for (const auto& iv : intervals) {
+        points->emplace_back(iv.c);
+        values->emplace_back(iv.fc);
+        points->emplace_back(iv.b);
+        values->emplace_back(iv.fb);
+    }
+}
+
+// Each point stands for the interval between the midpoints to its neighbors.
+// The first and last points extend as far past themselves as they do inward.
+static inline double
+CellLow(const std::vector<double>& points, size_t i)
+{
+    if (i == 0)
+        return points[0] - (points[1] - points[0]) / 2;
+    return (points[i - 1] + points[i]) / 2;
+}
+
+static inline double
+CellHigh(const std::vector<double>& points, size_t i)
+{
+    if (i + 1 == points.size())
+        return points[i] + (points[i] - points[i - 1]) / 2;
+    return (points[i] + points[i + 1]) / 2;
+}
+
+std::vector<double>
+PointMasses(const std::vector<double>& points, const std::vector<double>& values)
+{
+    assert(points.size() == values.size());
+    if (points.size() < 2)
+        return std::vector<double>(points.size(), 1.0);
+
+    std::vector<double> masses(points.size());
+    double total = 0.0;
+    for (size_t i = 0; i < points.size(); i++) {
+        masses[i] = values[i] * (CellHigh(points, i) - CellLow(points, i));
+        total += masses[i];
+    }
+    for (auto& mass : masses)
+        mass /= total;
+    return masses;
+}
+
+double
+InterpolateCdf(const std::vector<double>& points, const std::vector<double>& cs, double x)
+{
+    if (points.size() < 2)
+        return (points.empty() || x < points[0]) ? 0.0 : 1.0;
+    if (x <= CellLow(points, 0))
+        return 0.0;
+    if (x >= CellHigh(points, points.size() - 1))
+        return cs.back();
+
+    // Find the cell that |x| is in.
+    size_t lo = 0, hi = points.size() - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (CellHigh(points, mid) >= x)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    double x0 = CellLow(points, lo);
+    double x1 = CellHigh(points, lo);
+    double c0 = lo ? cs[lo - 1] : 0.0;
+    return c0 + (cs[lo] - c0) * (x - x0) / (x1 - x0);
+}
+
+double
+InterpolateQuantile(const std::vector<double>& points, const std::vector<double>& cs, double p)
+{
+    if (points.size() < 2)
+        return points.empty() ? 0.0 : points[0];
+
+    size_t i = std::lower_bound(cs.begin(), cs.end(), p) - cs.begin();
+    if (i == cs.size())
+        return points.back();
+
+    double x0 = CellLow(points, i);
+    double x1 = CellHigh(points, i);
+    double c0 = i ? cs[i - 1] : 0.0;
+    if (cs[i] <= c0)
+        return x1;
+    return x0 + (x1 - x0) * (p - c0) / (cs[i] - c0);
+}
+
 } // namespace stone
@@ -17,6 +17,7 @@
 
 #include <math.h>
 
+#include <functional>
 #include <limits>
 #include <vector>
 
@@ -24,6 +25,8 @@
 
 namespace stone {
 
+class ThreadPool;
+
 double Average(const std::vector<double>& values);
 double Median(const std::vector<double>& values);
 double SampleStdDev(const std::vector<double>& values);
@@ -35,29 +38,97 @@ std::vector<double> Cumsum(const std::vector<double>& values);
 double WeightedAverage(const std::vector<double>& weights);
 double WeightedAverage(const std::vector<double>& values, const std::vector<double>& weights);
 double WeightedStdDev(const std::vector<double>& weights, int mean);
+// Same as above, but only entries in [begin, end) can be non-zero.
+double WeightedAverage(const std::vector<double>& weights, size_t begin, size_t end);
+double WeightedStdDev(const std::vector<double>& weights, int mean, size_t begin, size_t end);
 int RoundToNearest(double d);
 double Tpdf(double value, int df);
 double Tcdf(double value, int df);
 double Sum(const std::vector<double>& values);
 
-static inline void
-Convolve(const std::vector<double>& x, const std::vector<double>& h, std::vector<double>* out)
+// Batched forms of NormalCdf and Tpdf, for evaluating a whole row of inputs in
+// one call:
+//    out[i] = NormalCdf(x[i], mean, stddev)
+//    out[i] = Tpdf(x[i], df)
+//
+// These use AVX2 when the CPU has it. Results agree with the scalar forms to
+// within an ulp or so of 1.0, not bit for bit.
+void NormalCdf(const double* x, size_t n, double mean, double stddev, double* out);
+void Tpdf(const double* x, size_t n, int df, double* out);
+
+// Sample |density| on [lo, hi], with points that are dense where it curves and
+// sparse where it is flat. An interval is split in two while its trapezoid and
+// Simpson estimates differ by more than |tolerance| of the total mass, until
+// the points would be closer than |min_step|. Points are in increasing order.
+//
+// The density is evaluated in batches: it must set out[i] for each of the |n|
+// points in |x|.
+typedef std::function<void(const double* x, size_t n, double* out)> DensityFn;
+void AdaptiveSample(const DensityFn& density, double lo, double hi, double tolerance,
+                    double min_step, std::vector<double>* points,
+                    std::vector<double>* values);
+
+// Turn density values at sorted, unevenly spaced points into probability
+// masses that sum to 1. Each point stands for the interval between the
+// midpoints to its neighbors, so evenly spaced points are weighted equally.
+std::vector<double> PointMasses(const std::vector<double>& points,
+                                const std::vector<double>& values);
+
+// Given the points and the Cumsum of their masses, interpolate the CDF at |x|,
+// or the value at which the CDF reaches |p|. The CDF is linear across each
+// point's interval.
+double InterpolateCdf(const std::vector<double>& points, const std::vector<double>& cs,
+                      double x);
+double InterpolateQuantile(const std::vector<double>& points, const std::vector<double>& cs,
+                           double p);
+
+// A flattened list of races, for evaluating scores at many different biases
+// without going through RaceModel protobufs or building histograms. Regions
+// are from Campaign::GetRegion, and are only used by simulations.
+struct RaceArray
 {
-    assert(!x.empty() && !h.empty());
-    assert(x.size() < (size_t)std::numeric_limits<ssize_t>::max());
-    assert(h.size() < (size_t)std::numeric_limits<ssize_t>::max());
-
-    out->resize(x.size() + h.size() - 1);
-    for (size_t i = 0; i < out->size(); i++) {
-        double val = 0.0;
-        ssize_t k = i;
-        for (size_t j = 0; j < h.size() && k >= 0; j++, k--) {
-            if (k < (ssize_t)x.size())
-                val += x[k] * h[j];
-        }
-        out->at(i) = val;
+    std::vector<double> weights;
+    std::vector<double> means;
+    std::vector<double> stddevs;
+    std::vector<int> regions;
+
+    void Add(double weight, double mean, double stddev, int region = -1) {
+        weights.emplace_back(weight);
+        means.emplace_back(mean);
+        stddevs.emplace_back(stddev);
+        regions.emplace_back(region);
     }
-}
+    size_t size() const { return weights.size(); }
+    bool empty() const { return weights.empty(); }
+};
+
+// Return the expected score for a set of races, given a margin bias. This is
+// the mean of the Poisson-binomial distribution that Convolver computes, which
+// is just the sum of weight * P(win) for each race.
+double ExpectedScore(const RaceArray& races, double bias);
+
+// Multiply two polynomials (convolve two sequences). Large inputs go through
+// an FFT, which agrees with direct convolution to within kFftTolerance per
+// coefficient for probability distributions.
+void ConvolvePolynomials(const std::vector<double>& a, const std::vector<double>& b,
+                         std::vector<double>* out);
+// Same as above, but |out| must already have room for a_len + b_len - 1 entries.
+void ConvolvePolynomials(const double* a, size_t a_len, const double* b, size_t b_len,
+                         double* out);
+
+static constexpr double kFftTolerance = 1e-10;
+
+// Return the binomial distribution of |n| races that each have weight |stride|
+// and win probability |p|. Entry k * stride is the probability of winning k of
+// them. Coefficients are computed in log space, so large |n| is stable.
+std::vector<double> BinomialPmf(int n, double p, int stride = 1);
+
+// Add one race to a Poisson-binomial histogram, in place:
+//    h[k] = h[k] * (1 - p) + h[k - w] * p
+//
+// |len| is the number of entries currently in use, and the caller must have
+// zeroed the |w| entries after it. Returns the new length (len + w).
+size_t AddRaceToHistogram(double* hist, size_t len, int w, double p);
 
 static inline int
 GetTiebreakerMajority(int total)
@@ -68,24 +139,60 @@ GetTiebreakerMajority(int total)
 class Convolver
 {
   public:
+    // Past this many races, the histogram is computed as a product tree: races
+    // are split into leaves, and leaves are merged pairwise with FFTs. If a
+    // thread pool is given, leaves and merges run in parallel.
+    static constexpr size_t kProductTreeThreshold = 128;
+
+    // Races with identical weights and probabilities (eg, House races that
+    // only have a rating) are grouped, and each group of at least this many
+    // is added as one binomial distribution.
+    static constexpr int kMinBinomialGroup = 4;
+
+    // Entries smaller than this are trimmed from the ends of the histogram as
+    // races are added, so that work only happens on the band where the mass
+    // is. Trimmed mass is folded into the ends of the remaining window. Zero
+    // disables trimming.
+    static double TrimEpsilon;
+
     Convolver(Convolver&& other) = default;
-    Convolver(const std::vector<double>& win_p) {
+    Convolver(const std::vector<double>& win_p, ThreadPool* pool = nullptr) {
         for (const auto& p : win_p)
             data_.emplace_back(1, p);
-        Compute();
+        Compute(pool);
     }
-    Convolver(std::vector<std::pair<int, double>>&& data)
+    Convolver(std::vector<std::pair<int, double>>&& data, ThreadPool* pool = nullptr)
       : data_(std::move(data))
     {
-        Compute();
+        Compute(pool);
     }
 
+    // Build a histogram that can be updated one race at a time. Each race is a
+    // leaf of a stored product tree, so changing a race only recomputes the
+    // products on its path to the root, rather than the whole histogram.
+    // Tails are not trimmed, and races are not grouped.
+    static Convolver Updatable(std::vector<std::pair<int, double>>&& data,
+                               ThreadPool* pool = nullptr);
+
+    // These require an updatable Convolver. RemoveRace moves the last race
+    // into |index|.
+    void AddRace(int weight, double p);
+    void RemoveRace(size_t index);
+    void UpdateRace(size_t index, double p);
+
+    // Same as UpdateRace for each (index, p) pair, but a product that covers
+    // several changed races is only recomputed once.
+    void UpdateRaces(const std::vector<std::pair<size_t, double>>& updates,
+                     ThreadPool* pool = nullptr);
+
+    const std::vector<std::pair<int, double>>& races() const { return data_; }
+
     int FindMedian() {
         ComputeCumsum();
 
-        for (int i = 0; i < (int)cumsum.size(); i++) {
+        for (size_t i = lo_; i < hi_; i++) {
             if (cumsum[i] >= 0.5)
-                return i;
+                return (int)i;
         }
 
         assert(false);
@@ -93,17 +200,17 @@ class Convolver
     }
 
     int FindMode() {
-        int mode = 0;
-        for (int i = 1; i < (int)histogram.size(); i++) {
+        size_t mode = lo_;
+        for (size_t i = lo_ + 1; i < hi_; i++) {
             if (histogram[i] > histogram[mode])
                 mode = i;
         }
-        return mode;
+        return (int)mode;
     }
 
     int FindMean() {
         if (mean_ == -1)
-            mean_ = RoundToNearest(WeightedAverage(histogram));
+            mean_ = RoundToNearest(WeightedAverage(histogram, lo_, hi_));
         return mean_;
     }
 
@@ -128,7 +235,7 @@ class Convolver
 
     void CalcConfidence(EvRange* range, int base = 0) {
         int mean = FindMean();
-        double stddev = WeightedStdDev(histogram, mean);
+        double stddev = WeightedStdDev(histogram, mean, lo_, hi_);
 
         static constexpr double kBand = 2;
 
@@ -140,38 +247,55 @@ class Convolver
         range->set_high(std::clamp(mean + dt, 0, (int)histogram.size()) + base - 1);
     }
 
+    // Entries below the window are zero, and entries above the window are the
+    // total, so only the window needs to be summed.
     void ComputeCumsum() {
-        if (cumsum.size() != histogram.size())
-            cumsum = Cumsum(histogram);
+        if (cumsum.size() == histogram.size())
+            return;
+
+        cumsum.assign(histogram.size(), 0.0);
+        double total = 0.0;
+        for (size_t i = lo_; i < hi_; i++) {
+            total += histogram[i];
+            cumsum[i] = total;
+        }
+        std::fill(cumsum.begin() + hi_, cumsum.end(), total);
     }
 
+    // The non-zero entries of the histogram are in [window_begin, window_end).
+    size_t window_begin() const { return lo_; }
+    size_t window_end() const { return hi_; }
+
     Convolver& operator =(Convolver&& other) = default;
 
     std::vector<double> histogram;
     std::vector<double> cumsum;
 
   private:
-    std::vector<double> MakeSlice(size_t i) {
-        std::vector<double> v(data_[i].first + 1, 0);
-        v.front() = data_[i].second;
-        v.back() = 1.0 - data_[i].second;
-        return v;
-    }
+    typedef std::vector<std::pair<int, double>> RaceList;
+    struct Window;
 
-    void Compute() {
-        histogram = MakeSlice(0);
+    Convolver() {}
 
-        std::vector<double> temp;
-        for (int i = 1; i < (int)data_.size(); i++) {
-            Convolve(histogram, MakeSlice(i), &temp);
-            std::swap(temp, histogram);
-        }
-        std::reverse(histogram.begin(), histogram.end());
-    }
+    void Compute(ThreadPool* pool);
+    void BuildTree(ThreadPool* pool);
+    void SetLeaf(size_t index);
+    void UpdatePath(size_t index);
+    void SetHistogramFromTree();
+    static void ComputeDirect(const std::pair<int, double>* begin,
+                              const std::pair<int, double>* end, Window* out);
+    static void ComputeProductTree(const RaceList& races, ThreadPool* pool, Window* out);
 
   private:
     int mean_ = -1;
+    size_t lo_ = 0;
+    size_t hi_ = 0;
     std::vector<std::pair<int, double>> data_;
+
+    // For updatable Convolvers: a complete binary tree in heap order, where
+    // node n is the product of nodes 2n and 2n + 1, and the last half of the
+    // nodes are per-race leaves. Unused leaves are the polynomial 1.
+    std::vector<std::vector<double>> tree_;
 };
 
 } // namespace stone
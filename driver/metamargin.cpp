@@ -15,6 +15,8 @@
 // limitations under the License.
 #include "metamargin.h"
 
+#include <algorithm>
+
 #include "logging.h"
 #include "utility.h"
 
@@ -22,52 +24,93 @@ namespace stone {
 
 bool MetamarginFinder::Debug = false;
 
+static constexpr double kBiasStep = 0.02;
+static constexpr double kMaxBias = 101.0;
+
 MetamarginFinder::MetamarginFinder(std::function<int(double)> in_bias_fn, int midpoint, int start,
-                                   int high)
+                                   int high, std::optional<double> hint)
   : bias_fn(std::move(in_bias_fn))
 {
     if (midpoint != start) {
-        metamargin = Calc(midpoint, start > midpoint ? -1 : 1);
+        metamargin = Calc(midpoint, start > midpoint ? -1 : 1, hint);
     } else if (start == 0) {
-        metamargin = -Calc(midpoint, 1);
+        // The result is negated here, so the hint has to be too.
+        std::optional<double> flipped;
+        if (hint)
+            flipped = {-hint.value()};
+        metamargin = -Calc(midpoint, 1, flipped);
     } else if (start == high) {
-        metamargin = Calc(midpoint, -1);
+        metamargin = Calc(midpoint, -1, hint);
     } else {
         // Go both directions, take whichever result is closer.
-        double mm1 = Calc(midpoint, 1);
-        double mm2 = Calc(midpoint, -1);
+        double mm1 = Calc(midpoint, 1, hint);
+        double mm2 = Calc(midpoint, -1, hint);
         metamargin = (abs(mm1) > abs(mm2)) ? mm2 : mm1;
     }
 }
 
 double
-MetamarginFinder::Calc(int midpoint, int direction)
+MetamarginFinder::Calc(int midpoint, int direction, std::optional<double> hint)
 {
-    double bias, step;
-    if (direction < 0) {
-        bias = 0.0;
-        step = -0.02;
-    } else {
-        bias = 0.02;
-        step = 0.02;
-    }
+    // Step |n| is the bias at grid index |first + n * direction|. A negative
+    // walk starts at 0.0, and a positive walk starts at 0.02.
+    int first = (direction < 0) ? 0 : 1;
+    int max_steps = (int)(kMaxBias / kBiasStep) - first;
 
-    double metamargin = 0.0f;
-    while (true) {
+    auto get_bias = [&](int n) -> double {
+        return double(first + n * direction) * kBiasStep;
+    };
+    auto reached = [&](int n) -> bool {
+        double bias = get_bias(n);
         int median_ev = bias_fn(bias);
         if (Debug)
             printf("bias = %f  result = %d\n", bias, median_ev);
-        if (bias > 101.0 || bias < -101.0) {
-            Err() << "Something has gone very wrong, metamargin > 100";
-            abort();
+        if (direction < 0)
+            return median_ev <= midpoint;
+        return median_ev >= midpoint;
+    };
+
+    int start = 0;
+    if (hint) {
+        // The metamargin is the negated bias.
+        int index = (int)round(-hint.value() / kBiasStep);
+        start = std::clamp((index - first) * direction, 0, max_steps);
+    }
+
+    // Find |lo| < |hi| such that |lo| has not reached the midpoint, and |hi|
+    // has. An |lo| of -1 means that even step 0 reaches it.
+    int lo, hi;
+    if (reached(start)) {
+        hi = start;
+        lo = start - 1;
+        for (int delta = 1; lo >= 0 && reached(lo); delta *= 2) {
+            hi = lo;
+            lo = std::max(hi - delta * 2, -1);
         }
-        if ((direction < 0 && median_ev <= midpoint) || (direction > 0 && median_ev >= midpoint)) {
-            metamargin = -bias;
-            break;
+    } else {
+        lo = start;
+        hi = start + 1;
+        for (int delta = 1;; delta *= 2) {
+            hi = std::min(hi, max_steps);
+            if (reached(hi))
+                break;
+            if (hi == max_steps) {
+                Err() << "Something has gone very wrong, metamargin > 100";
+                abort();
+            }
+            lo = hi;
+            hi = lo + delta * 2;
         }
-        bias += step;
     }
-    return RoundMargin(metamargin);
+
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (reached(mid))
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return RoundMargin(-get_bias(hi));
 }
 
 } // namespace stone
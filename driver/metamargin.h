@@ -18,14 +18,21 @@
 #include <math.h>
 
 #include <functional>
+#include <optional>
 
 namespace stone {
 
 // Derived from Princeton Election Consortium's "metamargin" analysis, with
 // some tweaks to generalize to more elections.
+//
+// The score is monotonic in the bias, so rather than walking the bias in 0.02
+// steps, we bracket the crossing point by doubling the step size and then
+// bisect. This finds the same grid point the linear walk would. If a hint is
+// given (eg the previous day's metamargin), the search starts there.
 struct MetamarginFinder
 {
-    MetamarginFinder(std::function<int(double)> bias_fn, int midpoint, int start, int high);
+    MetamarginFinder(std::function<int(double)> bias_fn, int midpoint, int start, int high,
+                     std::optional<double> hint = {});
 
     static bool Debug;
 
@@ -33,7 +40,7 @@ struct MetamarginFinder
     double metamargin;
 
   private:
-    double Calc(int midpoint, int direction);
+    double Calc(int midpoint, int direction, std::optional<double> hint);
 };
 
 } // namespace stone
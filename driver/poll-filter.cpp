@@ -0,0 +1,172 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "poll-filter.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "poll-index.h"
+
+namespace stone {
+
+// Before the first poll, the filter knows nothing about the race.
+static const double kPriorVariance = 10000.0;
+
+// Polls without a sample size are assumed to be typical.
+static const int kDefaultSampleSize = 600;
+
+// Polls without candidate numbers are assumed to have 10% undecided.
+static const double kDefaultDecided = 0.9;
+
+// On top of sampling error, each pollster's methods put it off by a couple
+// of points (2 points, squared).
+static const double kHouseVariance = 4.0;
+
+// Tracking polls re-use most of their sample from one release to the next, so
+// each release counts for less.
+static const double kTrackingFactor = 3.0;
+
+// Polls that contribute less than this to an estimate are left out.
+static const double kMinWeight = 0.005;
+
+// The same poll is often listed once per sample type. Like the windowed
+// average, only the best of them is used. Rows are sorted by end day, so
+// copies are next to each other.
+static bool
+IsSuperseded(const PollIndex& index, size_t row)
+{
+    auto is_better = [&index, row](size_t other) -> bool {
+        if (index.pollster(other) != index.pollster(row) ||
+            index.start_day(other) != index.start_day(row))
+        {
+            return false;
+        }
+        if (index.sample_type(other) != index.sample_type(row))
+            return index.sample_type(other) > index.sample_type(row);
+        return index.sample_size(other) > index.sample_size(row);
+    };
+
+    int end_day = index.end_day(row);
+    for (size_t i = row; i > 0 && index.end_day(i - 1) == end_day; i--) {
+        if (is_better(i - 1))
+            return true;
+    }
+    for (size_t i = row + 1; i < index.size() && index.end_day(i) == end_day; i++) {
+        if (is_better(i))
+            return true;
+    }
+    return false;
+}
+
+PollFilter::PollFilter(const PollIndex& index, const Params& params)
+  : index_(index),
+    drift_variance_(params.drift * params.drift)
+{
+    auto visible_day = [&index](size_t row) -> int {
+        return std::max(index.end_day(row), index.published_day(row));
+    };
+
+    std::vector<size_t> order;
+    order.reserve(index.size());
+    for (size_t row = 0; row < index.size(); row++) {
+        if (index.start_day(row) < params.cutoff || IsSuperseded(index, row))
+            continue;
+        order.emplace_back(row);
+    }
+
+    // Consume polls in the order they became visible. Rows are newest first,
+    // so ties go to the older poll first.
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) -> bool {
+        if (visible_day(a) != visible_day(b))
+            return visible_day(a) < visible_day(b);
+        return a > b;
+    });
+
+    // The estimate itself is not kept. Each day's estimate is rebuilt from the
+    // gains instead, as a weighted average of polls; see Select.
+    steps_.reserve(order.size());
+    double variance = kPriorVariance;
+    int last_day = order.empty() ? 0 : visible_day(order[0]);
+    for (size_t row : order) {
+        int day = visible_day(row);
+        variance += drift_variance_ * double(day - last_day);
+        last_day = day;
+
+        double gain = variance / (variance + MeasurementVariance(row, day));
+        variance *= 1.0 - gain;
+        steps_.emplace_back(Step{day, row, gain, variance});
+    }
+}
+
+double
+PollFilter::MeasurementVariance(size_t row, int day) const
+{
+    // Sampling variance of the margin, in points squared:
+    //    (d + g - (d - g)^2) / n
+    double dem = index_.dem(row) / 100.0;
+    double gop = index_.gop(row) / 100.0;
+    double margin = index_.margin(row) / 100.0;
+    double decided = (dem && gop) ? dem + gop : kDefaultDecided;
+    int sample_size = index_.sample_size(row) > 0 ? index_.sample_size(row) : kDefaultSampleSize;
+    double variance = std::max(decided - margin * margin, 0.01) / double(sample_size) * 10000.0;
+
+    variance += kHouseVariance;
+    if (index_.tracking(row))
+        variance *= kTrackingFactor;
+
+    // A poll published late measured the race as it was when it ended, and
+    // the race may have moved since.
+    variance += drift_variance_ * double(day - index_.end_day(row));
+    return variance;
+}
+
+void
+PollFilter::Select(int day, PollSelection* out) const
+{
+    out->index = &index_;
+
+    auto iter = std::upper_bound(steps_.begin(), steps_.end(), day,
+                                 [](int day, const Step& step) -> bool {
+        return day < step.day;
+    });
+    if (iter == steps_.begin())
+        return;
+    size_t last = (iter - steps_.begin()) - 1;
+
+    // The estimate is a weighted sum of every poll so far: a poll's weight is
+    // its gain, times whatever share of it later polls did not take away.
+    double remaining = 1.0;
+    double total = 0.0;
+    for (size_t i = last + 1; i-- > 0 && remaining >= kMinWeight;) {
+        double weight = remaining * steps_[i].gain;
+        remaining -= weight;
+        if (weight < kMinWeight && !out->rows.empty())
+            continue;
+        out->rows.emplace_back(steps_[i].row, weight);
+        total += weight;
+    }
+    for (auto& [_, weight] : out->rows)
+        weight /= total;
+
+    // Rows are in end date order, newest first, same as SortPolls.
+    std::sort(out->rows.begin(), out->rows.end());
+
+    double variance = steps_[last].variance + drift_variance_ * double(day - steps_[last].day);
+    out->filter_stddev = sqrt(variance);
+}
+
+} // namespace stone
@@ -0,0 +1,76 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace stone {
+
+class PollIndex;
+struct PollSelection;
+
+// A Kalman filter over one race's polls, as an alternative to averaging a
+// window of recent polls. The race's margin is modelled as a random walk, and
+// each poll is a noisy measurement of it on the day the poll ended.
+//
+// Polls are consumed once, in the order they became visible, so every day's
+// estimate is known after a single pass over the list. Like the windowed
+// average, a day only ever sees polls published by that day, so backdated
+// runs match live ones. (This means there is no smoothing pass: a smoother
+// would let later polls change earlier days.)
+class PollFilter
+{
+  public:
+    struct Params
+    {
+        // How far, in points of margin, the race is expected to move per day.
+        double drift = kDefaultDrift;
+
+        // Polls that started before this day (a DayNumber) are ignored.
+        int cutoff = 0;
+    };
+
+    static constexpr double kDefaultDrift = 0.25;
+
+    PollFilter(const PollIndex& index, const Params& params);
+
+    // Select the polls that make up the estimate for |day|, weighted by how
+    // much each contributes to it, and set the estimate's stddev. Polls whose
+    // contribution has decayed to almost nothing are left out.
+    void Select(int day, PollSelection* out) const;
+
+  private:
+    // The filter's state after each poll it consumed.
+    struct Step
+    {
+        // The day the poll became visible.
+        int day;
+        size_t row;
+        double gain;
+        double variance;
+    };
+
+    double MeasurementVariance(size_t row, int day) const;
+
+  private:
+    const PollIndex& index_;
+    double drift_variance_;
+    std::vector<Step> steps_;
+};
+
+} // namespace stone
@@ -0,0 +1,223 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "poll-index.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "logging.h"
+#include "utility.h"
+
+namespace stone {
+
+SampleType
+ParseSampleType(const std::string& sample_type)
+{
+    if (sample_type == "lv")
+        return SampleType::LikelyVoters;
+    if (sample_type == "rv")
+        return SampleType::RegisteredVoters;
+    if (sample_type == "a")
+        return SampleType::Adults;
+    return SampleType::Unknown;
+}
+
+PollIndex::PollIndex(const google::protobuf::RepeatedPtrField<Poll>& polls,
+                     PollsterIds* pollster_ids)
+  : polls_(&polls)
+{
+    start_days_.reserve(polls.size());
+    end_days_.reserve(polls.size());
+    published_days_.reserve(polls.size());
+    dem_.reserve(polls.size());
+    gop_.reserve(polls.size());
+    margin_.reserve(polls.size());
+    pollsters_.reserve(polls.size());
+    sample_types_.reserve(polls.size());
+    sample_sizes_.reserve(polls.size());
+    tracking_.reserve(polls.size());
+
+    for (const auto& poll : polls) {
+        int end = DayNumber(poll.end());
+        start_days_.emplace_back(DayNumber(poll.start()));
+        end_days_.emplace_back(end);
+        published_days_.emplace_back(poll.has_published() ? DayNumber(poll.published()) : end);
+        dem_.emplace_back(poll.dem());
+        gop_.emplace_back(poll.gop());
+        margin_.emplace_back(poll.margin());
+
+        auto iter = pollster_ids->emplace(poll.description(), (int)pollster_ids->size()).first;
+        pollsters_.emplace_back(iter->second);
+
+        sample_types_.emplace_back(ParseSampleType(poll.sample_type()));
+        sample_sizes_.emplace_back(poll.sample_size());
+        tracking_.emplace_back(poll.tracking());
+    }
+    assert(std::is_sorted(end_days_.begin(), end_days_.end(), std::greater<int>()));
+}
+
+size_t
+PollIndex::FindFirstEndedBy(int day) const
+{
+    // End days are descending, so this finds the first one <= day.
+    auto iter = std::lower_bound(end_days_.begin(), end_days_.end(), day, std::greater<int>());
+    return iter - end_days_.begin();
+}
+
+FeedIndex::FeedIndex(const Feed& feed)
+{
+    Add(feed.national_polls());
+    Add(feed.generic_ballot_polls());
+    for (const auto& [_, state] : feed.states())
+        Add(state.polls());
+    for (const auto& [_, list] : feed.senate_polls())
+        Add(list.polls());
+    for (const auto& [_, list] : feed.governor_polls())
+        Add(list.polls());
+    for (const auto& [_, list] : feed.house_polls())
+        Add(list.polls());
+}
+
+void
+FeedIndex::Add(const google::protobuf::RepeatedPtrField<Poll>& polls)
+{
+    lists_.emplace(&polls, PollIndex(polls, &pollster_ids_));
+}
+
+const PollIndex&
+FeedIndex::Get(const google::protobuf::RepeatedPtrField<Poll>& polls) const
+{
+    auto iter = lists_.find(&polls);
+    if (iter == lists_.end()) {
+        Err() << "Poll list is not part of the indexed feed.";
+        abort();
+    }
+    return iter->second;
+}
+
+void
+FeedIndex::BuildFilters(const PollFilter::Params& params)
+{
+    for (const auto& [_, index] : lists_)
+        filters_.emplace(&index, std::make_unique<PollFilter>(index, params));
+}
+
+const PollFilter*
+FeedIndex::GetFilter(const PollIndex& index) const
+{
+    auto iter = filters_.find(&index);
+    if (iter == filters_.end())
+        return nullptr;
+    return iter->second.get();
+}
+
+static std::string
+PollKey(const Poll& poll)
+{
+    if (!poll.weight())
+        return poll.SerializeAsString();
+
+    Poll copy = poll;
+    copy.clear_weight();
+    return copy.SerializeAsString();
+}
+
+PollTable::PollTable(google::protobuf::RepeatedPtrField<Poll>* polls)
+  : polls_(polls)
+{
+    for (int i = 0; i < polls_->size(); i++)
+        ids_.emplace(PollKey(polls_->Get(i)), i);
+}
+
+void
+PollTable::AddFeed(const FeedIndex& index)
+{
+    for (const auto& [_, list] : index.lists()) {
+        auto& rows = feed_rows_[&list];
+        rows.reserve(list.size());
+        for (size_t row = 0; row < list.size(); row++)
+            rows.emplace_back(Intern(list.poll(row)));
+    }
+}
+
+int
+PollTable::Find(const PollIndex& index, size_t row)
+{
+    if (auto iter = feed_rows_.find(&index); iter != feed_rows_.end())
+        return iter->second[row];
+    return Intern(index.poll(row));
+}
+
+int
+PollTable::Intern(const Poll& poll)
+{
+    auto key = PollKey(poll);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [iter, inserted] = ids_.emplace(std::move(key), polls_->size());
+    if (inserted) {
+        if (frozen_) {
+            Err() << "Poll was added to the poll table after it was frozen: "
+                  << poll.description();
+            abort();
+        }
+        Poll* entry = polls_->Add();
+        *entry = poll;
+        entry->clear_weight();
+    }
+    return iter->second;
+}
+
+void
+PollTable::MoveToTable(RaceModel* model)
+{
+    for (const auto& poll : model->polls()) {
+        auto ref = model->add_poll_refs();
+        ref->set_index(Intern(poll));
+        ref->set_weight(poll.weight());
+    }
+    model->clear_polls();
+}
+
+void
+PollTable::MoveToTable(ModelData* data)
+{
+    MoveToTable(data->mutable_national());
+    MoveToTable(data->mutable_generic_ballot());
+    for (auto& model : *data->mutable_states())
+        MoveToTable(&model);
+    for (auto& model : *data->mutable_senate_races())
+        MoveToTable(&model);
+    for (auto& model : *data->mutable_gov_races())
+        MoveToTable(&model);
+    for (auto& model : *data->mutable_house_races())
+        MoveToTable(&model);
+}
+
+void
+PollSelection::WriteTo(PollTable* table, google::protobuf::RepeatedPtrField<PollRef>* out) const
+{
+    out->Reserve(out->size() + rows.size());
+    for (const auto& [row, weight] : rows) {
+        PollRef* ref = out->Add();
+        ref->set_index(table->Find(*index, row));
+        ref->set_weight(weight);
+    }
+}
+
+} // namespace stone
@@ -0,0 +1,184 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <proto/model.pb.h>
+#include <proto/poll.pb.h>
+#include "poll-filter.h"
+
+namespace stone {
+
+// Values are in order of preference when deduplicating polls.
+enum class SampleType : uint8_t
+{
+    Unknown = 0,
+    Adults = 2,
+    RegisteredVoters = 3,
+    LikelyVoters = 4,
+};
+
+SampleType ParseSampleType(const std::string& sample_type);
+
+// Pollster names are interned so they can be compared as integers.
+typedef std::unordered_map<std::string, int> PollsterIds;
+
+// A read-only, column-wise copy of the fields of one poll list that analysis
+// needs, so that selecting polls for a day does not touch protobufs. The list
+// must be sorted by SortPolls (newest end date first), and rows are parallel
+// to it.
+class PollIndex
+{
+  public:
+    PollIndex(const google::protobuf::RepeatedPtrField<Poll>& polls, PollsterIds* pollster_ids);
+
+    // Return the index of the first poll that ended on or before |day|, or
+    // size() if there is none.
+    size_t FindFirstEndedBy(int day) const;
+
+    // Polls without a published date are treated as published when they end.
+    bool IsPublishedBy(size_t row, int day) const {
+        return published_days_[row] <= day;
+    }
+    int published_day(size_t row) const { return published_days_[row]; }
+
+    int start_day(size_t row) const { return start_days_[row]; }
+    int end_day(size_t row) const { return end_days_[row]; }
+    double dem(size_t row) const { return dem_[row]; }
+    double gop(size_t row) const { return gop_[row]; }
+    double margin(size_t row) const { return margin_[row]; }
+    int pollster(size_t row) const { return pollsters_[row]; }
+    SampleType sample_type(size_t row) const { return sample_types_[row]; }
+    int sample_size(size_t row) const { return sample_sizes_[row]; }
+    bool tracking(size_t row) const { return tracking_[row]; }
+
+    // The original poll, for the fields that are not indexed.
+    const Poll& poll(size_t row) const { return polls_->Get(row); }
+    size_t size() const { return end_days_.size(); }
+
+  private:
+    const google::protobuf::RepeatedPtrField<Poll>* polls_;
+    std::vector<int> start_days_;
+    std::vector<int> end_days_;
+    std::vector<int> published_days_;
+    std::vector<double> dem_;
+    std::vector<double> gop_;
+    std::vector<double> margin_;
+    std::vector<int> pollsters_;
+    std::vector<SampleType> sample_types_;
+    std::vector<int> sample_sizes_;
+    std::vector<uint8_t> tracking_;
+};
+
+// Poll indexes for every poll list in a feed. The feed must not change after
+// the index is built, since lists are looked up by address.
+class FeedIndex
+{
+  public:
+    explicit FeedIndex(const Feed& feed);
+
+    const PollIndex& Get(const google::protobuf::RepeatedPtrField<Poll>& polls) const;
+
+    // Run a PollFilter over every list. This must be called before any
+    // concurrent use.
+    void BuildFilters(const PollFilter::Params& params);
+
+    // Return the filter for an indexed list, or null if filters were not
+    // built.
+    const PollFilter* GetFilter(const PollIndex& index) const;
+
+    const std::unordered_map<const google::protobuf::RepeatedPtrField<Poll>*, PollIndex>&
+    lists() const {
+        return lists_;
+    }
+
+  private:
+    void Add(const google::protobuf::RepeatedPtrField<Poll>& polls);
+
+  private:
+    PollsterIds pollster_ids_;
+    std::unordered_map<const google::protobuf::RepeatedPtrField<Poll>*, PollIndex> lists_;
+    std::unordered_map<const PollIndex*, std::unique_ptr<PollFilter>> filters_;
+};
+
+// The campaign's table of every poll that a RaceModel refers to. Each poll is
+// stored once, without a weight, and races refer to it by its position.
+// Entries are never removed or reordered, so references in saved history stay
+// valid.
+class PollTable
+{
+  public:
+    // |polls| is the table, usually CampaignData::polls. Existing entries are
+    // reused when an identical poll is added.
+    explicit PollTable(google::protobuf::RepeatedPtrField<Poll>* polls);
+
+    // Add every poll in an indexed feed up front, so that Find does not need
+    // to lock for them. This must be called before any concurrent use.
+    void AddFeed(const FeedIndex& index);
+
+    // Return the table index of a row in a PollIndex. Rows of indexes that
+    // were not added with AddFeed are added on demand.
+    int Find(const PollIndex& index, size_t row);
+
+    // Return the table index of |poll|, adding it if needed. Its weight is
+    // ignored. This is thread-safe.
+    int Intern(const Poll& poll);
+
+    // Forbid adding entries from here on, so that the table can be read
+    // without locking while analysis is still looking polls up. Adding a poll
+    // after this is a fatal error.
+    void Freeze() { frozen_ = true; }
+
+    // Move a RaceModel's embedded polls, from history saved before the table
+    // existed, into the table.
+    void MoveToTable(RaceModel* model);
+    void MoveToTable(ModelData* data);
+
+  private:
+    std::mutex mutex_;
+    google::protobuf::RepeatedPtrField<Poll>* polls_;
+    bool frozen_ = false;
+    std::unordered_map<std::string, int> ids_;
+    std::unordered_map<const PollIndex*, std::vector<int>> feed_rows_;
+};
+
+// The polls chosen for one race, as weighted rows of a PollIndex, newest
+// first.
+struct PollSelection
+{
+    const PollIndex* index = nullptr;
+    std::vector<std::pair<size_t, double>> rows;
+
+    // If the polls came from a PollFilter, the stddev of its estimate.
+    double filter_stddev = 0.0;
+
+    bool empty() const { return rows.empty(); }
+    size_t size() const { return rows.size(); }
+
+    // Add references to the selected polls, with their weights, to a
+    // RaceModel.
+    void WriteTo(PollTable* table, google::protobuf::RepeatedPtrField<PollRef>* out) const;
+};
+
+} // namespace stone
@@ -15,6 +15,11 @@
 // limitations under the License.
 #include "predict.h"
 
+#include <assert.h>
+
+#include <atomic>
+#include <optional>
+
 #include "analysis.h"
 #include "campaign.h"
 #include "context.h"
@@ -63,32 +68,62 @@ static const std::vector<double> kMaxBallotSwing_Midterm = {
     7.86, 7.86, 7.86, 7.86, 7.86, 7.86, 7.98, 9.27, 11.27
 };
 
+static const std::vector<double>*
+GetMaxSwingByDay(Campaign* cc, Race_RaceType race_type)
+{
+    if (race_type == Race::ELECTORAL_COLLEGE)
+        return &kMaxNationalSwing;
+    if (cc->IsPresidentialYear())
+        return &kMaxBallotSwing_PresYear;
+    return &kMaxBallotSwing_Midterm;
+}
+
+static double
+GetSwing(const std::vector<double>& max_swing_by_day, double swing, int days_left)
+{
+    double min_swing = max_swing_by_day.back();
+    if (size_t(days_left) < max_swing_by_day.size())
+        min_swing = max_swing_by_day.at(days_left);
+
+    // Empirically, the metamargin is off by ~2 points each election.
+    min_swing = std::max(min_swing, 2.0);
+
+    return std::max(swing, min_swing);
+}
+
+// Bayes() only queries the surface near the posterior's mode and at a few
+// thresholds, so blocks of the surface are evaluated as they are needed.
+template <class AT>
+static std::unique_ptr<ScoreSurface>
+BuildSurface(Campaign* cc, const ModelData* day)
+{
+    return std::make_unique<ScoreSurface>(AT::GetRaceArray(cc, day));
+}
+
+// |prior_mm_sums| and |prior_swing_sums| are running sums over every earlier
+// day. See Predictor::PriorSums.
 template <class AT>
 static void
 SetBayesParameters(MarginPredictor* mp, Campaign* cc, const ModelData* day,
-                   const std::vector<const ModelData*>& priors)
+                   const std::vector<double>& prior_mm_sums,
+                   const std::vector<double>& prior_swing_sums, size_t num_priors,
+                   ScoreSurface* surface)
 {
     mp->metamargin = AT::GetMetamargin(day);
     mp->swing = Analysis::UndecidedFactor(day->undecideds());
 
-    std::vector<double> prior_mm, prior_swing;
-    for (const auto& day : priors) {
-        prior_mm.emplace_back(AT::GetMetamargin(day));
-        prior_swing.emplace_back(day->undecideds());
-    }
-
-    if (prior_mm.empty())
+    if (!num_priors)
         mp->prior_mm = AT::GetMetamargin(day);
     else
-        mp->prior_mm = Average(prior_mm);
+        mp->prior_mm = prior_mm_sums[num_priors] / double(num_priors);
 
-    if (prior_swing.empty())
+    if (!num_priors)
         mp->prior_swing = day->undecideds();
     else
-        mp->prior_swing = Average(prior_swing);
+        mp->prior_swing = prior_swing_sums[num_priors] / double(num_priors);
 
     mp->prior_swing = std::max(6.0f, (float)Analysis::UndecidedFactor(mp->prior_swing));
-    mp->bias_fn = AT::GetBiasFn(cc, day);
+    mp->bias_fn = surface->AsBiasFn();
     mp->mm_adjust = AT::GetMetamarginAdjustment(day);
 
     // Debugging.
@@ -107,28 +142,100 @@ SetBayesParameters(MarginPredictor* mp, Campaign* cc, const ModelData* day,
 }
 
 bool
-Predictor::Predict()
+Predictor::Start(size_t num_days)
 {
-    if (!DaysBetween(cc_->StartDate(), cc_->EndDate(), &days_in_campaign_))
+    bayes_tolerance_ = cx_->GetPropDouble("bayes-tolerance", kDefaultBayesTolerance);
+
+    // Simulations are expensive next to the rest of a day's prediction, so
+    // they only run when asked for.
+    sim_params_.num_sims = cx_->GetPropInt("simulations", 0);
+    if (sim_params_.num_sims < 0) {
+        Err() << "Invalid simulations setting.";
+        return false;
+    }
+    sim_params_.national_share = cx_->GetPropDouble("simulation-national-share", 0.4);
+    sim_params_.regional_share = cx_->GetPropDouble("simulation-regional-share", 0.2);
+    sim_params_.df = cx_->GetPropInt("simulation-df", 0);
+    if (sim_params_.national_share < 0.0 || sim_params_.regional_share < 0.0 ||
+        sim_params_.national_share + sim_params_.regional_share >= 1.0)
+    {
+        Err() << "Simulation error shares must be non-negative and add up to less than 1.";
+        return false;
+    }
+    if (sim_params_.df < 0) {
+        Err() << "Invalid simulation-df setting.";
         return false;
+    }
 
-    auto& history = *data_->mutable_history();
+    for (auto* sums : {&prior_sums_.ec_mm, &prior_sums_.senate_mm, &prior_sums_.house_mm,
+                       &prior_sums_.undecideds})
+    {
+        sums->assign(num_days + 1, 0.0);
+    }
+    num_priors_ = 0;
+    return DaysBetween(cc_->StartDate(), cc_->EndDate(), &days_in_campaign_);
+}
 
-    ProgressBar pbar("Predicting      ", history.size());
+void
+Predictor::AddPrior(const ModelData* day)
+{
+    size_t n = num_priors_++;
+    assert(num_priors_ < prior_sums_.undecideds.size());
 
-    bool should_predict = false;
+    auto add = [n](std::vector<double>* sums, double value) -> void {
+        (*sums)[n + 1] = (*sums)[n] + value;
+    };
+    add(&prior_sums_.ec_mm, StateAnalysis::GetMetamargin(day));
+    add(&prior_sums_.senate_mm, SenateAnalysis::GetMetamargin(day));
+    add(&prior_sums_.house_mm, HouseAnalysis::GetMetamargin(day));
+    add(&prior_sums_.undecideds, day->undecideds());
+}
+
+bool
+Predictor::Predict()
+{
+    auto& history = *data_->mutable_history();
+    if (!Start(history.size()))
+        return false;
+
+    // Predictions only use earlier days' analysis, not their predictions, so
+    // every prior can be added up front, and then every day predicted in
+    // parallel. Once a day needs a new prediction, every day after it does
+    // too.
+    std::vector<std::pair<ModelData*, size_t>> days;
     for (auto iter = history.rbegin(); iter != history.rend(); iter++) {
-        if (iter->generated() >= data_->last_updated())
-            should_predict = true;
+        if (!days.empty() || iter->generated() >= data_->last_updated())
+            days.emplace_back(&*iter, num_priors_);
+        AddPrior(&*iter);
+    }
 
-        if (should_predict && !PredictDay(&*iter))
-            return false;
-        priors_.emplace_back(&*iter);
-        pbar.Increment();
+    ProgressBar pbar("Predicting      ", days.size());
+    std::atomic<bool> ok = true;
+    for (const auto& [day, num_priors] : days) {
+        cx_->workers().Do([this, &ok, day = day, num_priors = num_priors](ThreadPool*) -> void {
+            DaySurfaces surfaces;
+            BuildSurfaces(day, &surfaces);
+            if (!PredictDay(day, &surfaces, num_priors))
+                ok = false;
+        }, [&pbar]() -> void {
+            pbar.Increment();
+        });
     }
+    cx_->workers().RunCompletionTasks();
     pbar.Finish();
 
-    return true;
+    return ok.load();
+}
+
+void
+Predictor::BuildSurfaces(const ModelData* day, DaySurfaces* surfaces)
+{
+    if (cc_->IsPresidentialYear())
+        surfaces->ec = BuildSurface<StateAnalysis>(cc_, day);
+    if (!day->senate_races().empty())
+        surfaces->senate = BuildSurface<SenateAnalysis>(cc_, day);
+    if (day->house_can_flip())
+        surfaces->house = BuildSurface<HouseAnalysis>(cc_, day);
 }
 
 [[maybe_unused]] static void
@@ -147,8 +254,60 @@ DumpP(const Prediction &p)
         p.score_2sig().high());
 }
 
+// Return the lowest margin, no lower than |from|, at which the score reaches
+// |score|, to the resolution of the score surface. The posterior's points are
+// searched first, and then the gap before the first one that reaches the
+// score is bisected, since points can be far apart in the tails.
+static std::optional<double>
+FindScoreThreshold(const MarginPredictor* mp, int score, double from)
+{
+    auto reaches = [mp, score](double mm) -> bool {
+        return mp->bias_fn(mm - mp->metamargin) >= score;
+    };
+
+    double below = std::max(from, mp->mm_range.front());
+    if (reaches(below))
+        return below;
+    for (const auto& mm : mp->mm_range) {
+        if (mm <= below)
+            continue;
+        if (!reaches(mm)) {
+            below = mm;
+            continue;
+        }
+
+        double above = mm;
+        while (above - below > ScoreSurface::kStep) {
+            double mid = (below + above) / 2;
+            if (reaches(mid))
+                above = mid;
+            else
+                below = mid;
+        }
+        return above;
+    }
+    return {};
+}
+
+// Return the probability that the margin is below the score threshold at
+// |mm|. A threshold stands for the surface grid step that it starts.
+static double
+ProbabilityBelow(const MarginPredictor* mp, double mm)
+{
+    return InterpolateCdf(mp->mm_range, mp->cs, mm - ScoreSurface::kStep / 2);
+}
+
+static double
+GetWinP(const MarginPredictor* mp)
+{
+    auto mm = FindScoreThreshold(mp, mp->score_to_win, 0.0);
+    if (!mm)
+        return 0.0;
+    return 1.0 - ProbabilityBelow(mp, *mm);
+}
+
 bool
-Predictor::PredictDay(ModelData* day)
+Predictor::PredictDay(ModelData* day, DaySurfaces* surfaces, size_t num_priors)
 {
     int days_left;
     if (!DaysBetween(day->date(), cc_->EndDate(), &days_left))
@@ -158,8 +317,10 @@ Predictor::PredictDay(ModelData* day)
         auto* p = day->mutable_ec_prediction();
 
         MarginPredictor mp;
-        mp.max_swing_by_day = &kMaxNationalSwing;
-        SetBayesParameters<StateAnalysis>(&mp, cc_, day, priors_);
+        mp.max_swing_by_day = GetMaxSwingByDay(cc_, Race::ELECTORAL_COLLEGE);
+        SetBayesParameters<StateAnalysis>(&mp, cc_, day, prior_sums_.ec_mm,
+                                          prior_sums_.undecideds, num_priors,
+                                          surfaces->ec.get());
         Bayes(&mp, p, days_left);
 
         Convolver cv =
@@ -173,11 +334,10 @@ Predictor::PredictDay(ModelData* day)
 
     if (!day->senate_races().empty()) {
         MarginPredictor mp;
-	if (cc_->IsPresidentialYear())
-	    mp.max_swing_by_day = &kMaxBallotSwing_PresYear;
-	else
-	    mp.max_swing_by_day = &kMaxBallotSwing_Midterm;
-        SetBayesParameters<SenateAnalysis>(&mp, cc_, day, priors_);
+        mp.max_swing_by_day = GetMaxSwingByDay(cc_, Race::SENATE);
+        SetBayesParameters<SenateAnalysis>(&mp, cc_, day, prior_sums_.senate_mm,
+                                           prior_sums_.undecideds, num_priors,
+                                           surfaces->senate.get());
         Bayes(&mp, day->mutable_senate_prediction(), days_left);
 
         int dem_seats_to_control = cc_->senate_map().dem_seats_for_control();
@@ -185,83 +345,84 @@ Predictor::PredictDay(ModelData* day)
 
         double win_prob_inv = 1.0;
         int alt_seats = mp.score_to_win - alt_delta;
-        for (size_t i = 0; i < mp.mm_range.size(); i++) {
-            if (mp.bias_fn(mp.mm_range[i] - mp.metamargin) >= alt_seats) {
-                if (i == 0)
-                    win_prob_inv = 0.0;
-                else
-                    win_prob_inv = mp.cs[i - 1];
-                break;
-            }
-        }
+        if (auto mm = FindScoreThreshold(&mp, alt_seats, mp.mm_range.front()))
+            win_prob_inv = ProbabilityBelow(&mp, *mm);
         day->set_senate_win_prob_alt(1.0 - win_prob_inv);
     }
 
     if (day->house_can_flip()) {
         MarginPredictor mp;
-	if (cc_->IsPresidentialYear())
-	    mp.max_swing_by_day = &kMaxBallotSwing_PresYear;
-	else
-	    mp.max_swing_by_day = &kMaxBallotSwing_Midterm;
-        SetBayesParameters<HouseAnalysis>(&mp, cc_, day, priors_);
+        mp.max_swing_by_day = GetMaxSwingByDay(cc_, Race::HOUSE);
+        SetBayesParameters<HouseAnalysis>(&mp, cc_, day, prior_sums_.house_mm,
+                                          prior_sums_.undecideds, num_priors,
+                                          surfaces->house.get());
         Bayes(&mp, day->mutable_house_prediction(), days_left);
     }
+
+    if (sim_params_.num_sims > 0) {
+        Simulate(day, surfaces);
+    } else {
+        // Don't leave distributions from an earlier run with simulations.
+        day->clear_ec_simulation();
+        day->clear_senate_simulation();
+        day->clear_house_simulation();
+    }
     return true;
 }
 
-static double GetWinP(MarginPredictor* mp, const std::vector<double>& cs)
+// Simulate the day's races as they stand, with correlated errors. Every race
+// type goes through the same simulations, so a national error moves the EC,
+// the Senate and the House together.
+void
+Predictor::Simulate(ModelData* day, DaySurfaces* surfaces)
 {
-    for (size_t i = 0; i < cs.size(); i++) {
-        if (mp->mm_range[i] < 0.0)
-            continue;
-        if (mp->bias_fn(mp->mm_range[i] - mp->metamargin) >= mp->score_to_win) {
-            if (i == 0)
-                return 1.0;
-            return 1.0 - cs[i - 1];
-        }
-    }
-    return 0.0f;
+    // Seed by date, so that each day gets its own draws, and rerunning a day
+    // gives the same results.
+    SimulationParams params = sim_params_;
+    params.seed = (uint64_t(day->date().year()) << 32) |
+                  (uint64_t(day->date().month()) << 8) | uint64_t(day->date().day());
+
+    Simulator sim(params, cc_->num_regions());
+
+    int score, offset;
+    if (surfaces->ec && StateAnalysis::GetScoreToWin(cc_, day, &score, &offset))
+        sim.AddRaces(surfaces->ec->races(), offset, score, day->mutable_ec_simulation());
+    if (surfaces->senate && SenateAnalysis::GetScoreToWin(cc_, day, &score, &offset))
+        sim.AddRaces(surfaces->senate->races(), offset, score, day->mutable_senate_simulation());
+    if (surfaces->house && HouseAnalysis::GetScoreToWin(cc_, day, &score, &offset))
+        sim.AddRaces(surfaces->house->races(), offset, score, day->mutable_house_simulation());
+
+    sim.Run(&cx_->workers());
 }
 
 void
 Predictor::Bayes(MarginPredictor* mp, Prediction *p, int days_left)
 {
-    double min_swing = mp->max_swing_by_day->back();
-    if (size_t(days_left) < mp->max_swing_by_day->size())
-        min_swing = mp->max_swing_by_day->at(days_left);
-
-    // Empirically, the metamargin is off by ~2 points each election.
-    min_swing = std::max(min_swing, 2.0);
-
-    double swing = std::max(mp->swing, min_swing);
-
-    // Get a four-sigma range of metamargin values.
-    double mm_4sig_low = mp->metamargin - 4 * swing;
-    double mm_4sig_high = mp->metamargin + 4 * swing;
-    for (double mm = mm_4sig_low; mm <= mm_4sig_high; mm += 0.02)
-        mp->mm_range.emplace_back(mm);
-
-    auto& mm_range = mp->mm_range;
-
-    std::vector<double> now;
-    for (const auto& mm : mm_range)
-        now.emplace_back(Tpdf((mm - mp->metamargin) / swing, 3));
-    double now_sum = Sum(now);
-
-    std::vector<double> prior;
-    for (const auto& mm : mm_range)
-        prior.emplace_back(Tpdf((mm - mp->prior_mm) / mp->prior_swing, 1));
-    double prior_sum = Sum(prior);
-
-    double pred_sum = 0;
-    for (size_t i = 0; i < now.size(); i++) {
-        mp->prediction.emplace_back((now[i] / now_sum) * (prior[i] / prior_sum));
-        pred_sum += mp->prediction.back();
-    }
-    for (auto& v : mp->prediction)
-        v /= pred_sum;
+    double swing = GetSwing(*mp->max_swing_by_day, mp->swing, days_left);
+
+    // The posterior is a t-distribution around today's metamargin times a
+    // Cauchy distribution around the prior. Sample it over a four-sigma range
+    // of metamargin values, with points packed where it curves, usually near
+    // its mode, and spread out in the flat tails.
+    std::vector<double> today, prior;
+    auto density = [&](const double* mm, size_t n, double* out) -> void {
+        today.resize(n);
+        prior.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            today[i] = (mm[i] - mp->metamargin) / swing;
+            prior[i] = (mm[i] - mp->prior_mm) / mp->prior_swing;
+        }
+        Tpdf(today.data(), n, 3, today.data());
+        Tpdf(prior.data(), n, 1, prior.data());
+        for (size_t i = 0; i < n; i++)
+            out[i] = today[i] * prior[i];
+    };
+    std::vector<double> values;
+    AdaptiveSample(density, mp->metamargin - 4 * swing, mp->metamargin + 4 * swing,
+                   bayes_tolerance_, ScoreSurface::kStep, &mp->mm_range, &values);
+    mp->prediction = PointMasses(mp->mm_range, values);
 
-    double predicted_mm = WeightedAverage(mm_range, mp->prediction);
+    double predicted_mm = WeightedAverage(mp->mm_range, mp->prediction);
     p->set_metamargin(RoundMargin(predicted_mm));
 
     mp->cs = Cumsum(mp->prediction);
@@ -269,40 +430,26 @@ Predictor::Bayes(MarginPredictor* mp, Prediction *p, int days_left)
     // The metamargin represents the movement toward a tie. For the EC it's
     // fine to use 0.0 as the win point, because the outcomes tend to cluster
     // close together. But for the senate, the difference between 50 and 51
-    // seats can be a steep cliff. So, we walk the MM list and find the first
-    // margin to bring us to a win. We do know however that this will be at a
-    // margin of >= 0, so we can optimize the walk a bit.
+    // seats can be a steep cliff. So, we search for the first margin to bring
+    // us to a win. We do know however that this will be at a margin of >= 0,
+    // so we can optimize the search a bit.
     //
     // Note that we clamp the result to not go below 0.01 or above 0.99. A 0%
     // or 100% chance does not make sense as long as both candidates are
     // running.
     if (mp->score_to_win > 0) {
-        p->set_dem_win_p(std::clamp(GetWinP(mp, mp->cs), 0.01, 0.99));
+        p->set_dem_win_p(std::clamp(GetWinP(mp), 0.01, 0.99));
     }
 
-    // Walk the cumulative sum looking for interesting points (sorted).
+    // Find the interesting points of the posterior (sorted).
     std::vector<double> points = {
         NormalCdf(-2.0, 0.0, 1.0),
         NormalCdf(-1.0, 0.0, 1.0),
         NormalCdf(1.0, 0.0, 1.0),
         NormalCdf(2.0, 0.0, 1.0),
     };
-    auto pt_iter = points.begin();
-    auto cs_iter = mp->cs.begin();
-    auto mm_iter = mm_range.begin();
-    while (pt_iter != points.end()) {
-        double result = mm_range.back();
-        while (cs_iter != mp->cs.end() && mm_iter != mm_range.end()) {
-            if (*cs_iter >= *pt_iter) {
-                result = *mm_iter;
-                break;
-            }
-            cs_iter++;
-            mm_iter++;
-        }
-        *pt_iter = RoundMargin(result);
-        pt_iter++;
-    }
+    for (auto& point : points)
+        point = RoundMargin(InterpolateQuantile(mp->mm_range, mp->cs, point));
 
     // This is the only place where we need to account for the metamargin
     // adjustment (eg generic ballot to house conversion). Everywhere else,
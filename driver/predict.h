@@ -18,8 +18,12 @@
 #include <proto/history.pb.h>
 
 #include <functional>
+#include <memory>
 #include <vector>
 
+#include "score-surface.h"
+#include "simulation.h"
+
 namespace stone {
 
 class Campaign;
@@ -43,6 +47,13 @@ struct MarginPredictor {
     std::vector<double> cs;
 };
 
+// Score surfaces for one day, one per race type that gets a prediction.
+struct DaySurfaces {
+    std::unique_ptr<ScoreSurface> ec;
+    std::unique_ptr<ScoreSurface> senate;
+    std::unique_ptr<ScoreSurface> house;
+};
+
 class Predictor
 {
   public:
@@ -50,19 +61,55 @@ class Predictor
       : cx_(cx), cc_(cc), data_(data)
     {}
 
+    // Predict every day that needs it, in parallel.
     bool Predict();
 
+    // Days can also be predicted as they become ready. Call Start with the
+    // number of days first. Then pass each day, oldest first, to AddPrior once
+    // it has been analyzed. A day's surfaces can be built once it has been
+    // analyzed, and the day can be predicted once every day before it has
+    // been added. BuildSurfaces and PredictDay can run in parallel with each
+    // other and with AddPrior, which must only be called from one thread at a
+    // time.
+    bool Start(size_t num_days);
+    void AddPrior(const ModelData* day);
+    void BuildSurfaces(const ModelData* day, DaySurfaces* surfaces);
+    bool PredictDay(ModelData* day, DaySurfaces* surfaces, size_t num_priors);
+
   private:
-    bool PredictDay(ModelData* day);
     void PredictPresident(ModelData* day, int days_left);
 
     void Bayes(MarginPredictor* mp, Prediction *p, int days_left);
+    void Simulate(ModelData* day, DaySurfaces* surfaces);
 
   private:
     Context* cx_;
     Campaign* cc_;
     CampaignData* data_;
-    std::vector<const ModelData*> priors_;
+
+    // Running sums of each prior input, oldest day first. Entry N is the sum
+    // over the first N days, so any day's average is one lookup. These are
+    // sized up front, so that AddPrior never moves them while a prediction
+    // reads them.
+    struct PriorSums
+    {
+        std::vector<double> ec_mm;
+        std::vector<double> senate_mm;
+        std::vector<double> house_mm;
+        std::vector<double> undecideds;
+    };
+    PriorSums prior_sums_;
+    size_t num_priors_ = 0;
+
+    // The largest error, as a fraction of the posterior's mass, that Bayes()
+    // allows on any interval of its quadrature grid. This is the
+    // "bayes-tolerance" setting.
+    static constexpr double kDefaultBayesTolerance = 1e-5;
+    double bayes_tolerance_ = kDefaultBayesTolerance;
+
+    // From the "simulations", "simulation-national-share",
+    // "simulation-regional-share" and "simulation-df" settings.
+    SimulationParams sim_params_;
     int days_in_campaign_;
 };
 
@@ -0,0 +1,119 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "race-cache.h"
+
+#include "context.h"
+#include "logging.h"
+
+namespace stone {
+
+static const char kRaceCacheFile[] = "race-cache.bin";
+
+bool
+RaceCache::Load(Context* cx)
+{
+    if (!cx->FileExists(kRaceCacheFile))
+        return true;
+
+    std::string bits;
+    if (!cx->Read(kRaceCacheFile, &bits)) {
+        Err() << "Could not read race cache.";
+        return false;
+    }
+    if (!saved_.ParseFromString(bits)) {
+        // The cache is only an optimization, so start over.
+        Err() << "Could not parse race cache protobuf, ignoring.";
+        saved_.Clear();
+    }
+    return true;
+}
+
+bool
+RaceCache::Save(Context* cx)
+{
+    // Days that were not analyzed by this run keep the keys they used before.
+    RaceModelCache out;
+    auto& days = *out.mutable_days();
+    days = used_.days();
+    for (const auto& [day, keys] : saved_.days()) {
+        if (!days.count(day))
+            days[day] = keys;
+    }
+
+    auto& races = *out.mutable_races();
+    for (const auto& [_, keys] : days) {
+        for (uint64_t key : keys.keys()) {
+            if (races.count(key))
+                continue;
+            if (auto iter = used_.races().find(key); iter != used_.races().end())
+                races[key] = iter->second;
+            else if (auto saved = saved_.races().find(key); saved != saved_.races().end())
+                races[key] = saved->second;
+        }
+    }
+
+    std::string bits;
+    out.SerializeToString(&bits);
+    return cx->Save(bits, kRaceCacheFile);
+}
+
+void
+RaceCache::Use(int day, uint64_t key)
+{
+    (*used_.mutable_days())[day].add_keys(key);
+}
+
+bool
+RaceCache::Find(int day, uint64_t key, RaceModel* model)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto& used = *used_.mutable_races();
+    if (auto iter = used.find(key); iter != used.end()) {
+        model->MergeFrom(iter->second);
+        Use(day, key);
+        return true;
+    }
+
+    auto iter = saved_.races().find(key);
+    if (iter == saved_.races().end())
+        return false;
+
+    model->MergeFrom(iter->second);
+    used[key] = iter->second;
+    Use(day, key);
+    return true;
+}
+
+void
+RaceCache::Insert(int day, uint64_t key, const RaceModel& model)
+{
+    RaceModel stats;
+    stats.set_margin(model.margin());
+    stats.set_win_prob(model.win_prob());
+    stats.set_mean(model.mean());
+    stats.set_median(model.median());
+    stats.set_stddev(model.stddev());
+    stats.set_undecideds(model.undecideds());
+    stats.set_dem_average(model.dem_average());
+    stats.set_gop_average(model.gop_average());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    (*used_.mutable_races())[key] = std::move(stats);
+    Use(day, key);
+}
+
+} // namespace stone
@@ -0,0 +1,64 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdint.h>
+
+#include <mutex>
+
+#include <proto/cache.pb.h>
+#include <proto/model.pb.h>
+
+namespace stone {
+
+class Context;
+
+// Memoizes per-race poll statistics and win probabilities. Most days select
+// the same polls for a race as the day before, and most runs recompute days
+// whose polls have not changed. Lookups are thread-safe.
+class RaceCache
+{
+  public:
+    // Bump this when a change to the model would change race stats for the
+    // same inputs, to invalidate saved caches.
+    static constexpr int kVersion = 1;
+
+    bool Load(Context* cx);
+    bool Save(Context* cx);
+
+    // On a hit, merge the stored stats into |model|. Polls are not stored.
+    // |day| is the DayNumber of the day being analyzed, which is recorded as
+    // using the key.
+    bool Find(int day, uint64_t key, RaceModel* model);
+    void Insert(int day, uint64_t key, const RaceModel& model);
+
+  private:
+    void Use(int day, uint64_t key);
+
+  private:
+    std::mutex mutex_;
+
+    // Entries from the previous run, and the keys each saved day used.
+    RaceModelCache saved_;
+
+    // Entries used or added by this run, and the keys each day analyzed by
+    // this run used. Saving keeps the entries that some day still uses: the
+    // days analyzed by this run, and the saved days that were kept as is.
+    // Entries for poll sets that no longer occur are dropped.
+    RaceModelCache used_;
+};
+
+} // namespace stone
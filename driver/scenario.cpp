@@ -0,0 +1,449 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "scenario.h"
+
+#include <assert.h>
+
+#include <sstream>
+
+#include "analysis.h"
+#include "campaign.h"
+#include "logging.h"
+#include "metamargin.h"
+#include "score-surface.h"
+#include "utility.h"
+
+namespace stone {
+
+// A forced race's margin. This is past any bias the metamargin search tries,
+// so the race never flips.
+static const double kForcedMargin = 1000.0;
+
+static const char*
+RaceTypeName(Race_RaceType type)
+{
+    switch (type) {
+        case Race::ELECTORAL_COLLEGE:
+            return "ev";
+        case Race::SENATE:
+            return "senate";
+        case Race::HOUSE:
+            return "house";
+        default:
+            return "unknown";
+    }
+}
+
+static bool
+ParseOverride(const std::string& text, ScenarioOverride* out)
+{
+    std::vector<std::string> words;
+    std::istringstream in(text);
+    for (std::string word; in >> word;)
+        words.emplace_back(std::move(word));
+
+    const std::string& action = words[0];
+    if (action == "shift" && words.size() == 2) {
+        out->action = ScenarioOverride::Action::Shift;
+        return ParseFloat(words[1], &out->value);
+    }
+    if (words.size() < 3)
+        return false;
+
+    // Race names can have spaces, like "New York/Class I".
+    std::string race = words[1];
+    for (size_t i = 2; i < words.size() - 1; i++)
+        race += " " + words[i];
+
+    for (auto type : {Race::ELECTORAL_COLLEGE, Race::SENATE, Race::HOUSE}) {
+        std::string prefix = std::string(RaceTypeName(type)) + ":";
+        if (race.size() > prefix.size() && race.compare(0, prefix.size(), prefix) == 0) {
+            out->race_type = type;
+            out->race = race.substr(prefix.size());
+            break;
+        }
+    }
+    if (out->race_type == Race::UNKNOWN)
+        return false;
+
+    const std::string& value = words.back();
+    if (action == "shift") {
+        out->action = ScenarioOverride::Action::Shift;
+        return ParseFloat(value, &out->value);
+    }
+    if (action == "force") {
+        out->action = ScenarioOverride::Action::Force;
+        if (value == "dem")
+            out->value = 1.0;
+        else if (value == "gop")
+            out->value = -1.0;
+        else
+            return false;
+        return true;
+    }
+    if (action == "stddev") {
+        out->action = ScenarioOverride::Action::SetStddev;
+        return ParseFloat(value, &out->value) && out->value > 0.0;
+    }
+    return false;
+}
+
+bool
+ParseScenario(std::string_view text, Scenario* out)
+{
+    std::string rest(text);
+    size_t pos = 0;
+    while (pos <= rest.size()) {
+        size_t end = rest.find(';', pos);
+        if (end == std::string::npos)
+            end = rest.size();
+        std::string part = rest.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (part.find_first_not_of(" \t\r\n") == std::string::npos)
+            continue;
+
+        ScenarioOverride change;
+        if (!ParseOverride(part, &change)) {
+            Err() << "Invalid scenario override: " << part;
+            return false;
+        }
+        out->emplace_back(std::move(change));
+    }
+    return true;
+}
+
+ScenarioEngine::ScenarioEngine(Campaign* cc, const ModelData& data, ThreadPool* pool)
+  : cc_(cc),
+    pool_(pool)
+{
+    if (cc->IsPresidentialYear() && !data.states().empty()) {
+        Chamber ev;
+        ev.type = Race::ELECTORAL_COLLEGE;
+        ev.races = StateAnalysis::GetRaceArray(cc, &data);
+        for (const auto& state : data.states()) {
+            ev.indexes.emplace(state.race_id(), ev.base_p.size());
+            ev.base_p.emplace_back(state.win_prob());
+        }
+        ev.needed = GetTiebreakerMajority(cc->TotalEv());
+        ev.base_metamargin = {data.metamargin()};
+        InitChamber(&ev);
+    }
+
+    if (!data.senate_races().empty()) {
+        Chamber senate;
+        senate.type = Race::SENATE;
+        senate.races = SenateAnalysis::GetRaceArray(cc, &data);
+        for (const auto& race : data.senate_races()) {
+            // Same test as SenateAnalysis::GetRaceArray.
+            if (race.poll_refs().empty() && !race.rating().empty()) {
+                if (race.rating() == "dem" || race.rating() == "gop")
+                    senate.safe_races.emplace(race.race_id(), race.rating() == "dem");
+                continue;
+            }
+            senate.indexes.emplace(race.race_id(), senate.base_p.size());
+            senate.base_p.emplace_back(race.win_prob());
+        }
+        senate.safe_dem = data.senate_safe_seats().dem();
+        senate.safe_gop = data.senate_safe_seats().gop();
+        senate.needed = cc->senate_map().dem_seats_for_control();
+        if (data.senate_can_flip())
+            senate.base_metamargin = {data.senate_mm()};
+        InitChamber(&senate);
+    }
+
+    if (!data.house_races().empty()) {
+        Chamber house;
+        house.type = Race::HOUSE;
+        house.races = HouseAnalysis::GetRaceArray(cc, &data);
+        for (const auto& race : data.house_races()) {
+            house.indexes.emplace(race.race_id(), house.base_p.size());
+            house.base_p.emplace_back(race.win_prob());
+        }
+        // The analysis leaves safe seats out of the day's races.
+        for (const auto& race : cc->house_map().races()) {
+            if (!house.indexes.count(race.race_id()))
+                house.safe_races.emplace(race.race_id(), HouseAnalysis::IsSafeForDem(race));
+        }
+        house.safe_dem = data.house_safe_seats().dem();
+        house.safe_gop = data.house_safe_seats().gop();
+        house.needed = GetTiebreakerMajority(cc->house_map().total_seats());
+        if (data.house_can_flip())
+            house.base_metamargin = {data.house_mm()};
+        InitChamber(&house);
+    }
+}
+
+void
+ScenarioEngine::InitChamber(Chamber* chamber)
+{
+    assert(chamber->races.size() == chamber->base_p.size());
+
+    std::vector<std::pair<int, double>> win_p;
+    win_p.reserve(chamber->races.size());
+    for (size_t i = 0; i < chamber->races.size(); i++)
+        win_p.emplace_back((int)chamber->races.weights[i], chamber->base_p[i]);
+    chamber->cv.emplace(Convolver::Updatable(std::move(win_p), pool_));
+
+    chambers_.emplace_back(std::move(*chamber));
+}
+
+int
+ScenarioEngine::FindChamber(Race_RaceType type) const
+{
+    for (size_t i = 0; i < chambers_.size(); i++) {
+        if (chambers_[i].type == type)
+            return (int)i;
+    }
+    return -1;
+}
+
+std::optional<int>
+ScenarioEngine::FindRaceId(Race_RaceType type, const std::string& name) const
+{
+    if (type == Race::ELECTORAL_COLLEGE) {
+        for (const auto& state : cc_->state_list()) {
+            if (state.name() == name || state.code() == name)
+                return {state.race_id()};
+        }
+        Err() << "Unknown ev race: " << name;
+        return {};
+    }
+
+    // A Senate seat can be named by its region and seat name, like
+    // "Georgia/Class II", for states with two races.
+    std::string region = name;
+    std::optional<std::string> seat_name;
+    if (auto slash = name.find('/'); slash != std::string::npos) {
+        region = name.substr(0, slash);
+        seat_name = {name.substr(slash + 1)};
+    }
+
+    // Accept a state code in place of a state name, like "PA", or "PA-7" for
+    // a House seat.
+    for (const auto& [state_name, code] : kStateCodes) {
+        if (region == code) {
+            region = state_name;
+            break;
+        }
+        if (region.size() > code.size() + 1 && region.compare(0, code.size(), code) == 0 &&
+            region[code.size()] == '-')
+        {
+            region = state_name + " " + region.substr(code.size() + 1);
+            break;
+        }
+    }
+
+    const auto& races = (type == Race::SENATE) ? cc_->senate_map().races()
+                                               : cc_->house_map().races();
+    std::vector<const Race*> found;
+    for (const auto& race : races) {
+        if (race.region() != region)
+            continue;
+        if (seat_name && race.seat_name() != seat_name.value())
+            continue;
+        found.emplace_back(&race);
+    }
+
+    if (found.empty()) {
+        Err() << "Unknown " << RaceTypeName(type) << " race: " << name;
+        return {};
+    }
+    if (found.size() > 1) {
+        std::string seats;
+        for (const auto* race : found)
+            seats += " " + race->region() + "/" + race->seat_name();
+        Err() << "Ambiguous " << RaceTypeName(type) << " race: " << name << " (one of:" << seats
+              << ")";
+        return {};
+    }
+    return {found[0]->race_id()};
+}
+
+bool
+ScenarioEngine::Run(const Scenario& scenario, ScenarioResult* out)
+{
+    std::vector<Changes> changes(chambers_.size());
+    for (size_t i = 0; i < chambers_.size(); i++) {
+        changes[i].races = chambers_[i].races;
+        changes[i].changed.assign(chambers_[i].races.size(), false);
+    }
+
+    for (const auto& change : scenario) {
+        if (!Apply(change, &changes))
+            return false;
+    }
+
+    *out = ScenarioResult();
+    for (size_t i = 0; i < chambers_.size(); i++) {
+        auto scores = Score(&chambers_[i], changes[i]);
+        switch (chambers_[i].type) {
+            case Race::ELECTORAL_COLLEGE:
+                out->ev = {std::move(scores)};
+                break;
+            case Race::SENATE:
+                out->senate = {std::move(scores)};
+                break;
+            case Race::HOUSE:
+                out->house = {std::move(scores)};
+                break;
+            default:
+                assert(false);
+        }
+    }
+    return true;
+}
+
+bool
+ScenarioEngine::Apply(const ScenarioOverride& change, std::vector<Changes>* changes) const
+{
+    using Action = ScenarioOverride::Action;
+
+    if (change.action == Action::SetStddev && change.value <= 0.0) {
+        Err() << "Invalid stddev for " << change.race << ": " << change.value;
+        return false;
+    }
+
+    if (change.race_type == Race::UNKNOWN) {
+        if (change.action != Action::Shift) {
+            Err() << "Only a shift can apply to every race.";
+            return false;
+        }
+        for (auto& chamber : *changes) {
+            for (auto& mean : chamber.races.means)
+                mean += change.value;
+            chamber.changed.assign(chamber.changed.size(), true);
+        }
+        return true;
+    }
+
+    int index = FindChamber(change.race_type);
+    if (index < 0) {
+        Err() << "The model has no " << RaceTypeName(change.race_type) << " races.";
+        return false;
+    }
+    auto race_id = FindRaceId(change.race_type, change.race);
+    if (!race_id)
+        return false;
+
+    const Chamber& chamber = chambers_[index];
+    Changes* out = &(*changes)[index];
+    if (auto iter = chamber.indexes.find(race_id.value()); iter != chamber.indexes.end()) {
+        size_t i = iter->second;
+        switch (change.action) {
+            case Action::Shift:
+                out->races.means[i] += change.value;
+                break;
+            case Action::Force:
+                out->races.means[i] = (change.value > 0.0) ? kForcedMargin : -kForcedMargin;
+                break;
+            case Action::SetStddev:
+                out->races.stddevs[i] = change.value;
+                break;
+        }
+        out->changed[i] = true;
+        return true;
+    }
+
+    if (change.action == Action::Force && chamber.safe_races.count(race_id.value())) {
+        out->forced_safe[race_id.value()] = change.value > 0.0;
+        return true;
+    }
+
+    if (change.action == Action::Force) {
+        Err() << RaceTypeName(change.race_type) << " race " << change.race
+              << " has no model on this day.";
+        return false;
+    }
+    Err() << RaceTypeName(change.race_type) << " race " << change.race
+          << " is safe in this model, so it cannot be shifted or given a stddev.";
+    return false;
+}
+
+ScenarioScores
+ScenarioEngine::Score(Chamber* chamber, const Changes& changes)
+{
+    const RaceArray& races = changes.races;
+
+    // Changed races get new win probabilities, as in Analysis::DemWinProb:
+    //    P(win) = 1 - NormalCdf(0, mean, stddev) = NormalCdf(mean / stddev)
+    std::vector<size_t> changed;
+    std::vector<double> z;
+    for (size_t i = 0; i < races.size(); i++) {
+        if (changes.changed[i]) {
+            changed.emplace_back(i);
+            z.emplace_back(races.means[i] / races.stddevs[i]);
+        }
+    }
+    std::vector<double> changed_p(z.size());
+    NormalCdf(z.data(), z.size(), 0.0, 1.0, changed_p.data());
+
+    std::vector<double> win_p = chamber->base_p;
+    for (size_t i = 0; i < changed.size(); i++)
+        win_p[changed[i]] = changed_p[i];
+
+    // Only races that differ from the last scenario need to be updated.
+    std::vector<std::pair<size_t, double>> updates;
+    const auto& current = chamber->cv->races();
+    for (size_t i = 0; i < races.size(); i++) {
+        if (win_p[i] != current[i].second)
+            updates.emplace_back(i, win_p[i]);
+    }
+    chamber->cv->UpdateRaces(updates, pool_);
+
+    int safe_dem = chamber->safe_dem;
+    int safe_gop = chamber->safe_gop;
+    for (const auto& [race_id, dem] : changes.forced_safe) {
+        if (dem == chamber->safe_races.at(race_id))
+            continue;
+        safe_dem += dem ? 1 : -1;
+        safe_gop += dem ? -1 : 1;
+    }
+
+    Convolver& cv = *chamber->cv;
+    ScenarioScores scores;
+    scores.histogram = cv.histogram;
+    scores.offset = safe_dem;
+    scores.mean = safe_dem;
+    for (size_t i = 0; i < races.size(); i++)
+        scores.mean += races.weights[i] * win_p[i];
+
+    int max_score = (int)cv.histogram.size() - 1;
+    int score_to_win = chamber->needed - safe_dem;
+    if (score_to_win <= 0)
+        scores.control_p = 1.0;
+    else if (score_to_win > max_score)
+        scores.control_p = 0.0;
+    else
+        scores.control_p = cv.DemWinProbForValue(score_to_win);
+
+    // Like the analysis, only compute a metamargin if control can change.
+    if (safe_dem >= chamber->needed || safe_gop >= chamber->needed)
+        return scores;
+
+    if (changed.empty() && safe_dem == chamber->safe_dem && chamber->base_metamargin) {
+        scores.metamargin = chamber->base_metamargin;
+        return scores;
+    }
+
+    ScoreSurface surface(races);
+    MetamarginFinder mmf(surface.AsBiasFn(), score_to_win - 1, cv.FindMean(), max_score,
+                         chamber->base_metamargin);
+    scores.metamargin = {mmf.metamargin};
+    return scores;
+}
+
+} // namespace stone
@@ -0,0 +1,157 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <proto/model.pb.h>
+#include <proto/state.pb.h>
+#include "mathlib.h"
+
+namespace stone {
+
+class Campaign;
+class ThreadPool;
+
+// One change to a day's races. Margins are D minus R, in points, so a
+// positive shift favors D.
+struct ScenarioOverride
+{
+    enum class Action
+    {
+        // Add |value| to the margin.
+        Shift,
+        // D wins if |value| is positive, R wins otherwise.
+        Force,
+        // Replace the race's stddev with |value|.
+        SetStddev,
+    };
+
+    Action action = Action::Shift;
+
+    // The race is a state, Senate seat, or House seat, named by its region
+    // (eg "Pennsylvania") or state code (eg "PA", or "PA-7" for a House
+    // seat). When a state has two Senate races, the seat name follows the
+    // region, as in the campaign's Senate map (eg "Georgia/Class II"). A
+    // Shift with no race type applies to every race.
+    Race_RaceType race_type = Race::UNKNOWN;
+    std::string race;
+    double value = 0.0;
+};
+
+typedef std::vector<ScenarioOverride> Scenario;
+
+// Parse a scenario: overrides separated by semicolons, each one of:
+//
+//    shift <points>
+//    shift <race> <points>
+//    force <race> dem|gop
+//    stddev <race> <points>
+//
+// where a race is "ev:", "senate:", or "house:" followed by its name, eg
+// "force ev:PA dem; shift senate:Georgia/Class II 2; shift -1.5". Returns false
+// if the text is malformed.
+bool ParseScenario(std::string_view text, Scenario* out);
+
+// The outcome of one chamber (the electoral college, Senate, or House) in a
+// scenario. Scores are D's, including seats not up or not competitive.
+struct ScenarioScores
+{
+    // Entry i is the probability of a score of |offset + i|.
+    std::vector<double> histogram;
+    int offset = 0;
+    double mean = 0.0;
+    // The probability of reaching the score needed for control.
+    double control_p = 0.0;
+    // Unset if control cannot change.
+    std::optional<double> metamargin;
+};
+
+struct ScenarioResult
+{
+    // Chambers that the day's model has no races for are unset.
+    std::optional<ScenarioScores> ev;
+    std::optional<ScenarioScores> senate;
+    std::optional<ScenarioScores> house;
+};
+
+// Recompute a day's seat distributions and metamargins after changing some of
+// its races, without analyzing polls again. Each chamber keeps an updatable
+// Convolver, so a scenario that changes a few races only recomputes the
+// products those races are in. Scenarios are independent: each one starts
+// from the day's model.
+class ScenarioEngine
+{
+  public:
+    // |data| is a fully analyzed day. It is only read while the engine is
+    // constructed.
+    ScenarioEngine(Campaign* cc, const ModelData& data, ThreadPool* pool = nullptr);
+
+    // Returns false, after reporting an error, if an override names a race
+    // that is not in the day's model.
+    bool Run(const Scenario& scenario, ScenarioResult* out);
+
+  private:
+    struct Chamber
+    {
+        Race_RaceType type;
+        // The races that can go either way, as used by the metamargin, and
+        // their win probabilities in the day's model.
+        RaceArray races;
+        std::vector<double> base_p;
+        // Race id to position in |races|.
+        std::unordered_map<int, size_t> indexes;
+        // Races that are not in |races| because they are rated safe, by race
+        // id. The value is true if the seat is safe for D.
+        std::unordered_map<int, bool> safe_races;
+        int safe_dem = 0;
+        int safe_gop = 0;
+        // The score D needs for control, including safe seats.
+        int needed = 0;
+        std::optional<double> base_metamargin;
+        // Holds the win probabilities of the last scenario that was run.
+        std::optional<Convolver> cv;
+    };
+
+    // A scenario's copy of a chamber's races.
+    struct Changes
+    {
+        RaceArray races;
+        std::vector<bool> changed;
+        // Safe races that were forced, by race id. The value is true if D
+        // wins.
+        std::unordered_map<int, bool> forced_safe;
+    };
+
+    void InitChamber(Chamber* chamber);
+    int FindChamber(Race_RaceType type) const;
+    // Returns no id, after reporting an error, if the name matches no race or
+    // more than one.
+    std::optional<int> FindRaceId(Race_RaceType type, const std::string& name) const;
+    bool Apply(const ScenarioOverride& change, std::vector<Changes>* changes) const;
+    ScenarioScores Score(Chamber* chamber, const Changes& changes);
+
+  private:
+    Campaign* cc_;
+    ThreadPool* pool_;
+    std::vector<Chamber> chambers_;
+};
+
+} // namespace stone
@@ -0,0 +1,104 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "score-surface.h"
+
+#include <math.h>
+
+namespace stone {
+
+// Biases closer than this to a grid point are treated as being on the grid.
+// This absorbs drift from callers that step by repeatedly adding 0.02.
+static constexpr double kGridEpsilon = 1e-9;
+
+ScoreSurface::ScoreSurface(RaceArray races)
+  : races_(std::move(races))
+{
+}
+
+void
+ScoreSurface::Fill(double low, double high)
+{
+    int first = (int)floor(low / kStep);
+    int last = (int)ceil(high / kStep);
+    for (int index = first; index <= last; index += kBlockSize)
+        At(index);
+    At(last);
+}
+
+double
+ScoreSurface::ExpectedScore(double bias)
+{
+    double pos = bias / kStep;
+    double nearest = round(pos);
+    if (fabs(pos - nearest) * kStep <= kGridEpsilon)
+        return At((int)nearest);
+
+    int index = (int)floor(pos);
+    double t = pos - double(index);
+    double a = At(index);
+    double b = At(index + 1);
+    return a + (b - a) * t;
+}
+
+std::function<int(double)>
+ScoreSurface::AsBiasFn()
+{
+    return [this](double bias) -> int {
+        return Score(bias);
+    };
+}
+
+double
+ScoreSurface::At(int index)
+{
+    // Floor division, so negative indices map to the right block.
+    int block_index = index >= 0 ? index / kBlockSize : -((-index - 1) / kBlockSize) - 1;
+    const Block& block = GetBlock(block_index);
+    return block[index - block_index * kBlockSize];
+}
+
+const ScoreSurface::Block&
+ScoreSurface::GetBlock(int block_index)
+{
+    if (auto iter = blocks_.find(block_index); iter != blocks_.end())
+        return iter->second;
+
+    // Evaluate the whole block at once. The race loop is on the outside so
+    // each race's win probabilities come from one batched NormalCdf call over
+    // contiguous grid points.
+    Block biases, scores, margins, win_p;
+    for (int i = 0; i < kBlockSize; i++) {
+        biases[i] = double(block_index * kBlockSize + i) * kStep;
+        scores[i] = 0.0;
+    }
+
+    const auto& weights = races_.weights;
+    const auto& means = races_.means;
+    const auto& stddevs = races_.stddevs;
+    for (size_t r = 0; r < races_.size(); r++) {
+        // Note: this must agree with Analysis::DemWinProb, which is
+        // 1 - NormalCdf(0, margin, stddev) = NormalCdf(margin, 0, stddev).
+        for (int i = 0; i < kBlockSize; i++)
+            margins[i] = means[r] + biases[i];
+        NormalCdf(margins.data(), kBlockSize, 0.0, stddevs[r], win_p.data());
+        for (int i = 0; i < kBlockSize; i++)
+            scores[i] += weights[r] * win_p[i];
+    }
+
+    return blocks_.emplace(block_index, scores).first->second;
+}
+
+} // namespace stone
@@ -0,0 +1,64 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <array>
+#include <functional>
+#include <unordered_map>
+
+#include "mathlib.h"
+
+namespace stone {
+
+// The metamargin search, the Bayesian prediction, and the win probability
+// walks all ask for the score of the same set of races at biases on a 0.02
+// grid. This caches the expected score for each grid point, evaluating a
+// block of neighboring points at a time. Biases that fall between grid points
+// are linearly interpolated.
+class ScoreSurface
+{
+  public:
+    static constexpr double kStep = 0.02;
+
+    explicit ScoreSurface(RaceArray races);
+
+    // Evaluate every grid point in [low, high] up front.
+    void Fill(double low, double high);
+
+    double ExpectedScore(double bias);
+    int Score(double bias) {
+        return RoundToNearest(ExpectedScore(bias));
+    }
+
+    // Adapt to the bias function interface used by MetamarginFinder and
+    // MarginPredictor. The surface must outlive the returned function.
+    std::function<int(double)> AsBiasFn();
+
+    const RaceArray& races() const { return races_; }
+
+  private:
+    static constexpr int kBlockSize = 32;
+    typedef std::array<double, kBlockSize> Block;
+
+    double At(int index);
+    const Block& GetBlock(int block_index);
+
+  private:
+    RaceArray races_;
+    std::unordered_map<int, Block> blocks_;
+};
+
+} // namespace stone
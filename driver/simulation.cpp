@@ -0,0 +1,405 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "simulation.h"
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+#include "threadpool.h"
+
+namespace stone {
+
+// Simulations are handed to threads in batches of this many.
+static constexpr uint64_t kSimsPerBatch = 4096;
+
+// Stand-in z-score for races with no error, which are always won or lost.
+static constexpr double kDecidedZ = 1e6;
+
+// Random streams. Stream 0 feeds the shared errors, and stream 1 + N feeds
+// the races of the Nth race set.
+static constexpr uint32_t kErrorStream = 0;
+static constexpr uint32_t kFirstRaceStream = 1;
+
+// Philox4x32-10, from "Parallel Random Numbers: As Easy as 1, 2, 3" (Salmon et
+// al., 2011). Any (simulation, stream, block) counter maps to four random
+// words, without any state carried between calls.
+static constexpr uint32_t kPhiloxM0 = 0xD2511F53;
+static constexpr uint32_t kPhiloxM1 = 0xCD9E8D57;
+static constexpr uint32_t kPhiloxW0 = 0x9E3779B9;
+static constexpr uint32_t kPhiloxW1 = 0xBB67AE85;
+static constexpr int kPhiloxRounds = 10;
+
+static inline void
+Philox(uint64_t key, uint64_t sim, uint32_t stream, uint32_t block, uint32_t out[4])
+{
+    uint32_t c0 = uint32_t(sim), c1 = uint32_t(sim >> 32), c2 = stream, c3 = block;
+    uint32_t k0 = uint32_t(key), k1 = uint32_t(key >> 32);
+    for (int round = 0; round < kPhiloxRounds; round++) {
+        uint64_t p0 = uint64_t(kPhiloxM0) * c0;
+        uint64_t p1 = uint64_t(kPhiloxM1) * c2;
+        c0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+        c1 = uint32_t(p1);
+        c2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+        c3 = uint32_t(p0);
+        k0 += kPhiloxW0;
+        k1 += kPhiloxW1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Map a random word to (0, 1), never hitting either end.
+static inline double
+ToUniform(uint32_t bits)
+{
+    return (double(bits) + 0.5) * (1.0 / 4294967296.0);
+}
+
+// Fill |out| with uniforms from one stream. Block N of the stream gives
+// entries 4N through 4N + 3.
+static void
+FillUniforms_Scalar(uint64_t key, uint64_t sim, uint32_t stream, size_t count, double* out)
+{
+    uint32_t bits[4];
+    for (size_t i = 0; i < count; i += 4) {
+        Philox(key, sim, stream, uint32_t(i / 4), bits);
+        for (size_t j = 0; j < 4 && i + j < count; j++)
+            out[i + j] = ToUniform(bits[j]);
+    }
+}
+
+// Return the sum of weights[i] for each race where u[i] < p[i].
+static double
+CountWins_Scalar(const double* u, const double* p, const double* weights, size_t count)
+{
+    double score = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        if (u[i] < p[i])
+            score += weights[i];
+    }
+    return score;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Turn 32-bit values in 64-bit lanes into uniforms, like ToUniform.
+__attribute__((target("avx2,fma"))) static inline __m256d
+ToUniform_Avx2(__m256i bits)
+{
+    // Or-ing the bits into the mantissa of 2^52 gives 2^52 + bits, exactly.
+    const __m256i kExponent = _mm256_set1_epi64x(0x4330000000000000);
+    __m256d x = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(bits, kExponent)),
+                              _mm256_set1_pd(4503599627370496.0));
+    return _mm256_mul_pd(_mm256_add_pd(x, _mm256_set1_pd(0.5)),
+                         _mm256_set1_pd(1.0 / 4294967296.0));
+}
+
+// Run Philox on four consecutive blocks at once. Each 64-bit lane holds one
+// block's 32-bit word, since _mm256_mul_epu32 multiplies the low halves of
+// 64-bit lanes.
+__attribute__((target("avx2,fma"))) static void
+FillUniforms_Avx2(uint64_t key, uint64_t sim, uint32_t stream, size_t count, double* out)
+{
+    const __m256i kLow = _mm256_set1_epi64x(0xffffffff);
+    const __m256i m0 = _mm256_set1_epi64x(kPhiloxM0);
+    const __m256i m1 = _mm256_set1_epi64x(kPhiloxM1);
+
+    __m256i keys0[kPhiloxRounds], keys1[kPhiloxRounds];
+    uint32_t k0 = uint32_t(key), k1 = uint32_t(key >> 32);
+    for (int round = 0; round < kPhiloxRounds; round++) {
+        keys0[round] = _mm256_set1_epi64x(k0);
+        keys1[round] = _mm256_set1_epi64x(k1);
+        k0 += kPhiloxW0;
+        k1 += kPhiloxW1;
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint32_t block = uint32_t(i / 4);
+        __m256i c0 = _mm256_set1_epi64x(uint32_t(sim));
+        __m256i c1 = _mm256_set1_epi64x(uint32_t(sim >> 32));
+        __m256i c2 = _mm256_set1_epi64x(stream);
+        __m256i c3 = _mm256_setr_epi64x(block, block + 1, block + 2, block + 3);
+        for (int round = 0; round < kPhiloxRounds; round++) {
+            __m256i p0 = _mm256_mul_epu32(c0, m0);
+            __m256i p1 = _mm256_mul_epu32(c2, m1);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1), keys0[round]);
+            c1 = _mm256_and_si256(p1, kLow);
+            c2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3), keys1[round]);
+            c3 = _mm256_and_si256(p0, kLow);
+        }
+
+        // Lane N of word W belongs at entry 4N + W, so transpose.
+        __m256d w0 = ToUniform_Avx2(c0), w1 = ToUniform_Avx2(c1);
+        __m256d w2 = ToUniform_Avx2(c2), w3 = ToUniform_Avx2(c3);
+        __m256d t0 = _mm256_unpacklo_pd(w0, w1);
+        __m256d t1 = _mm256_unpackhi_pd(w0, w1);
+        __m256d t2 = _mm256_unpacklo_pd(w2, w3);
+        __m256d t3 = _mm256_unpackhi_pd(w2, w3);
+        _mm256_storeu_pd(out + i, _mm256_permute2f128_pd(t0, t2, 0x20));
+        _mm256_storeu_pd(out + i + 4, _mm256_permute2f128_pd(t1, t3, 0x20));
+        _mm256_storeu_pd(out + i + 8, _mm256_permute2f128_pd(t0, t2, 0x31));
+        _mm256_storeu_pd(out + i + 12, _mm256_permute2f128_pd(t1, t3, 0x31));
+    }
+
+    uint32_t bits[4];
+    for (; i < count; i += 4) {
+        Philox(key, sim, stream, uint32_t(i / 4), bits);
+        for (size_t j = 0; j < 4 && i + j < count; j++)
+            out[i + j] = ToUniform(bits[j]);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static double
+CountWins_Avx2(const double* u, const double* p, const double* weights, size_t count)
+{
+    __m256d sum = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d won = _mm256_cmp_pd(_mm256_loadu_pd(u + i), _mm256_loadu_pd(p + i), _CMP_LT_OQ);
+        sum = _mm256_add_pd(sum, _mm256_and_pd(won, _mm256_loadu_pd(weights + i)));
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, sum);
+    double score = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return score + CountWins_Scalar(u + i, p + i, weights + i, count - i);
+}
+
+static bool
+HasAvx2()
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has_avx2;
+}
+#endif
+
+static void
+FillUniforms(uint64_t key, uint64_t sim, uint32_t stream, size_t count, double* out)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (HasAvx2())
+        return FillUniforms_Avx2(key, sim, stream, count, out);
+#endif
+    FillUniforms_Scalar(key, sim, stream, count, out);
+}
+
+static int
+CountWins(const double* u, const double* p, const double* weights, size_t count)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (HasAvx2())
+        return RoundToNearest(CountWins_Avx2(u, p, weights, count));
+#endif
+    return RoundToNearest(CountWins_Scalar(u, p, weights, count));
+}
+
+// Fill |out| with standard normals from one stream, via Box-Muller.
+static void
+FillNormals(uint64_t key, uint64_t sim, uint32_t stream, size_t count, double* out)
+{
+    static const double kTwoPi = 8.0 * atan(1.0);
+
+    // Uniforms come in pairs, so round up, and convert in place.
+    size_t pairs = (count + 1) / 2;
+    FillUniforms(key, sim, stream, pairs * 2, out);
+    for (size_t i = pairs; i-- > 0;) {
+        double r = sqrt(-2.0 * log(out[2 * i]));
+        double theta = kTwoPi * out[2 * i + 1];
+        out[2 * i] = r * cos(theta);
+        out[2 * i + 1] = r * sin(theta);
+    }
+}
+
+Simulator::Simulator(const SimulationParams& params, int num_regions)
+  : params_(params),
+    num_regions_(num_regions)
+{
+    assert(params_.national_share >= 0.0 && params_.regional_share >= 0.0);
+    assert(params_.national_share + params_.regional_share < 1.0);
+    assert(params_.df >= 0);
+}
+
+void
+Simulator::AddRaces(const RaceArray& races, int score_offset, int score_to_win,
+                    Simulation* out)
+{
+    double national = params_.national_share;
+    double regional = params_.regional_share;
+
+    RaceSet set;
+    set.score_offset = score_offset;
+    set.score_to_win = score_to_win;
+    set.out = out;
+    for (size_t i = 0; i < races.size(); i++) {
+        int region = i < races.regions.size() ? races.regions[i] : -1;
+        bool has_region = region >= 0 && region < num_regions_;
+
+        double z;
+        if (races.stddevs[i] > 0.0)
+            z = races.means[i] / races.stddevs[i];
+        else if (races.means[i] != 0.0)
+            z = copysign(kDecidedZ, races.means[i]);
+        else
+            z = 0.0;
+
+        // Races without a region use the last region slot, which is always
+        // zero.
+        double own = 1.0 - national - (has_region ? regional : 0.0);
+        set.z.emplace_back(z);
+        set.regional.emplace_back(has_region ? sqrt(regional) : 0.0);
+        set.inv_own.emplace_back(1.0 / sqrt(own));
+        set.regions.emplace_back(has_region ? region : num_regions_);
+        set.weights.emplace_back(RoundToNearest(races.weights[i]));
+        set.max_score += RoundToNearest(races.weights[i]);
+    }
+    sets_.emplace_back(std::move(set));
+}
+
+void
+Simulator::SimulateOne(uint64_t sim, Batch* batch)
+{
+    // Draw the shared errors: one national error, one per region, and if
+    // errors have a t distribution, the normals for its chi-squared scale.
+    size_t num_normals = 1 + num_regions_ + params_.df;
+    FillNormals(params_.seed, sim, kErrorStream, num_normals, batch->normals.data());
+
+    double national = sqrt(params_.national_share) * batch->normals[0];
+    std::copy(batch->normals.begin() + 1, batch->normals.begin() + 1 + num_regions_,
+              batch->region_errors.begin());
+
+    // A multivariate t is a multivariate normal divided by sqrt(chi2 / df),
+    // where chi2 is shared by every race. Dividing each race's error by that
+    // is the same as multiplying its z-score by it.
+    double scale = 1.0;
+    if (params_.df) {
+        double chi2 = 0.0;
+        for (int i = 0; i < params_.df; i++) {
+            double x = batch->normals[1 + num_regions_ + i];
+            chi2 += x * x;
+        }
+        scale = sqrt(chi2 / params_.df);
+    }
+
+    for (size_t s = 0; s < sets_.size(); s++) {
+        const RaceSet& set = sets_[s];
+        size_t n = set.z.size();
+        double* p = batch->probabilities.data();
+
+        // Get each race's win probability given the shared errors. The race's
+        // own error is what's left, so the probability is one NormalCdf, and
+        // the whole row of races goes through the batched form.
+        const double* region_errors = batch->region_errors.data();
+        for (size_t i = 0; i < n; i++) {
+            double shift = national + set.regional[i] * region_errors[set.regions[i]];
+            p[i] = (set.z[i] * scale + shift) * set.inv_own[i];
+        }
+        NormalCdf(p, n, 0.0, 1.0, p);
+
+        // Then each race is won if its own draw lands under that.
+        double* u = batch->uniforms.data();
+        FillUniforms(params_.seed, sim, kFirstRaceStream + uint32_t(s), n, u);
+        int score = CountWins(u, p, set.weights.data(), n);
+        batch->counts[s][score]++;
+    }
+}
+
+void
+Simulator::Run(ThreadPool* pool)
+{
+    if (params_.num_sims <= 0 || sets_.empty())
+        return;
+
+    size_t max_races = 0;
+    std::vector<std::vector<uint64_t>> totals;
+    for (const auto& set : sets_) {
+        max_races = std::max(max_races, set.z.size());
+        totals.emplace_back(set.max_score + 1, 0);
+    }
+
+    // Counts are integers, so adding up batches in any order gives the same
+    // totals.
+    std::mutex mutex;
+    uint64_t num_sims = params_.num_sims;
+    size_t num_batches = (num_sims + kSimsPerBatch - 1) / kSimsPerBatch;
+    auto run_batch = [&](size_t index) -> void {
+        Batch batch;
+        batch.normals.resize(2 + num_regions_ + params_.df);
+        batch.region_errors.assign(num_regions_ + 1, 0.0);
+        batch.probabilities.resize(max_races);
+        batch.uniforms.resize(max_races);
+        for (const auto& set : sets_)
+            batch.counts.emplace_back(set.max_score + 1, 0);
+
+        uint64_t begin = index * kSimsPerBatch;
+        uint64_t end = std::min(begin + kSimsPerBatch, num_sims);
+        for (uint64_t sim = begin; sim < end; sim++)
+            SimulateOne(sim, &batch);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t s = 0; s < sets_.size(); s++) {
+            for (size_t k = 0; k < totals[s].size(); k++)
+                totals[s][k] += batch.counts[s][k];
+        }
+    };
+
+    if (pool) {
+        pool->ForEach(num_batches, run_batch);
+    } else {
+        for (size_t i = 0; i < num_batches; i++)
+            run_batch(i);
+    }
+
+    for (size_t s = 0; s < sets_.size(); s++)
+        Finish(sets_[s], totals[s]);
+}
+
+void
+Simulator::Finish(const RaceSet& set, const std::vector<uint64_t>& counts)
+{
+    Simulation* out = set.out;
+    out->Clear();
+    out->set_num_sims(params_.num_sims);
+
+    size_t lo = 0, hi = counts.size();
+    while (lo < hi && !counts[lo])
+        lo++;
+    while (hi > lo && !counts[hi - 1])
+        hi--;
+
+    double num_sims = params_.num_sims;
+    double mean = 0.0;
+    uint64_t wins = 0;
+    out->set_offset(set.score_offset + (int)lo);
+    for (size_t k = lo; k < hi; k++) {
+        out->add_histogram(counts[k] / num_sims);
+        mean += double(k) * counts[k];
+        if ((int)k >= set.score_to_win)
+            wins += counts[k];
+    }
+    out->set_mean(set.score_offset + mean / num_sims);
+    out->set_dem_control_p(wins / num_sims);
+}
+
+} // namespace stone
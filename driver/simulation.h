@@ -0,0 +1,111 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <proto/model.pb.h>
+#include "mathlib.h"
+
+namespace stone {
+
+class ThreadPool;
+
+struct SimulationParams
+{
+    // The number of simulations to run. Zero disables simulations.
+    int num_sims = 0;
+
+    // The fractions of each race's variance that come from a national error,
+    // and from an error shared by every race in its region. The rest comes
+    // from the race's own error. Races with no region get the regional share
+    // as their own error. The shares must add up to less than 1.
+    double national_share = 0.0;
+    double regional_share = 0.0;
+
+    // If non-zero, errors have a multivariate t distribution with this many
+    // degrees of freedom, instead of a multivariate normal distribution.
+    int df = 0;
+
+    // Simulations with the same seed and inputs have the same results.
+    uint64_t seed = 0;
+};
+
+// Simulate elections by drawing correlated errors for every race at once: one
+// national error, one error per region, and one error per race. Each race's
+// total error has the race's own stddev. With normal errors, a race on its own
+// is won as often as Analysis::DemWinProb says; with t errors (df > 0) its
+// marginal is a t distribution instead, so its win probability differs from
+// DemWinProb's, most for lopsided races. Either way, races in the same
+// simulation move together, unlike in a Convolver.
+//
+// Each simulation draws from its own counter-based (Philox) random streams,
+// so the results are the same no matter how simulations are split across
+// threads.
+class Simulator
+{
+  public:
+    Simulator(const SimulationParams& params, int num_regions);
+
+    // Score |races| in every simulation, and write the results to |out|. The
+    // offset is added to each score, and D has control at |score_to_win| or
+    // more before the offset, like Analysis::GetScoreToWin.
+    void AddRaces(const RaceArray& races, int score_offset, int score_to_win, Simulation* out);
+
+    void Run(ThreadPool* pool);
+
+  private:
+    // Races are kept in the form that the inner loop wants. Given the shared
+    // errors, a race is won with probability:
+    //
+    //    NormalCdf((z * scale + national + regional * region_error) * inv_own)
+    //
+    // where scale is 1, or the t distribution's scale for this simulation.
+    struct RaceSet
+    {
+        std::vector<double> z;
+        std::vector<double> regional;
+        std::vector<double> inv_own;
+        std::vector<int> regions;
+        std::vector<double> weights;
+        int max_score = 0;
+        int score_offset = 0;
+        int score_to_win = 0;
+        Simulation* out = nullptr;
+    };
+
+    // Scratch space and results for one thread's share of simulations.
+    struct Batch
+    {
+        std::vector<double> region_errors;
+        std::vector<double> probabilities;
+        std::vector<double> uniforms;
+        std::vector<double> normals;
+        std::vector<std::vector<uint64_t>> counts;
+    };
+
+    void SimulateOne(uint64_t sim, Batch* batch);
+    void Finish(const RaceSet& set, const std::vector<uint64_t>& counts);
+
+  private:
+    SimulationParams params_;
+    int num_regions_;
+    std::vector<RaceSet> sets_;
+};
+
+} // namespace stone
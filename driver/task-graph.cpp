@@ -0,0 +1,110 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "task-graph.h"
+
+#include <assert.h>
+
+namespace stone {
+
+TaskGraph::TaskGraph(ThreadPool* pool)
+  : pool_(pool)
+{
+}
+
+TaskGraph::TaskId
+TaskGraph::Add(std::function<void(ThreadPool*)> fn, std::initializer_list<TaskId> deps)
+{
+    return Add(std::move(fn), std::vector<TaskId>(deps));
+}
+
+TaskGraph::TaskId
+TaskGraph::Add(std::function<void(ThreadPool*)> fn, const std::vector<TaskId>& deps)
+{
+    TaskId id = nodes_.size();
+    nodes_.emplace_back(std::make_unique<Node>());
+    if (fn)
+        num_tasks_++;
+    nodes_.back()->fn = std::move(fn);
+    for (const auto& dep : deps)
+        Depend(id, dep);
+    return id;
+}
+
+void
+TaskGraph::Depend(TaskId task, TaskId dep)
+{
+    if (dep == kNoTask)
+        return;
+    assert(dep < nodes_.size() && task < nodes_.size());
+    nodes_[dep]->dependents.emplace_back(task);
+    nodes_[task]->num_deps++;
+}
+
+void
+TaskGraph::Run()
+{
+    for (const auto& node : nodes_)
+        node->waiting = node->num_deps;
+
+    // Collect the roots first, since finishing a join can make other tasks
+    // ready while we're still looking.
+    std::vector<TaskId> roots;
+    for (TaskId id = 0; id < nodes_.size(); id++) {
+        if (!nodes_[id]->num_deps)
+            roots.emplace_back(id);
+    }
+    for (const auto& id : roots)
+        Submit(id);
+
+    pool_->RunCompletionTasks();
+}
+
+void
+TaskGraph::Submit(TaskId task)
+{
+    if (!nodes_[task]->fn) {
+        Finished(task);
+        return;
+    }
+
+    pool_->Do([this, task](ThreadPool* pool) -> void {
+        nodes_[task]->fn(pool);
+        Finished(task);
+    }, on_task_done_);
+}
+
+void
+TaskGraph::Finished(TaskId task)
+{
+    // Joins finish inline. A worklist keeps long chains of them from
+    // recursing.
+    std::vector<TaskId> finished = {task};
+    while (!finished.empty()) {
+        TaskId id = finished.back();
+        finished.pop_back();
+
+        for (const auto& dependent : nodes_[id]->dependents) {
+            if (--nodes_[dependent]->waiting != 0)
+                continue;
+            if (nodes_[dependent]->fn)
+                Submit(dependent);
+            else
+                finished.emplace_back(dependent);
+        }
+    }
+}
+
+} // namespace stone
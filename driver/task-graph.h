@@ -0,0 +1,82 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+#include "threadpool.h"
+
+namespace stone {
+
+// A set of tasks that declare which other tasks they depend on. Each task is
+// submitted to the pool as soon as all of its dependencies have finished, so
+// independent chains of work overlap instead of running in phases.
+//
+// Tasks and dependencies are added up front, and then Run() runs the graph.
+class TaskGraph
+{
+  public:
+    typedef size_t TaskId;
+    static constexpr TaskId kNoTask = ~TaskId(0);
+
+    explicit TaskGraph(ThreadPool* pool);
+
+    // Add a task that runs after every task in |deps|. kNoTask entries in
+    // |deps| are ignored. A task without a function only joins its
+    // dependencies, and finishes as soon as they do.
+    TaskId Add(std::function<void(ThreadPool*)> fn, std::initializer_list<TaskId> deps = {});
+    TaskId Add(std::function<void(ThreadPool*)> fn, const std::vector<TaskId>& deps);
+
+    // Make |task| wait for |dep| as well.
+    void Depend(TaskId task, TaskId dep);
+
+    // The number of tasks that have a function.
+    size_t num_tasks() const { return num_tasks_; }
+
+    // If set, this is called on the thread that calls Run(), after each task
+    // that has a function.
+    void set_on_task_done(std::function<void()> fn) { on_task_done_ = std::move(fn); }
+
+    // Run every task, and return once all of them have finished. The graph
+    // must not have cycles.
+    void Run();
+
+  private:
+    struct Node
+    {
+        std::function<void(ThreadPool*)> fn;
+        std::vector<TaskId> dependents;
+        size_t num_deps = 0;
+        std::atomic<size_t> waiting{0};
+    };
+
+    void Submit(TaskId task);
+    void Finished(TaskId task);
+
+  private:
+    ThreadPool* pool_;
+    std::vector<std::unique_ptr<Node>> nodes_;
+    size_t num_tasks_ = 0;
+    std::function<void()> on_task_done_;
+};
+
+} // namespace stone
@@ -0,0 +1,356 @@
+// vim: set sts=4 ts=8 sw=4 tw=99 et:
+//
+// Copyright (C) 2016-2020 David Anderson
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "threadpool.h"
+
+namespace stone {
+
+// How many times an idle worker looks for work before parking.
+static constexpr int kSpinCount = 64;
+
+// The pool and worker that the current thread belongs to, if any.
+static thread_local ThreadPool* sCurrentPool = nullptr;
+static thread_local size_t sCurrentWorker = 0;
+
+void
+MpscQueue::Push(MpscNode* node)
+{
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MpscNode* prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+MpscNode*
+MpscQueue::Pop()
+{
+    MpscNode* tail = tail_;
+    MpscNode* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+        if (!next)
+            return nullptr;
+        tail_ = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+
+    // |tail| is the last node we can see. If it is not the head, a push is
+    // halfway done, and we have to wait for it to link in.
+    if (tail != head_.load(std::memory_order_acquire))
+        return nullptr;
+
+    // Put the stub back behind |tail|, so that |tail| can be removed.
+    Push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        tail_ = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+void
+EventCount::Wait(uint64_t key)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (epoch_.load() == key)
+            cv_.wait(lock);
+    }
+    waiters_.fetch_sub(1);
+}
+
+void
+EventCount::Notify(bool all)
+{
+    epoch_.fetch_add(1);
+    if (!waiters_.load())
+        return;
+
+    // Taking the lock orders this with a waiter that has checked the epoch,
+    // but has not started waiting yet.
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    if (all)
+        cv_.notify_all();
+    else
+        cv_.notify_one();
+}
+
+WorkDeque::WorkDeque()
+{
+    arrays_.emplace_back(std::make_unique<Array>(kInitialSize));
+    array_.store(arrays_.back().get(), std::memory_order_relaxed);
+}
+
+void
+WorkDeque::Push(PoolTask* task)
+{
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+    if (b - t > int64_t(a->size()) - 1) {
+        auto grown = std::make_unique<Array>(a->size() * 2);
+        for (int64_t i = t; i < b; i++)
+            grown->at(i).store(a->at(i).load(std::memory_order_relaxed), std::memory_order_relaxed);
+        a = grown.get();
+        arrays_.emplace_back(std::move(grown));
+        array_.store(a, std::memory_order_release);
+    }
+    a->at(b).store(task, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+}
+
+PoolTask*
+WorkDeque::Pop()
+{
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // Empty.
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    PoolTask* task = a->at(b).load(std::memory_order_relaxed);
+    if (t == b) {
+        // This is the last task, so race with thieves for it.
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed))
+        {
+            task = nullptr;
+        }
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+PoolTask*
+WorkDeque::Steal()
+{
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b)
+        return nullptr;
+
+    Array* a = array_.load(std::memory_order_acquire);
+    PoolTask* task = a->at(t).load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+    return task;
+}
+
+ThreadPool::ThreadPool(unsigned int n)
+{
+    workers_.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        workers_[i] = std::make_unique<Worker>();
+        workers_[i]->rng = i * 0x9e3779b97f4a7c15ull + 1;
+    }
+
+    // Workers steal from each other, so they all have to exist first.
+    for (size_t i = 0; i < n; i++) {
+        workers_[i]->thread = std::make_unique<std::thread>([this, i]() -> void {
+            Work(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    Stop();
+
+    // Drop anything that never got to run.
+    for (const auto& worker : workers_) {
+        while (PoolTask* task = worker->deque.Pop())
+            delete task;
+    }
+    while (PoolTask* task = PopInjected())
+        delete task;
+    while (MpscNode* node = completions_.Pop())
+        delete static_cast<Completion*>(node);
+}
+
+void
+ThreadPool::Do(std::function<void(ThreadPool*)> fn, std::function<void()> completion)
+{
+    auto task = new PoolTask;
+    task->fn = std::move(fn);
+    task->completion = std::move(completion);
+
+    pending_.fetch_add(1);
+    if (sCurrentPool == this)
+        workers_[sCurrentWorker]->deque.Push(task);
+    else
+        injected_.Push(task);
+    work_event_.Notify();
+}
+
+void
+ThreadPool::RunCompletionTasks()
+{
+    for (;;) {
+        while (MpscNode* node = completions_.Pop()) {
+            std::unique_ptr<Completion> completion(static_cast<Completion*>(node));
+            completion->fn();
+        }
+
+        // Completions are pushed before the task that posted them is no
+        // longer pending, so if nothing is pending, the queue is drained.
+        if (!pending_.load()) {
+            if (MpscNode* node = completions_.Pop()) {
+                std::unique_ptr<Completion> completion(static_cast<Completion*>(node));
+                completion->fn();
+                continue;
+            }
+            return;
+        }
+
+        uint64_t key = done_event_.PrepareWait();
+        if (MpscNode* node = completions_.Pop()) {
+            done_event_.CancelWait();
+            std::unique_ptr<Completion> completion(static_cast<Completion*>(node));
+            completion->fn();
+            continue;
+        }
+        if (!pending_.load()) {
+            done_event_.CancelWait();
+            continue;
+        }
+        done_event_.Wait(key);
+    }
+}
+
+void
+ThreadPool::OnComplete(std::function<void()> fn)
+{
+    PushCompletion(std::move(fn));
+}
+
+void
+ThreadPool::PushCompletion(std::function<void()> fn)
+{
+    auto completion = new Completion;
+    completion->fn = std::move(fn);
+    completions_.Push(completion);
+    done_event_.Notify();
+}
+
+void
+ThreadPool::Stop()
+{
+    shutdown_.store(true);
+    work_event_.Notify(true);
+
+    for (const auto& worker : workers_) {
+        if (worker->thread) {
+            worker->thread->join();
+            worker->thread = nullptr;
+        }
+    }
+}
+
+void
+ThreadPool::Work(size_t id)
+{
+    sCurrentPool = this;
+    sCurrentWorker = id;
+
+    while (!shutdown_.load(std::memory_order_acquire)) {
+        PoolTask* task = nullptr;
+        for (int i = 0; i < kSpinCount && !task; i++) {
+            if (i)
+                std::this_thread::yield();
+            task = FindWork(id);
+        }
+        if (task) {
+            Run(task);
+            continue;
+        }
+
+        uint64_t key = work_event_.PrepareWait();
+        if (shutdown_.load()) {
+            work_event_.CancelWait();
+            break;
+        }
+        if ((task = FindWork(id)) != nullptr) {
+            work_event_.CancelWait();
+            Run(task);
+            continue;
+        }
+        work_event_.Wait(key);
+    }
+
+    sCurrentPool = nullptr;
+}
+
+PoolTask*
+ThreadPool::FindWork(size_t id)
+{
+    Worker* self = workers_[id].get();
+    if (PoolTask* task = self->deque.Pop())
+        return task;
+    if (PoolTask* task = PopInjected())
+        return task;
+
+    // Start at a random victim, so thieves don't all pile onto one worker.
+    self->rng ^= self->rng << 13;
+    self->rng ^= self->rng >> 7;
+    self->rng ^= self->rng << 17;
+    size_t start = self->rng % workers_.size();
+    for (size_t i = 0; i < workers_.size(); i++) {
+        size_t victim = (start + i) % workers_.size();
+        if (victim == id)
+            continue;
+        if (PoolTask* task = workers_[victim]->deque.Steal())
+            return task;
+    }
+    return nullptr;
+}
+
+PoolTask*
+ThreadPool::PopInjected()
+{
+    if (!injected_.TryLock())
+        return nullptr;
+    MpscNode* node = injected_.Pop();
+    injected_.Unlock();
+    return static_cast<PoolTask*>(node);
+}
+
+void
+ThreadPool::Run(PoolTask* task)
+{
+    task->fn(this);
+    if (task->completion)
+        PushCompletion(std::move(task->completion));
+    delete task;
+
+    if (pending_.fetch_sub(1) == 1)
+        done_event_.Notify();
+}
+
+} // namespace stone
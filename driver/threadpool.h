@@ -15,111 +15,224 @@
 // limitations under the License.
 #pragma once
 
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
-#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 namespace stone {
 
-class ThreadPool
+class ThreadPool;
+
+// A node in an MpscQueue. Queued types derive from this.
+struct MpscNode
 {
-  public:
-    ThreadPool(unsigned int n) {
-        threads_.resize(n);
-        for (size_t i = 0; i < n; i++) {
-            threads_[i] = std::make_unique<std::thread>([this, i]() -> void {
-                Work(i);
-            });
-        }
-    }
+    std::atomic<MpscNode*> next{nullptr};
+};
 
-    ~ThreadPool() {
-        Stop();
-    }
+// An unbounded, intrusive queue. Any number of threads can push without
+// locking. Only one thread can pop at a time, which callers arrange with
+// TryLock. Based on Dmitry Vyukov's intrusive MPSC queue.
+class MpscQueue
+{
+  public:
+    MpscQueue() : head_(&stub_), tail_(&stub_) {}
 
-    void Do(std::function<void(ThreadPool*)> fn, std::function<void()> completion = {}) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        work_.emplace_back(std::move(fn), std::move(completion));
-        work_cv_.notify_one();
-    }
+    void Push(MpscNode* node);
 
-    void RunCompletionTasks() {
-        std::unique_lock<std::mutex> lock(mutex_);
-        for (;;) {
-            while (completion_.empty()) {
-                if (work_.empty() && !in_progress_)
-                    return;
-                completion_cv_.wait(lock);
-            }
+    // The caller must hold the pop lock. This can return null while a push
+    // is in progress, even though the queue is not empty.
+    MpscNode* Pop();
 
-            auto fn = std::move(completion_.front());
-            completion_.pop_front();
-            lock.unlock();
+    bool TryLock() {
+        return !popping_.exchange(true, std::memory_order_acquire);
+    }
+    void Unlock() {
+        popping_.store(false, std::memory_order_release);
+    }
 
-            fn();
+  private:
+    std::atomic<MpscNode*> head_;
+    MpscNode* tail_;
+    MpscNode stub_;
+    std::atomic<bool> popping_{false};
+};
 
-            lock.lock();
-        }
+// Lets threads sleep until something changes, without the signalling side
+// taking a lock unless a thread is actually asleep. A waiter calls
+// PrepareWait, checks its condition, and then either calls CancelWait or
+// Wait with the returned key. A signaller changes the condition, and then
+// calls Notify.
+class EventCount
+{
+  public:
+    uint64_t PrepareWait() {
+        waiters_.fetch_add(1);
+        return epoch_.load();
     }
-
-    void OnComplete(std::function<void()> fn) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        completion_.emplace_back(std::move(fn));
-        completion_cv_.notify_one();
+    void CancelWait() {
+        waiters_.fetch_sub(1);
     }
+    void Wait(uint64_t key);
+    void Notify(bool all = false);
+
+  private:
+    std::atomic<uint64_t> epoch_{0};
+    std::atomic<uint32_t> waiters_{0};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
 
-    void Stop() {
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            shutdown_ = true;
-        }
-        work_cv_.notify_all();
+struct PoolTask : public MpscNode
+{
+    std::function<void(ThreadPool*)> fn;
+    std::function<void()> completion;
+};
 
-        for (const auto& thread : threads_)
-            thread->join();
-        threads_.clear();
-    }
+// A Chase-Lev work-stealing deque. The owning worker pushes and pops at the
+// bottom, and other workers steal from the top. This follows "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (Le et al., 2013).
+class WorkDeque
+{
+  public:
+    WorkDeque();
 
-    size_t NumThreads() const { return threads_.size(); }
+    // Only the owner may call Push and Pop.
+    void Push(PoolTask* task);
+    PoolTask* Pop();
+
+    // Any thread may steal. This returns null if the deque is empty, or if
+    // another thread took the task first.
+    PoolTask* Steal();
 
   private:
-    void Work(unsigned id) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        for (;;) {
-            while (work_.empty() && !shutdown_)
-                work_cv_.wait(lock);
+    struct Array
+    {
+        explicit Array(size_t size)
+          : mask(size - 1),
+            slots(new std::atomic<PoolTask*>[size])
+        {}
+
+        size_t size() const { return mask + 1; }
+        std::atomic<PoolTask*>& at(int64_t index) { return slots[index & mask]; }
+
+        size_t mask;
+        std::unique_ptr<std::atomic<PoolTask*>[]> slots;
+    };
 
-            if (shutdown_)
-                break;
+    static constexpr size_t kInitialSize = 256;
 
-            auto p = std::move(work_.front());
-            work_.pop_front();
-            in_progress_++;
-            lock.unlock();
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    std::atomic<Array*> array_;
 
-            p.first(this);
-            if (p.second)
-                OnComplete(std::move(p.second));
+    // Arrays that were outgrown are kept, since a thief may still be reading
+    // one. Only the owner touches this.
+    std::vector<std::unique_ptr<Array>> arrays_;
+};
 
-            lock.lock();
+// A work-stealing thread pool. Tasks queued from a worker go on that worker's
+// deque, and tasks queued from any other thread go on a shared injection
+// queue. Idle workers take from their own deque, then the injection queue,
+// then steal from other workers, and spin for a while before parking.
+//
+// Completion functions are run by RunCompletionTasks, on the thread that
+// calls it. Only one thread may call RunCompletionTasks at a time.
+class ThreadPool
+{
+  public:
+    explicit ThreadPool(unsigned int n);
+    ~ThreadPool();
+
+    void Do(std::function<void(ThreadPool*)> fn, std::function<void()> completion = {});
+
+    // Run completion functions until every task has finished and there are
+    // no completions left.
+    void RunCompletionTasks();
+
+    void OnComplete(std::function<void()> fn);
+
+    void Stop();
+
+    // Call fn(0) through fn(count - 1), spreading the calls across the pool,
+    // and wait for them to finish. The calling thread claims work too, so
+    // this is safe to use from inside a task that is already on the pool.
+    void ForEach(size_t count, const std::function<void(size_t)>& fn) {
+        if (!count)
+            return;
+
+        struct State {
+            std::atomic<size_t> next{0};
+            size_t done = 0;
+            std::mutex mutex;
+            std::condition_variable cv;
+        };
+        auto state = std::make_shared<State>();
+
+        // Helpers may start after every index has been claimed, and even after
+        // we've returned, so they only touch |fn| once they've claimed one.
+        auto run = [state, count, fn_ptr = &fn]() -> void {
+            size_t ran = 0;
+            for (size_t i = state->next++; i < count; i = state->next++) {
+                (*fn_ptr)(i);
+                ran++;
+            }
+            if (!ran)
+                return;
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->done += ran;
+            if (state->done == count)
+                state->cv.notify_all();
+        };
+
+        size_t helpers = std::min(count, workers_.size() + 1) - 1;
+        for (size_t i = 0; i < helpers; i++)
+            Do([run](ThreadPool*) -> void { run(); });
+        run();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (state->done < count)
+            state->cv.wait(lock);
+    }
+
+    size_t NumThreads() const { return workers_.size(); }
 
-            in_progress_--;
-            completion_cv_.notify_one();
-        }
+  private:
+    struct Worker
+    {
+        std::unique_ptr<std::thread> thread;
+        WorkDeque deque;
+        uint64_t rng;
+    };
+
+    struct Completion : public MpscNode
+    {
+        std::function<void()> fn;
     };
 
+    void Work(size_t id);
+    PoolTask* FindWork(size_t id);
+    PoolTask* PopInjected();
+    void Run(PoolTask* task);
+    void PushCompletion(std::function<void()> fn);
+
   private:
-    bool shutdown_ = false;
-    size_t in_progress_ = 0;
-    std::mutex mutex_;
-    std::condition_variable work_cv_;
-    std::condition_variable completion_cv_;
-    std::vector<std::unique_ptr<std::thread>> threads_;
-    std::deque<std::pair<std::function<void(ThreadPool*)>,
-                         std::function<void()>>> work_;
-    std::deque<std::function<void()>> completion_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    MpscQueue injected_;
+    MpscQueue completions_;
+    EventCount work_event_;
+    EventCount done_event_;
+
+    // Tasks that have been queued but have not finished running.
+    std::atomic<size_t> pending_{0};
+    std::atomic<bool> shutdown_{false};
 };
 
 } // namespace stone
@@ -17,6 +17,7 @@
 #include <libgen.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <spawn.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -28,6 +29,8 @@
 #include <ctime>
 #include <utility>
 
+#include <openssl/sha.h>
+
 #include <amtl/am-string.h>
 #include <amtl/am-time.h>
 #include "logging.h"
@@ -93,6 +96,51 @@ NextDay(const Date& d)
     return d + 1;
 }
 
+void
+ContentHash::Add(double value)
+{
+    buffer_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void
+ContentHash::Add(int value)
+{
+    buffer_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void
+ContentHash::Add(std::string_view value)
+{
+    // Length-prefix strings so that adjacent strings can't run together.
+    Add((int)value.size());
+    buffer_.append(value);
+}
+
+uint64_t
+ContentHash::Hash() const
+{
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char*)buffer_.data(), buffer_.size(), hash);
+
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return key;
+}
+
+int
+DayNumber(const Date& d)
+{
+    auto ymd = date::year_month_day(date::year(d.year()), date::month(d.month()),
+                                    date::day(d.day()));
+    return date::sys_days{ymd}.time_since_epoch().count();
+}
+
+Date
+DateFromDayNumber(int day)
+{
+    return FromYmd(date::year_month_day(date::sys_days{date::days{day}}));
+}
+
 bool
 ParseYyyyMmDd(std::string_view text, Date* date)
 {
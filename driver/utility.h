@@ -17,6 +17,7 @@
 
 #include <errno.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
 
@@ -54,6 +55,26 @@ bool GetFileModTime(std::string_view path, FileTime* time);
 bool DaysBetween(const Date& first, const Date& second, int* diff);
 int DaysBetween(const Date& first, const Date& second);
 
+// Return the number of days since the Unix epoch. Comparing day numbers is
+// cheaper than comparing Dates.
+int DayNumber(const Date& d);
+Date DateFromDayNumber(int day);
+
+// Accumulates values into a stable 64-bit content hash, suitable for keys
+// that are saved across runs.
+class ContentHash
+{
+  public:
+    void Add(double value);
+    void Add(int value);
+    void Add(std::string_view value);
+
+    uint64_t Hash() const;
+
+  private:
+    std::string buffer_;
+};
+
 int64_t GetUtcTime();
 int64_t UtcToLocal(int64_t value);
 
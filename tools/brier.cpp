@@ -1,10 +1,10 @@
 // vim: set sts=4 ts=8 sw=4 tw=99 et:
-#include <fstream>
 #include <iostream>
 #include <string>
 #include <unordered_map>
 
 #include <proto/history.pb.h>
+#include "history-store.h"
 
 using namespace stone;
 
@@ -36,24 +36,20 @@ int main(int argc, char** argv)
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 
     if (argc < 2) {
-        std::cerr << "Usage: <campaign-history.bin>\n";
+        std::cerr << "Usage: <campaign-history.dat>\n";
         return 1;
     }
 
-    std::fstream input(argv[1], std::ios::in | std::ios::binary);
-    if (!input) {
-        std::cerr << "error opening: " << argv[1] << "\n";
+    HistoryReader reader;
+    if (!reader.Open(argv[1]))
         return 1;
-    }
-
-    CampaignData data;
-    if (!data.ParseFromIstream(&input)) {
-        std::cerr << "error parsing: " << argv[1] << "\n";
-        return 1;
-    }
 
+    // Decode one day at a time, since only the predictions are used.
     ProbMap map;
-    for (const auto& day : data.history()) {
+    for (size_t i = 0; i < reader.num_days(); i++) {
+        ModelData day;
+        if (!reader.ReadDay(i, &day))
+            return 1;
         if (day.has_ec_prediction())
             AddPrediction(&map, "ec", day.ec_prediction());
         if (day.has_senate_prediction())
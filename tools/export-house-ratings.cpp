@@ -1,5 +1,4 @@
 // vim: set sts=4 ts=8 sw=4 tw=99 et:
-#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -8,6 +7,7 @@
 #include <date/date.h>
 #include <google/protobuf/text_format.h>
 #include <proto/history.pb.h>
+#include "history-store.h"
 
 using namespace std::string_literals;
 using namespace stone;
@@ -31,25 +31,20 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    std::string path = argv[1] + "/history.bin"s;
-    std::fstream input(path, std::ios::in | std::ios::binary);
-    if (!input) {
-        std::cerr << "error opening: " << path << "\n";
+    std::string path = argv[1] + "/"s + kHistoryFile;
+    HistoryReader reader;
+    if (!reader.Open(path))
         return 1;
-    }
-
-    CampaignData data;
-    if (!data.ParseFromIstream(&input)) {
-        std::cerr << "error parsing: " << path << "\n";
-        return 1;
-    }
 
     HouseRatingHistory history;
     std::map<int32_t, std::pair<std::string, std::string>> prev_ratings;
     std::map<int32_t, std::pair<std::string, std::string>> ratings;
 
-    for (auto iter = data.history().rbegin(); iter != data.history().rend(); iter++) {
-        const auto& model = *iter;
+    // Days are stored newest first. Decode them oldest first, one at a time.
+    ModelData model;
+    for (size_t i = reader.num_days(); i-- > 0;) {
+        if (!reader.ReadDay(i, &model))
+            return 1;
 
         ratings.clear();
         for (const auto& rm : model.house_races()) {
@@ -3,12 +3,43 @@ import argparse
 import datetime
 import matplotlib.pyplot as plt
 import matplotlib.dates as mdates
+import mmap
 import numpy as np
+import struct
 import sys
 
 import state_pb2
 import history_pb2
 
+# See driver/history-store.h for the file layout.
+HISTORY_HEADER = struct.Struct('<4sIQII')
+RECORD_PREFIX = struct.Struct('<I')
+
+# Days after |end_date| are left out, except for the newest day, which holds
+# the final results. Only the index is read for them.
+def read_history(path, end_date=None):
+    with open(path, 'rb') as fp:
+        with mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+            magic, version, index_offset, index_length, _ = HISTORY_HEADER.unpack_from(mm, 0)
+            if magic != b'STNH' or version != 1:
+                raise Exception('{} is not a history file'.format(path))
+
+            def read_record(offset, length, msg):
+                if RECORD_PREFIX.unpack_from(mm, offset)[0] != length:
+                    raise Exception('Bad record at offset {}'.format(offset))
+                start = offset + RECORD_PREFIX.size
+                msg.ParseFromString(mm[start : start + length])
+                return msg
+
+            index = read_record(index_offset, index_length, history_pb2.HistoryIndex())
+            cd = read_record(index.campaign.offset, index.campaign.length,
+                             history_pb2.CampaignData())
+            for i, record in enumerate(index.days):
+                if i > 0 and end_date is not None and get_proto_date(record.date) > end_date:
+                    continue
+                read_record(record.offset, record.length, cd.history.add())
+            return cd
+
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument('history_file', type=str, help='History file')
@@ -16,10 +47,6 @@ def main():
                         choices=['bias', 'score', 'vote_share', 'batch'])
     args = parser.parse_args(sys.argv[1:3])
 
-    cd = history_pb2.CampaignData()
-    with open(args.history_file, 'rb') as fp:
-        cd.ParseFromString(fp.read())
-
     commands = []
     if args.graph_type == 'batch':
         cursor = 3
@@ -47,13 +74,17 @@ def main():
     if len(commands) == 0:
         raise Exception('No commands given')
 
-    for graph_type, race_type, end_date_str, output_file in commands:
+    end_dates = []
+    for _, _, end_date_str, _ in commands:
         parts = end_date_str.split('-')
         if len(parts) != 3:
             raise Exception('Date format must be M-D-Y')
         parts = [int(part) for part in parts]
-        end_date = datetime.date(parts[2], parts[0], parts[1])
+        end_dates.append(datetime.date(parts[2], parts[0], parts[1]))
+
+    cd = read_history(args.history_file, max(end_dates))
 
+    for (graph_type, race_type, _, output_file), end_date in zip(commands, end_dates):
         if graph_type == 'score':
             grapher = ScoreGrapher(cd, end_date, race_type)
         elif graph_type == 'bias':
@@ -362,7 +393,7 @@ class VoteShareGrapher(Grapher):
         dem_data, gop_data = [], []
         for dp in self.datapoints_:
             model = self.fetch_model_(dp)
-            if not len(model.polls):
+            if not len(model.poll_refs):
                 continue
             x_data.append(get_proto_date(dp.date))
             dem_data.append(model.dem_average)
@@ -1,7 +1,6 @@
 // vim: set sts=4 ts=8 sw=4 tw=99 et:
 #include <math.h>
 
-#include <fstream>
 #include <iostream>
 #include <limits>
 #include <string>
@@ -10,6 +9,7 @@
 #include <amtl/am-string.h>
 #include <date/date.h>
 #include <proto/history.pb.h>
+#include "history-store.h"
 
 using namespace std::string_literals;
 using namespace stone;
@@ -23,18 +23,15 @@ int main(int argc, char** argv)
 
     std::vector<CampaignData> campaigns;
     for (int i = 1; i < argc; i++) {
-        std::string path = argv[i] + "/history.bin"s;
-        std::fstream input(path, std::ios::in | std::ios::binary);
-        if (!input) {
-            std::cerr << "error opening: " << path << "\n";
+        std::string path = argv[i] + "/"s + kHistoryFile;
+        HistoryReader reader;
+        if (!reader.Open(path))
             return 1;
-        }
 
+        // Only the summarized fields of each day are used.
         CampaignData data;
-        if (!data.ParseFromIstream(&input)) {
-            std::cerr << "error parsing: " << path << "\n";
+        if (!reader.ReadSummaries(&data))
             return 1;
-        }
         campaigns.emplace_back(std::move(data));
     }
     if (campaigns.empty()) {